@@ -26,14 +26,17 @@
 #define SGL_H_DEFINED
 
 // C includes
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdint.h>
 #include <inttypes.h>
+#include <locale.h>
 #include <stdlib.h>
 #include <string.h>
 #ifdef __MACH__
 #include <mach/clock.h>
 #include <mach/mach.h>
+#include <mach/mach_time.h>
 #include <sys/time.h>
 #endif
 #if defined(_WIN32)
@@ -43,11 +46,43 @@
 #include<time.h>
 #endif
 #if defined(__linux__) || defined(__MACH__)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 #include <unistd.h>
 #endif
+#if defined(__MACH__)
+#include <sys/sysctl.h>
+#include <xlocale.h>
+#endif
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+#include <cpuid.h>
+#include <x86intrin.h>
+#endif
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#endif
+#if defined(__AVX2__)
+#include <immintrin.h>
+#endif
 
 // C++ includes
+#include <atomic>
+#include <cmath>
+#include <condition_variable>
+#include <cstddef>
 #include <initializer_list>
+#include <limits>
+#include <mutex>
+#include <new>
+#include <thread>
+#include <type_traits>
+#include <utility>
 
 
 // I don't like double negations
@@ -90,63 +125,406 @@ namespace sgl {
 ////////////////////////////////////////////////////////////////////////////////
 
 /*
-* Get the size of o L1 cache line.
-* Returns 0 for platforms not yet supported.
-*/
-size_t cache_line_size()  {
+ * Compile-time guess for the L1 line size. Containers use this instead of
+ * cpu_info() so that constructing one never touches the OS.
+ * Define SGL_CACHE_LINE_SIZE before including sgl.h to override it.
+ */
+#ifndef SGL_CACHE_LINE_SIZE
+#define SGL_CACHE_LINE_SIZE 64
+#endif
+static const size_t compile_time_cache_line_size = SGL_CACHE_LINE_SIZE;
+
+/*
+ * Cache and core topology. Sizes are in bytes.
+ * Fields that could not be detected are 0, except for the line sizes, the
+ * core counts and numa_nodes, which fall back to sane defaults.
+ */
+struct CpuInfo {
+    size_t l1d_size;
+    size_t l1d_line_size;
+    size_t l2_size;
+    size_t l2_line_size;
+    size_t l3_size;
+    size_t l3_line_size;
+    size_t logical_cores;
+    size_t physical_cores;
+    size_t numa_nodes;
+};
+
+namespace detail {
+
 #if defined(__linux__)
-    FILE * p = 0;
-    p = fopen("/sys/devices/system/cpu/cpu0/cache/index0/coherency_line_size", "r");
-    size_t i = 0;
-    if (p) {
-        fscanf(p, "%zd", &i);
-        fclose(p);
+// Reads a sysfs file holding one value, like "64" or "32K".
+inline size_t read_sysfs_size(const char* path) {
+    FILE* fd = fopen(path, "r");
+    if (!fd) {
+        return 0;
     }
-    return i;
-#elif defined(_WIN32)
-    static size_t memoized_size = 0;
-    if (memoized_size) {
-        return memoized_size;
+    unsigned long long value = 0;
+    char suffix = 0;
+    int read = fscanf(fd, "%llu%c", &value, &suffix);
+    fclose(fd);
+    if (read < 1) {
+        return 0;
+    }
+    if (suffix == 'K') value *= 1024;
+    if (suffix == 'M') value *= 1024 * 1024;
+    return (size_t)value;
+}
+
+// Counts the entries of a cpu list like "0-3,8,10-11".
+inline size_t read_sysfs_list_count(const char* path) {
+    FILE* fd = fopen(path, "r");
+    if (!fd) {
+        return 0;
+    }
+    size_t count = 0;
+    unsigned lo = 0, hi = 0;
+    int c = 0;
+    while (fscanf(fd, "%u", &lo) == 1) {
+        hi = lo;
+        c = fgetc(fd);
+        if (c == '-') {
+            if (fscanf(fd, "%u", &hi) != 1) break;
+            c = fgetc(fd);
+        }
+        count += hi - lo + 1;
+        if (c != ',') break;
+    }
+    fclose(fd);
+    return count;
+}
+
+inline void detect_cpu_info_sysfs(CpuInfo* info) {
+    char path[128];
+    for (int i = 0; i < 16; ++i) {
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu0/cache/index%d/level", i);
+        size_t level = read_sysfs_size(path);
+        if (!level) {
+            break;
+        }
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu0/cache/index%d/type", i);
+        char type = 0;
+        FILE* fd = fopen(path, "r");
+        if (fd) {
+            type = (char)fgetc(fd);
+            fclose(fd);
+        }
+        if (type == 'I') {  // Instruction cache. Don't care.
+            continue;
+        }
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu0/cache/index%d/size", i);
+        size_t size = read_sysfs_size(path);
+        snprintf(path, sizeof(path),
+                 "/sys/devices/system/cpu/cpu0/cache/index%d/coherency_line_size", i);
+        size_t line = read_sysfs_size(path);
+        switch (level) {
+        case 1: info->l1d_size = size; info->l1d_line_size = line; break;
+        case 2: info->l2_size  = size; info->l2_line_size  = line; break;
+        case 3: info->l3_size  = size; info->l3_line_size  = line; break;
+        default: break;
+        }
     }
-    size_t size = 0;
+
+    long num_online = sysconf(_SC_NPROCESSORS_ONLN);
+    info->logical_cores = num_online > 0 ? (size_t)num_online : 0;
+
+    // Physical cores are the distinct (package, core) pairs.
+    static const size_t max_cpus = 1024;
+    uint64_t cores[max_cpus];
+    size_t num_cores = 0;
+    long num_conf = sysconf(_SC_NPROCESSORS_CONF);
+    for (long cpu = 0; cpu < num_conf && cpu < (long)max_cpus; ++cpu) {
+        snprintf(path, sizeof(path),
+                 "/sys/devices/system/cpu/cpu%ld/topology/physical_package_id", cpu);
+        FILE* fd = fopen(path, "r");
+        if (!fd) {
+            continue;  // Offline.
+        }
+        int package = 0;
+        int core = 0;
+        int read = fscanf(fd, "%d", &package);
+        fclose(fd);
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%ld/topology/core_id", cpu);
+        fd = fopen(path, "r");
+        if (!fd || read != 1) {
+            if (fd) fclose(fd);
+            continue;
+        }
+        read = fscanf(fd, "%d", &core);
+        fclose(fd);
+        if (read != 1) {
+            continue;
+        }
+        const uint64_t id = ((uint64_t)(uint32_t)package << 32) | (uint32_t)core;
+        bool seen = false;
+        for (size_t j = 0; j < num_cores; ++j) {
+            if (cores[j] == id) { seen = true; break; }
+        }
+        if (!seen) {
+            cores[num_cores++] = id;
+        }
+    }
+    info->physical_cores = num_cores;
+
+    info->numa_nodes = read_sysfs_list_count("/sys/devices/system/node/online");
+}
+#endif  // __linux__
+
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+// Only used when the OS didn't tell us. Leaf 4 is the Intel deterministic
+// cache parameters leaf; leaf 1 gives the clflush line size everywhere.
+inline void detect_cpu_info_cpuid(CpuInfo* info) {
+    unsigned eax = 0, ebx = 0, ecx = 0, edx = 0;
+    if (!__get_cpuid(0, &eax, &ebx, &ecx, &edx)) {
+        return;
+    }
+    const unsigned max_leaf = eax;
+    if (max_leaf >= 4) {
+        for (unsigned sub = 0; sub < 16; ++sub) {
+            __cpuid_count(4, sub, eax, ebx, ecx, edx);
+            const unsigned type = eax & 0x1f;
+            if (type == 0) break;
+            if (type == 2) continue;  // Instruction cache.
+            const unsigned level = (eax >> 5) & 0x7;
+            const size_t line  = (ebx & 0xfff) + 1;
+            const size_t parts = ((ebx >> 12) & 0x3ff) + 1;
+            const size_t ways  = ((ebx >> 22) & 0x3ff) + 1;
+            const size_t sets  = (size_t)ecx + 1;
+            const size_t size  = line * parts * ways * sets;
+            switch (level) {
+            case 1: if (!info->l1d_size) { info->l1d_size = size; info->l1d_line_size = line; } break;
+            case 2: if (!info->l2_size)  { info->l2_size  = size; info->l2_line_size  = line; } break;
+            case 3: if (!info->l3_size)  { info->l3_size  = size; info->l3_line_size  = line; } break;
+            default: break;
+            }
+        }
+    }
+    if (!info->l1d_line_size && __get_cpuid(1, &eax, &ebx, &ecx, &edx)) {
+        info->l1d_line_size = ((ebx >> 8) & 0xff) * 8;
+    }
+}
+#endif
+
+#if defined(__MACH__)
+inline size_t sysctl_size(const char* name) {
+    uint64_t value = 0;
+    size_t len = sizeof(value);
+    if (sysctlbyname(name, &value, &len, NULL, 0) != 0) {
+        return 0;
+    }
+    // Some of these are 32 bit.
+    return len == sizeof(uint32_t) ? (size_t)(uint32_t)value : (size_t)value;
+}
+#endif
+
+inline CpuInfo detect_cpu_info() {
+    CpuInfo info;
+    memset(&info, 0, sizeof(info));
+#if defined(__linux__)
+    detect_cpu_info_sysfs(&info);
+#elif defined(_WIN32)
     DWORD buffer_size = 0;
-    SYSTEM_LOGICAL_PROCESSOR_INFORMATION* buffer = NULL;
     GetLogicalProcessorInformation(0, &buffer_size);
-    buffer = (SYSTEM_LOGICAL_PROCESSOR_INFORMATION*) malloc(buffer_size);
-    GetLogicalProcessorInformation(&buffer[0], &buffer_size);
-    for (DWORD i = 0; i != buffer_size / sizeof(SYSTEM_LOGICAL_PROCESSOR_INFORMATION); ++i) {
-        if (buffer && buffer[i].Relationship == RelationCache && buffer[i].Cache.Level == 1) {
-            size = buffer[i].Cache.LineSize;
-            break;
+    SYSTEM_LOGICAL_PROCESSOR_INFORMATION* buffer =
+        (SYSTEM_LOGICAL_PROCESSOR_INFORMATION*) malloc(buffer_size);
+    if (buffer && GetLogicalProcessorInformation(&buffer[0], &buffer_size)) {
+        for (DWORD i = 0; i != buffer_size / sizeof(SYSTEM_LOGICAL_PROCESSOR_INFORMATION); ++i) {
+            const SYSTEM_LOGICAL_PROCESSOR_INFORMATION& e = buffer[i];
+            if (e.Relationship == RelationCache && e.Cache.Type != CacheInstruction) {
+                switch (e.Cache.Level) {
+                case 1: info.l1d_size = e.Cache.Size; info.l1d_line_size = e.Cache.LineSize; break;
+                case 2: info.l2_size  = e.Cache.Size; info.l2_line_size  = e.Cache.LineSize; break;
+                case 3: info.l3_size  = e.Cache.Size; info.l3_line_size  = e.Cache.LineSize; break;
+                default: break;
+                }
+            } else if (e.Relationship == RelationProcessorCore) {
+                info.physical_cores++;
+                for (ULONG_PTR mask = e.ProcessorMask; mask; mask &= mask - 1) {
+                    info.logical_cores++;
+                }
+            } else if (e.Relationship == RelationNumaNode) {
+                info.numa_nodes++;
+            }
         }
     }
     free(buffer);
-    memoized_size = size;
-    return size;
 #elif defined(__MACH__)
-    return 64;  // What could possibly go wrong?
-#else
-    return 0;
+    info.l1d_size       = sysctl_size("hw.l1dcachesize");
+    info.l2_size        = sysctl_size("hw.l2cachesize");
+    info.l3_size        = sysctl_size("hw.l3cachesize");
+    info.l1d_line_size  = sysctl_size("hw.cachelinesize");
+    info.logical_cores  = sysctl_size("hw.logicalcpu");
+    info.physical_cores = sysctl_size("hw.physicalcpu");
 #endif
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+    detect_cpu_info_cpuid(&info);
+#endif
+    // Fill the holes.
+    if (!info.l1d_line_size)  info.l1d_line_size  = compile_time_cache_line_size;
+    if (!info.l2_line_size)   info.l2_line_size   = info.l1d_line_size;
+    if (!info.l3_line_size)   info.l3_line_size   = info.l2_line_size;
+    if (!info.logical_cores)  info.logical_cores  = 1;
+    if (!info.physical_cores) info.physical_cores = info.logical_cores;
+    if (!info.numa_nodes)     info.numa_nodes     = 1;
+    return info;
+}
+
+}  // namespace detail
+
+/*
+ * Processor topology. Detected on the first call, cached for the lifetime of
+ * the process. Thread safe.
+ */
+inline const CpuInfo& cpu_info() {
+    static const CpuInfo info = detail::detect_cpu_info();
+    return info;
+}
 
+/*
+ * Get the size of o L1 cache line.
+ * Never returns 0: falls back to SGL_CACHE_LINE_SIZE when detection fails.
+ */
+inline size_t cache_line_size() {
+    return cpu_info().l1d_line_size;
 }
 
-long get_nanoseconds() {
+////////////////////////////////////////////////////////////////////////////////
+// Time
+////////////////////////////////////////////////////////////////////////////////
+
+/*
+ * Monotonic clock. Never jumps with NTP or with the wall clock.
+ */
+class Clock {
+public:
+    /*
+     * Nanoseconds since an unspecified epoch.
+     * Linux: CLOCK_MONOTONIC_RAW. OS X: mach_absolute_time. Windows: QPC.
+     */
+    static uint64_t now_ns() {
 #if defined(__linux__)
-    struct timespec tp;
-    clock_gettime(CLOCK_REALTIME, &tp);
-    return tp.tv_nsec;
+        struct timespec tp;
+#if defined(CLOCK_MONOTONIC_RAW)
+        clock_gettime(CLOCK_MONOTONIC_RAW, &tp);
+#else
+        clock_gettime(CLOCK_MONOTONIC, &tp);
+#endif
+        return (uint64_t)tp.tv_sec * 1000000000ull + (uint64_t)tp.tv_nsec;
 #elif defined(__MACH__)
-    struct timespec tp;
-    clock_serv_t cclock;
-    mach_timespec_t mts;
-    host_get_clock_service(mach_host_self(), CALENDAR_CLOCK, &cclock);
-    clock_get_time(cclock, &mts);
-    mach_port_deallocate(mach_task_self(), cclock);
-    tp.tv_sec = mts.tv_sec;
-    tp.tv_nsec = mts.tv_nsec;
-    return tp.tv_nsec;
+        static const mach_timebase_info_data_t timebase = mach_timebase();
+        return mach_absolute_time() * timebase.numer / timebase.denom;
+#elif defined(_WIN32)
+        static const uint64_t freq = qpc_frequency();
+        LARGE_INTEGER counter;
+        QueryPerformanceCounter(&counter);
+        const uint64_t c = (uint64_t)counter.QuadPart;
+        // Split to avoid overflowing the multiplication.
+        return (c / freq) * 1000000000ull + ((c % freq) * 1000000000ull) / freq;
+#else
+        return 0;
+#endif
+    }
+
+    /*
+     * Raw time stamp counter on x86 (rdtsc), now_ns() elsewhere.
+     * Cheaper than now_ns() but in ticks; use ns_per_tick() to convert.
+     * Only trustworthy on CPUs with an invariant TSC.
+     */
+    static uint64_t ticks() {
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+        return __rdtsc();
+#elif (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+        return __rdtsc();
+#else
+        return now_ns();
+#endif
+    }
+
+    /*
+     * Calibrated against now_ns() the first time it's called (takes ~10ms).
+     */
+    static double ns_per_tick() {
+        static const double ratio = calibrate();
+        return ratio;
+    }
+
+    static uint64_t ticks_to_ns(uint64_t ticks) {
+        return (uint64_t)((double)ticks * ns_per_tick());
+    }
+
+private:
+    // The constants now_ns() scales by, set once under the static's guard.
+#if defined(__MACH__)
+    static mach_timebase_info_data_t mach_timebase() {
+        mach_timebase_info_data_t timebase;
+        mach_timebase_info(&timebase);
+        return timebase;
+    }
+#elif defined(_WIN32)
+    static uint64_t qpc_frequency() {
+        LARGE_INTEGER frequency;
+        QueryPerformanceFrequency(&frequency);
+        return (uint64_t)frequency.QuadPart;
+    }
 #endif
+
+    static double calibrate() {
+        const uint64_t ns_begin    = now_ns();
+        const uint64_t ticks_begin = ticks();
+        uint64_t ns_end = ns_begin;
+        while (ns_end - ns_begin < 10000000) {
+            ns_end = now_ns();
+        }
+        const uint64_t ticks_end = ticks();
+        if (ticks_end == ticks_begin) {
+            return 1.0;
+        }
+        return (double)(ns_end - ns_begin) / (double)(ticks_end - ticks_begin);
+    }
+};
+
+/*
+ * Measure elapsed time.
+ *
+ * Stopwatch watch;
+ * do_stuff();
+ * printf("%f ms\n", watch.elapsed_ms());
+ */
+class Stopwatch {
+public:
+    /**
+     * use_tsc: read the time stamp counter instead of the OS clock.
+     */
+    explicit Stopwatch(bool use_tsc = false) : m_use_tsc(use_tsc) {
+        restart();
+    }
+
+    void restart() {
+        m_start = m_use_tsc ? Clock::ticks() : Clock::now_ns();
+    }
+
+    uint64_t elapsed_ns() const {
+        if (m_use_tsc) {
+            return Clock::ticks_to_ns(Clock::ticks() - m_start);
+        }
+        return Clock::now_ns() - m_start;
+    }
+
+    double elapsed_ms() const {
+        return (double)elapsed_ns() / 1e6;
+    }
+
+private:
+    uint64_t m_start;
+    bool     m_use_tsc;
+};
+
+/*
+ * Deprecated. Use Clock::now_ns().
+ */
+inline uint64_t get_nanoseconds() {
+    return Clock::now_ns();
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -167,376 +545,7128 @@ private:
     Noncopyable& operator=(const Noncopyable&);
 };
 
-////////////////////////////////////////////////////////////////////////////////
-// Output
-////////////////////////////////////////////////////////////////////////////////
-template<typename T>
-void dbg(const T& that) {
-    printf("%s", that.str());
-}
+template <typename T> class Maybe;
 
-template<typename T>
-void dbg(const std::initializer_list<T>& list) {
-    for(auto it = list.begin(); it != list.end(); it++) {
-        dbg(*it);
-        if(it != list.end() - 1) {
-            printf(" ");
-        }
-    }
-}
+namespace detail {
+template <typename T> struct is_maybe : std::false_type {};
+template <typename T> struct is_maybe<Maybe<T>> : std::true_type {};
+
+// What Maybe::map returns for a function returning R. References stay
+// references, so map can reach into a value without copying.
+template <typename R>
+struct MaybeResult {
+    typedef Maybe<typename std::remove_cv<R>::type> type;
+};
+}  // namespace detail
 
 /**
  * Class to avoid exceptions and prevent NULL usage.
  *
  * Example:
  *
- * int parse_this_int(const string&);
- * ...
- * Maybe<int> i = parse_this_int(const string &str);
+ * Maybe<int64_t> i = parse<int64_t>(str);
  *
  * if (i.valid()) {
  *     use_int(i.value());
  * } else {
  *     // handle parse error.
  * }
+ *
+ * The value lives in raw storage inside the Maybe: an empty Maybe
+ * constructs nothing, and T doesn't need a default constructor.
+ *
+ * Maybe<T&> holds a pointer instead. Containers use it to hand out
+ * elements without copying them.
+ *
+ * map(f) is Maybe(f(value)) or empty, and_then(f) is f(value) or empty
+ * (f returns a Maybe), value_or(x) is value or x.
  */
-template <typename T>
-class Maybe {
-public:
-    Maybe() : m_is_valid(false) {}
-    Maybe(const T& that) : m_value(that), m_is_valid(true) {}
-    Maybe(const Maybe &that) : m_value(that.m_value), m_is_valid(that.m_is_valid) {}
-    Maybe<T>& operator=(const Maybe<T>& that) {
-        this->m_is_valid = that.m_is_valid;
-        this->m_value = that.m_value;
-        return *this;
-    }
+namespace detail {
 
-    bool valid() const { return m_is_valid; }
+// Storage and lifetime for Maybe. For trivially copyable, trivially
+// destructible T the copies and the destructor are the implicit ones, so
+// Maybe<int> is trivially copyable too and comes back from a function in
+// registers.
+template <typename T, bool Trivial = std::is_trivially_copyable<T>::value &&
+                                     std::is_trivially_destructible<T>::value>
+class MaybeStorage {
+protected:
+    MaybeStorage() : m_is_valid(false) {}
 
-    /**
-     * Usage:
-     * if (m.valid()) some_function(m.value());
-     */
-    const T& value() const {
-        sgl_assert(m_is_valid);
-        return m_value;
+    MaybeStorage(const MaybeStorage& that) : m_is_valid(that.m_is_valid) {
+        if (m_is_valid) {
+            new (m_storage) T(that.get());
+        }
     }
 
-private:
-    T m_value;
-    bool m_is_valid;
-};
-
-/**
- * Simple scoped pointers. Call delete and delete[] respectively.
- */
-template<typename T>
-class ScopedPtr : public Noncopyable {
-    public:
-    ScopedPtr(T* ptr) : m_ptr(ptr) {}
-    ScopedPtr(const T* ptr) : m_ptr(ptr) {}
+    MaybeStorage(MaybeStorage&& that) : m_is_valid(that.m_is_valid) {
+        if (m_is_valid) {
+            new (m_storage) T(std::move(that.get()));
+        }
+    }
 
-    T& operator*() const { return *m_ptr; }
-    T* operator->() const { return m_ptr; }
+    ~MaybeStorage() {
+        reset();
+    }
 
-    T* get() const { m_ptr; }
+    MaybeStorage& operator=(const MaybeStorage& that) {
+        if (m_is_valid && that.m_is_valid) {
+            get() = that.get();
+        } else if (that.m_is_valid) {
+            new (m_storage) T(that.get());
+            m_is_valid = true;
+        } else {
+            reset();
+        }
+        return *this;
+    }
 
-    T* detach() {
-        T* detached = m_ptr;
-        m_ptr = NULL;
-        return detached;
+    MaybeStorage& operator=(MaybeStorage&& that) {
+        if (m_is_valid && that.m_is_valid) {
+            get() = std::move(that.get());
+        } else if (that.m_is_valid) {
+            new (m_storage) T(std::move(that.get()));
+            m_is_valid = true;
+        } else {
+            reset();
+        }
+        return *this;
     }
-private:
-    ScopedPtr() {}
-    ScopedPtr(T) {}
-    T* m_ptr;
 
-public:
-    virtual ~ScopedPtr() {
-        if (m_ptr) {
-            delete m_ptr;
+    void reset() {
+        if (m_is_valid) {
+            get().~T();
+            m_is_valid = false;
         }
     }
+
+    T& get() { return *reinterpret_cast<T*>(m_storage); }
+    const T& get() const { return *reinterpret_cast<const T*>(m_storage); }
+
+    alignas(T) unsigned char m_storage[sizeof(T)];
+    bool m_is_valid;
 };
 
-template<typename T>
-class ScopedArray : public Noncopyable {
-    public:
-    ScopedArray(T* ptr) : m_ptr(ptr) {}
-    ScopedArray(const T* ptr) : m_ptr(ptr) {}
+template <typename T>
+class MaybeStorage<T, true> {
+protected:
+    MaybeStorage() : m_is_valid(false) {}
 
-    T& operator*() const { return *m_ptr; }
-    T* operator->() const { return m_ptr; }
+    void reset() { m_is_valid = false; }
 
-    T* get() const { m_ptr; }
+    T& get() { return *reinterpret_cast<T*>(m_storage); }
+    const T& get() const { return *reinterpret_cast<const T*>(m_storage); }
 
-    T* detach() {
-        T* detached = m_ptr;
-        m_ptr = NULL;
-        return detached;
-    }
-private:
-    ScopedArray() {}
-    ScopedArray(T) {}
-    T* m_ptr;
-public:
-    virtual ~ScopedArray() {
-        if (m_ptr) {
-            delete[] m_ptr;
-        }
-    }
+    alignas(T) unsigned char m_storage[sizeof(T)];
+    bool m_is_valid;
 };
 
-////////////////////////////////////////////////////////////////////////////////
+}  // namespace detail
 
-////////////////////////////////////////////////////////////////////////////////
-// Generic data structures
-////////////////////////////////////////////////////////////////////////////////
-/**
- * Array class designed to be faster than std::vector
- * Windows: push_back is faster in general but really kicks ass as the size grows.
- */
 template <typename T>
-class Array {
+class Maybe : private detail::MaybeStorage<T> {
+    typedef detail::MaybeStorage<T> Storage;
+    using Storage::get;
+    using Storage::m_storage;
+    using Storage::m_is_valid;
+
 public:
-    /**
-     * Allocates space for at least num elements.
-     */
-    explicit Array(size_t reserve) :
-        m_num_elements(0) {
-        sgl_assert(reserve > 0);
-        m_size = friendly_array_size(reserve);
-        m_storage = new T[m_size];
+    typedef T value_type;
+
+    Maybe() {}
+    Maybe(const T& that) {
+        new (m_storage) T(that);
+        m_is_valid = true;
+    }
+    Maybe(T&& that) {
+        new (m_storage) T(std::move(that));
+        m_is_valid = true;
     }
 
-    Array(std::initializer_list<T> list) : m_num_elements(0) {
-        sgl_assert(list.size() > 0);
-        m_size = friendly_array_size(list.size());
-        m_storage = new T[m_size];
-        for (const auto e : list) {
-            this->push_back(e);
+    /**
+     * Copies out what a Maybe<U&> refers to.
+     */
+    template <typename U,
+              typename = typename std::enable_if<std::is_constructible<T, U&>::value>::type>
+    Maybe(const Maybe<U&>& that) {
+        if (that.valid()) {
+            new (m_storage) T(that.value());
+            m_is_valid = true;
         }
     }
 
-    Array(const Array<T>& other) {
-        this->m_size         = other.m_size;
-        this->m_num_elements = other.m_num_elements;
-        this->m_storage      = new T[m_size];
-        memcpy(m_storage, other.m_storage, other.m_size);
+    /**
+     * Destroys the old value, if any, and constructs a new one in place.
+     */
+    template <typename... Args>
+    T& emplace(Args&&... args) {
+        reset();
+        new (m_storage) T(std::forward<Args>(args)...);
+        m_is_valid = true;
+        return get();
     }
 
-    T& operator[](size_t index) {
-        sgl_assert(index < m_num_elements);
-        return m_storage[index];
-    }
+    using Storage::reset;
 
-    T* begin() const { return &m_storage[0]; }
-    T* end() const { return &m_storage[0] + m_num_elements; }
+    bool valid() const { return m_is_valid; }
 
-    void push_back(const T& e) {
-        m_num_elements++;
-        if (m_num_elements * sizeof(T) > m_size) {  // Stretch
-            m_size *= 2;
-            T* new_storage = new T[m_size];
-            memcpy(new_storage, m_storage, (m_num_elements - 1) * sizeof(T));
-            delete[] m_storage;
-            m_storage = new_storage;
-        }
-        m_storage[m_num_elements - 1] = e;
+    /**
+     * Usage:
+     * if (m.valid()) some_function(m.value());
+     */
+    const T& value() const & {
+        sgl_assert(m_is_valid);
+        return get();
     }
-
-    T* ptr() const {
-        return m_storage;
+    T& value() & {
+        sgl_assert(m_is_valid);
+        return get();
     }
-
-    size_t num_elements() const {
-        return m_num_elements;
+    T&& value() && {
+        sgl_assert(m_is_valid);
+        return std::move(get());
     }
 
-    Array<T>& operator= (const Array<T>& other) {
-        if (m_size < other.m_size) {
-            if (m_storage) {
-                delete[] m_storage;
-            }
-            m_storage      = new T[other.m_size];
-            m_size         = other.m_size;
-            m_num_elements = other.m_num_elements;
-        }
-        memcpy(m_storage, other.m_storage, other.m_size);
-        return *this;
+    template <typename U>
+    T value_or(U&& fallback) const & {
+        return m_is_valid ? get() : T(std::forward<U>(fallback));
     }
-
-    void resize(size_t num_elements) {
-        sgl_expect(num_elements <= m_num_elements);
-        m_num_elements = num_elements;
+    template <typename U>
+    T value_or(U&& fallback) && {
+        return m_is_valid ? std::move(get()) : T(std::forward<U>(fallback));
     }
 
-    // Not virtual to avoid vtables. Assuming String is the only subclass.
-    // and that compilers will call this (not in spec.)
-    ~Array() {
-        if (m_storage) {
-            delete[] m_storage;
-        }
+    template <typename F>
+    typename detail::MaybeResult<typename std::result_of<F(const T&)>::type>::type
+    map(F&& f) const & {
+        typedef typename detail::MaybeResult<typename std::result_of<F(const T&)>::type>::type R;
+        return m_is_valid ? R(std::forward<F>(f)(get())) : R();
+    }
+    template <typename F>
+    typename detail::MaybeResult<typename std::result_of<F(T&&)>::type>::type
+    map(F&& f) && {
+        typedef typename detail::MaybeResult<typename std::result_of<F(T&&)>::type>::type R;
+        return m_is_valid ? R(std::forward<F>(f)(std::move(get()))) : R();
     }
 
-protected:
+    template <typename F>
+    typename std::result_of<F(const T&)>::type and_then(F&& f) const & {
+        typedef typename std::result_of<F(const T&)>::type R;
+        static_assert(detail::is_maybe<R>::value, "and_then needs a function returning a Maybe");
+        return m_is_valid ? std::forward<F>(f)(get()) : R();
+    }
+    template <typename F>
+    typename std::result_of<F(T&&)>::type and_then(F&& f) && {
+        typedef typename std::result_of<F(T&&)>::type R;
+        static_assert(detail::is_maybe<R>::value, "and_then needs a function returning a Maybe");
+        return m_is_valid ? std::forward<F>(f)(std::move(get())) : R();
+    }
+};
+
+/**
+ * A Maybe that refers to a T somewhere else. Copying it copies the
+ * reference; assigning rebinds it. Whatever it points to has to outlive it.
+ */
+template <typename T>
+class Maybe<T&> {
+public:
+    typedef T& value_type;
+
+    Maybe() : m_ptr(NULL) {}
+    Maybe(T& that) : m_ptr(&that) {}
+
+    /**
+     * Maybe<T&> converts to Maybe<const T&>.
+     */
+    template <typename U,
+              typename = typename std::enable_if<std::is_convertible<U*, T*>::value>::type>
+    Maybe(const Maybe<U&>& that) : m_ptr(that.valid() ? &that.value() : NULL) {}
+
+    bool valid() const { return m_ptr != NULL; }
+
+    T& value() const {
+        sgl_assert(m_ptr);
+        return *m_ptr;
+    }
+
+    /**
+     * Pointer to the value, or NULL.
+     */
+    T* ptr() const { return m_ptr; }
+
+    template <typename U>
+    typename std::remove_const<T>::type value_or(U&& fallback) const {
+        return m_ptr ? *m_ptr : typename std::remove_const<T>::type(std::forward<U>(fallback));
+    }
+
+    template <typename F>
+    typename detail::MaybeResult<typename std::result_of<F(T&)>::type>::type map(F&& f) const {
+        typedef typename detail::MaybeResult<typename std::result_of<F(T&)>::type>::type R;
+        return m_ptr ? R(std::forward<F>(f)(*m_ptr)) : R();
+    }
+
+    template <typename F>
+    typename std::result_of<F(T&)>::type and_then(F&& f) const {
+        typedef typename std::result_of<F(T&)>::type R;
+        static_assert(detail::is_maybe<R>::value, "and_then needs a function returning a Maybe");
+        return m_ptr ? std::forward<F>(f)(*m_ptr) : R();
+    }
+
+private:
+    T* m_ptr;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// Memory
+////////////////////////////////////////////////////////////////////////////////
+
+/*
+ * Allocators.
+ *
+ * Containers take an allocator type and keep an instance of it. An allocator
+ * is a small copyable handle with these members:
+ *
+ *   void* allocate(size_t size, size_t alignment);
+ *   // Grow or shrink, keeping the first min(old_size, new_size) bytes.
+ *   void* reallocate(void* ptr, size_t old_size, size_t new_size, size_t alignment);
+ *   void  deallocate(void* ptr, size_t size, size_t alignment);
+ *   bool  operator==(const Allocator&) const;  // Can free each other's memory.
+ *
+ * allocate and reallocate never return NULL; running out of memory is fatal.
+ */
+
+/*
+ * malloc/realloc/free. The default.
+ */
+struct HeapAllocator {
+    void* allocate(size_t size, size_t alignment) {
+        void* ptr = NULL;
+        if (alignment <= alignof(std::max_align_t)) {
+            ptr = malloc(size);
+        } else {
+#if defined(_WIN32)
+            ptr = _aligned_malloc(size, alignment);
+#else
+            if (posix_memalign(&ptr, alignment, size) != 0) {
+                ptr = NULL;
+            }
+#endif
+        }
+        sgl_assert(ptr);
+        return ptr;
+    }
+
+    void* reallocate(void* ptr, size_t old_size, size_t new_size, size_t alignment) {
+        if (alignment <= alignof(std::max_align_t)) {
+            void* new_ptr = realloc(ptr, new_size);
+            sgl_assert(new_ptr);
+            return new_ptr;
+        }
+        // No aligned realloc.
+        void* new_ptr = allocate(new_size, alignment);
+        memcpy(new_ptr, ptr, old_size < new_size ? old_size : new_size);
+        deallocate(ptr, old_size, alignment);
+        return new_ptr;
+    }
+
+    void deallocate(void* ptr, size_t /*size*/, size_t alignment) {
+#if defined(_WIN32)
+        if (alignment > alignof(std::max_align_t)) {
+            _aligned_free(ptr);
+            return;
+        }
+#endif
+        (void)alignment;
+        free(ptr);
+    }
+
+    bool operator==(const HeapAllocator&) const { return true; }
+    bool operator!=(const HeapAllocator&) const { return false; }
+};
+
+/*
+ * Bump allocator. Allocating is a pointer increment, freeing individual
+ * allocations does nothing. Memory comes back all at once with reset(), or
+ * back to a point in time with mark()/reset(mark).
+ *
+ * Arena arena;
+ * Array<int, ArenaAllocator> scratch(ArenaAllocator(&arena));
+ * ...
+ * arena.reset();  // scratch must not be used after this.
+ *
+ * Blocks are kept around after a reset and reused.
+ */
+class Arena : public Noncopyable {
+    struct Block {
+        Block* next;
+        size_t size;  // Usable bytes after the header.
+        size_t used;
+        unsigned char* data() { return (unsigned char*)(this + 1); }
+    };
+
+public:
+    struct Mark {
+        Block* block;
+        size_t used;
+    };
+
+    explicit Arena(size_t block_size = 64 * 1024) :
+        m_first(NULL), m_current(NULL), m_block_size(block_size) {}
+
+    void* allocate(size_t size, size_t alignment) {
+        if (m_current) {
+            void* ptr = bump(m_current, size, alignment);
+            if (ptr) {
+                return ptr;
+            }
+        }
+        // Try the blocks left over from a reset, then a fresh one.
+        while (m_current && m_current->next) {
+            m_current = m_current->next;
+            m_current->used = 0;
+            void* ptr = bump(m_current, size, alignment);
+            if (ptr) {
+                return ptr;
+            }
+        }
+        const size_t needed = size + alignment;
+        Block* block = new_block(needed > m_block_size ? needed : m_block_size);
+        if (m_current) {
+            block->next = m_current->next;
+            m_current->next = block;
+        } else {
+            m_first = block;
+        }
+        m_current = block;
+        void* ptr = bump(m_current, size, alignment);
+        sgl_assert(ptr);
+        return ptr;
+    }
+
+    /**
+     * Grows or shrinks ptr in place when it's the last allocation.
+     */
+    bool resize_last(void* ptr, size_t old_size, size_t new_size) {
+        if (!m_current ||
+            (unsigned char*)ptr + old_size != m_current->data() + m_current->used) {
+            return false;
+        }
+        const size_t start = (size_t)((unsigned char*)ptr - m_current->data());
+        if (start + new_size > m_current->size) {
+            return false;
+        }
+        m_current->used = start + new_size;
+        return true;
+    }
+
+    Mark mark() const {
+        Mark m = { m_current, m_current ? m_current->used : 0 };
+        return m;
+    }
+
+    /**
+     * Frees everything allocated after m was taken.
+     */
+    void reset(const Mark& m) {
+        if (!m.block) {
+            reset();
+            return;
+        }
+        m_current = m.block;
+        m_current->used = m.used;
+    }
+
+    /**
+     * Frees everything. Keeps the blocks.
+     */
+    void reset() {
+        m_current = m_first;
+        if (m_current) {
+            m_current->used = 0;
+        }
+    }
+
+    /**
+     * Bytes handed out since the last reset, counting alignment padding.
+     */
+    size_t bytes_used() const {
+        size_t total = 0;
+        for (Block* b = m_first; b; b = b->next) {
+            total += b->used;
+            if (b == m_current) break;
+        }
+        return total;
+    }
+
+    ~Arena() {
+        Block* b = m_first;
+        while (b) {
+            Block* next = b->next;
+            free(b);
+            b = next;
+        }
+    }
+
+private:
+    static void* bump(Block* block, size_t size, size_t alignment) {
+        const uintptr_t base  = (uintptr_t)block->data();
+        const uintptr_t start = (base + block->used + alignment - 1) & ~(uintptr_t)(alignment - 1);
+        const size_t offset   = (size_t)(start - base);
+        if (offset + size > block->size) {
+            return NULL;
+        }
+        block->used = offset + size;
+        return (void*)start;
+    }
+
+    static Block* new_block(size_t size) {
+        Block* block = (Block*)malloc(sizeof(Block) + size);
+        sgl_assert(block);
+        block->next = NULL;
+        block->size = size;
+        block->used = 0;
+        return block;
+    }
+
+    Block* m_first;
+    Block* m_current;
+    size_t m_block_size;
+};
+
+/*
+ * Allocator handle for an Arena. deallocate is a no-op.
+ */
+class ArenaAllocator {
+public:
+    explicit ArenaAllocator(Arena* arena) : m_arena(arena) {}
+
+    void* allocate(size_t size, size_t alignment) {
+        return m_arena->allocate(size, alignment);
+    }
+
+    void* reallocate(void* ptr, size_t old_size, size_t new_size, size_t alignment) {
+        if (m_arena->resize_last(ptr, old_size, new_size)) {
+            return ptr;
+        }
+        void* new_ptr = m_arena->allocate(new_size, alignment);
+        memcpy(new_ptr, ptr, old_size < new_size ? old_size : new_size);
+        return new_ptr;
+    }
+
+    void deallocate(void*, size_t, size_t) {}
+
+    Arena* arena() const { return m_arena; }
+
+    bool operator==(const ArenaAllocator& other) const { return m_arena == other.m_arena; }
+    bool operator!=(const ArenaAllocator& other) const { return m_arena != other.m_arena; }
+
+private:
+    Arena* m_arena;
+};
+
+/*
+ * Fixed-size blocks with a free list. Allocating and freeing are a couple of
+ * pointer moves. Memory is taken from the heap in chunks of
+ * blocks_per_chunk blocks and only returned when the Pool dies.
+ */
+class Pool : public Noncopyable {
+    struct Chunk {
+        Chunk* next;
+    };
+    struct FreeBlock {
+        FreeBlock* next;
+    };
+
+public:
+    explicit Pool(size_t block_size, size_t blocks_per_chunk = 64) :
+        m_chunks(NULL),
+        m_free(NULL),
+        m_block_size(round_up(block_size < sizeof(FreeBlock) ? sizeof(FreeBlock) : block_size)),
+        m_blocks_per_chunk(blocks_per_chunk ? blocks_per_chunk : 1) {}
+
+    void* allocate() {
+        if (!m_free) {
+            add_chunk();
+        }
+        FreeBlock* block = m_free;
+        m_free = block->next;
+        return block;
+    }
+
+    void free(void* ptr) {
+        if (!ptr) {
+            return;
+        }
+        FreeBlock* block = (FreeBlock*)ptr;
+        block->next = m_free;
+        m_free = block;
+    }
+
+    size_t block_size() const {
+        return m_block_size;
+    }
+
+    ~Pool() {
+        Chunk* c = m_chunks;
+        while (c) {
+            Chunk* next = c->next;
+            ::free(c);
+            c = next;
+        }
+    }
+
+private:
+    static size_t round_up(size_t size) {
+        const size_t align = alignof(std::max_align_t);
+        return (size + align - 1) & ~(align - 1);
+    }
+
+    void add_chunk() {
+        const size_t header = round_up(sizeof(Chunk));
+        Chunk* chunk = (Chunk*)malloc(header + m_block_size * m_blocks_per_chunk);
+        sgl_assert(chunk);
+        chunk->next = m_chunks;
+        m_chunks = chunk;
+        unsigned char* blocks = (unsigned char*)chunk + header;
+        for (size_t i = m_blocks_per_chunk; i > 0; --i) {
+            free(blocks + (i - 1) * m_block_size);
+        }
+    }
+
+    Chunk*     m_chunks;
+    FreeBlock* m_free;
+    size_t     m_block_size;
+    size_t     m_blocks_per_chunk;
+};
+
+/*
+ * Allocator handle for a Pool. Every allocation takes one block, so a
+ * container using it can never hold more than pool->block_size() bytes.
+ * Asking for more aborts, in release builds too: handing back a block
+ * that's too small would let the container write past its end.
+ */
+class PoolAllocator {
+public:
+    explicit PoolAllocator(Pool* pool) : m_pool(pool) {}
+
+    void* allocate(size_t size, size_t alignment) {
+        check_fits(size, alignment);
+        return m_pool->allocate();
+    }
+
+    void* reallocate(void* ptr, size_t /*old_size*/, size_t new_size, size_t alignment) {
+        check_fits(new_size, alignment);
+        return ptr;
+    }
+
+    void deallocate(void* ptr, size_t, size_t) {
+        m_pool->free(ptr);
+    }
+
+    Pool* pool() const { return m_pool; }
+
+    bool operator==(const PoolAllocator& other) const { return m_pool == other.m_pool; }
+    bool operator!=(const PoolAllocator& other) const { return m_pool != other.m_pool; }
+
+private:
+    void check_fits(size_t size, size_t alignment) const {
+        if (size > m_pool->block_size() || alignment > alignof(std::max_align_t)) {
+            fprintf(stderr, "PoolAllocator: %zu bytes aligned to %zu don't fit a %zu-byte block\n",
+                    size, alignment, m_pool->block_size());
+            abort();
+        }
+    }
+
+    Pool* m_pool;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// Owning pointers
+////////////////////////////////////////////////////////////////////////////////
+
+/*
+ * Deleters for ScopedPtr and ScopedArray. A deleter is called with the
+ * pointer when the owner dies or is reset, and never with NULL.
+ */
+template <typename T>
+struct Delete {
+    void operator()(T* ptr) const { delete ptr; }
+};
+
+template <typename T>
+struct Delete<T[]> {
+    void operator()(T* ptr) const { delete[] ptr; }
+};
+
+/*
+ * For objects placed in an Arena: runs the destructor. The memory comes
+ * back when the arena is reset.
+ */
+template <typename T>
+struct ArenaDelete {
+    void operator()(T* ptr) const { ptr->~T(); }
+};
+
+/*
+ * For objects placed in a Pool block: runs the destructor and frees the block.
+ */
+template <typename T>
+struct PoolDelete {
+    explicit PoolDelete(Pool* owner = NULL) : pool(owner) {}
+    void operator()(T* ptr) const {
+        ptr->~T();
+        pool->free(ptr);
+    }
+    Pool* pool;
+};
+
+namespace detail {
+
+// The deleter is a base class, so an empty one takes no space and a
+// ScopedPtr with one is the size of a pointer.
+template <typename T, typename D>
+class ScopedBase : private D {
+public:
+    T* get() const { return m_ptr; }
+    explicit operator bool() const { return m_ptr != NULL; }
+
+    T* detach() {
+        T* detached = m_ptr;
+        m_ptr = NULL;
+        return detached;
+    }
+
+    /**
+     * Deletes the old pointer, if any, and owns ptr.
+     */
+    void reset(T* ptr = NULL) {
+        T* old = m_ptr;
+        m_ptr = ptr;
+        if (old) {
+            deleter()(old);
+        }
+    }
+
+    D& deleter() { return *this; }
+    const D& deleter() const { return *this; }
+
+protected:
+    ScopedBase(T* ptr, const D& d) : D(d), m_ptr(ptr) {}
+    ScopedBase(ScopedBase&& other) : D(std::move(other.deleter())), m_ptr(other.detach()) {}
+    ScopedBase& operator=(ScopedBase&& other) {
+        if (this != &other) {
+            reset(other.detach());
+            deleter() = std::move(other.deleter());
+        }
+        return *this;
+    }
+    ~ScopedBase() { reset(); }
+
+private:
+    ScopedBase(const ScopedBase&);
+    ScopedBase& operator=(const ScopedBase&);
+
+    T* m_ptr;
+};
+
+}  // namespace detail
+
+/**
+ * Simple scoped pointers. Move-only, and the size of a pointer unless the
+ * deleter has state.
+ *
+ * ScopedPtr<Mesh> mesh(new Mesh);
+ * ScopedPtr<Node, ArenaDelete<Node>> node = arena_new<Node>(&arena, 1, 2);
+ */
+template <typename T, typename D = Delete<T>>
+class ScopedPtr : public detail::ScopedBase<T, D> {
+    typedef detail::ScopedBase<T, D> Base;
+
+public:
+    ScopedPtr() : Base(NULL, D()) {}
+    explicit ScopedPtr(T* ptr, const D& d = D()) : Base(ptr, d) {}
+    ScopedPtr(ScopedPtr&& other) : Base(std::move(other)) {}
+
+    ScopedPtr& operator=(ScopedPtr&& other) {
+        Base::operator=(std::move(other));
+        return *this;
+    }
+
+    T& operator*() const { return *this->get(); }
+    T* operator->() const { return this->get(); }
+};
+
+/**
+ * Same as ScopedPtr, for arrays. Calls delete[] by default.
+ */
+template <typename T, typename D = Delete<T[]>>
+class ScopedArray : public detail::ScopedBase<T, D> {
+    typedef detail::ScopedBase<T, D> Base;
+
+public:
+    ScopedArray() : Base(NULL, D()) {}
+    explicit ScopedArray(T* ptr, const D& d = D()) : Base(ptr, d) {}
+    ScopedArray(ScopedArray&& other) : Base(std::move(other)) {}
+
+    ScopedArray& operator=(ScopedArray&& other) {
+        Base::operator=(std::move(other));
+        return *this;
+    }
+
+    T& operator[](size_t i) const { return this->get()[i]; }
+};
+
+template <typename T, typename... Args>
+ScopedPtr<T> make_scoped(Args&&... args) {
+    return ScopedPtr<T>(new T(std::forward<Args>(args)...));
+}
+
+/**
+ * Constructs a T in the arena. The ScopedPtr only runs the destructor.
+ */
+template <typename T, typename... Args>
+ScopedPtr<T, ArenaDelete<T>> arena_new(Arena* arena, Args&&... args) {
+    void* mem = arena->allocate(sizeof(T), alignof(T));
+    return ScopedPtr<T, ArenaDelete<T>>(new (mem) T(std::forward<Args>(args)...));
+}
+
+/**
+ * Constructs a T in a block of the pool, which must be big enough.
+ */
+template <typename T, typename... Args>
+ScopedPtr<T, PoolDelete<T>> pool_new(Pool* pool, Args&&... args) {
+    sgl_assert(sizeof(T) <= pool->block_size() && alignof(T) <= alignof(std::max_align_t));
+    void* mem = pool->allocate();
+    return ScopedPtr<T, PoolDelete<T>>(new (mem) T(std::forward<Args>(args)...),
+                                       PoolDelete<T>(pool));
+}
+
+namespace detail {
+
+template <bool Atomic>
+struct RefCount {
+    RefCount() : n(0) {}
+    void increment() { ++n; }
+    bool decrement() { return --n == 0; }
+    uint32_t get() const { return n; }
+    uint32_t n;
+};
+
+template <>
+struct RefCount<true> {
+    RefCount() : n(0) {}
+    void increment() { n.fetch_add(1, std::memory_order_relaxed); }
+    // acq_rel so that whoever deletes sees every other owner's writes.
+    bool decrement() { return n.fetch_sub(1, std::memory_order_acq_rel) == 1; }
+    uint32_t get() const { return n.load(std::memory_order_relaxed); }
+    std::atomic<uint32_t> n;
+};
+
+}  // namespace detail
+
+/**
+ * Intrusive reference count. Derive from it and hold the object in RefPtrs.
+ *
+ * struct Texture : sgl::RefCounted<> { ... };
+ * sgl::RefPtr<Texture> t = sgl::make_ref<Texture>(w, h);
+ *
+ * The count is a plain integer unless Atomic is true. Use
+ * AtomicRefCounted for objects shared between threads.
+ *
+ * The destructor is not virtual: RefPtr<T> deletes a T*, so hold the most
+ * derived type or give T a virtual destructor.
+ */
+template <bool Atomic = false>
+class RefCounted : public Noncopyable {
+public:
+    void retain() const { m_count.increment(); }
+
+    /**
+     * True when that was the last reference. The caller deletes.
+     */
+    bool release() const { return m_count.decrement(); }
+
+    uint32_t ref_count() const { return m_count.get(); }
+
+protected:
+    RefCounted() {}
+    ~RefCounted() {}
+
+private:
+    mutable detail::RefCount<Atomic> m_count;
+};
+
+typedef RefCounted<true> AtomicRefCounted;
+
+/**
+ * Shared owner of a RefCounted object. The size of a pointer.
+ */
+template <typename T>
+class RefPtr {
+public:
+    RefPtr() : m_ptr(NULL) {}
+    explicit RefPtr(T* ptr) : m_ptr(ptr) {
+        if (m_ptr) m_ptr->retain();
+    }
+    RefPtr(const RefPtr& other) : RefPtr(other.m_ptr) {}
+    RefPtr(RefPtr&& other) : m_ptr(other.m_ptr) { other.m_ptr = NULL; }
+
+    template <typename U, typename = typename std::enable_if<std::is_convertible<U*, T*>::value>::type>
+    RefPtr(const RefPtr<U>& other) : RefPtr(other.get()) {}
+    template <typename U, typename = typename std::enable_if<std::is_convertible<U*, T*>::value>::type>
+    RefPtr(RefPtr<U>&& other) : m_ptr(other.detach()) {}
+
+    ~RefPtr() { reset(); }
+
+    RefPtr& operator=(const RefPtr& other) {
+        reset(other.m_ptr);
+        return *this;
+    }
+
+    RefPtr& operator=(RefPtr&& other) {
+        if (this != &other) {
+            T* ptr = other.detach();
+            reset();
+            m_ptr = ptr;
+        }
+        return *this;
+    }
+
+    /**
+     * Drops the old reference, if any, and takes one to ptr.
+     */
+    void reset(T* ptr = NULL) {
+        if (ptr) ptr->retain();
+        T* old = m_ptr;
+        m_ptr = ptr;
+        if (old && old->release()) {
+            delete old;
+        }
+    }
+
+    /**
+     * Gives up the pointer without releasing it.
+     */
+    T* detach() {
+        T* detached = m_ptr;
+        m_ptr = NULL;
+        return detached;
+    }
+
+    T* get() const { return m_ptr; }
+    T& operator*() const { return *m_ptr; }
+    T* operator->() const { return m_ptr; }
+    explicit operator bool() const { return m_ptr != NULL; }
+
+    bool operator==(const RefPtr& other) const { return m_ptr == other.m_ptr; }
+    bool operator!=(const RefPtr& other) const { return m_ptr != other.m_ptr; }
+
+private:
+    T* m_ptr;
+};
+
+template <typename T, typename... Args>
+RefPtr<T> make_ref(Args&&... args) {
+    return RefPtr<T>(new T(std::forward<Args>(args)...));
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+////////////////////////////////////////////////////////////////////////////////
+// Hashing
+////////////////////////////////////////////////////////////////////////////////
+
+namespace detail {
+
+static const uint64_t hash_secret[4] = {
+    0x2d358dccaa6c78a5ull, 0x8bb84b93962eacc9ull, 0x4b33a62ed433d4a3ull, 0x4d5a2da51de1aa47ull,
+};
+
+// Full 64x64 -> 128 bit product of *a and *b: low half in *a, high in *b.
+inline void mul128(uint64_t* a, uint64_t* b) {
+#if defined(__SIZEOF_INT128__)
+    __extension__ typedef unsigned __int128 uint128;
+    const uint128 r = (uint128)*a * *b;
+    *a = (uint64_t)r;
+    *b = (uint64_t)(r >> 64);
+#elif defined(_MSC_VER) && defined(_M_X64)
+    *a = _umul128(*a, *b, b);
+#else
+    const uint64_t ha = *a >> 32, hb = *b >> 32, la = (uint32_t)*a, lb = (uint32_t)*b;
+    const uint64_t rh = ha * hb, rm0 = ha * lb, rm1 = hb * la, rl = la * lb;
+    const uint64_t t = rl + (rm0 << 32);
+    uint64_t carry = t < rl;
+    const uint64_t lo = t + (rm1 << 32);
+    carry += lo < t;
+    *a = lo;
+    *b = rh + (rm0 >> 32) + (rm1 >> 32) + carry;
+#endif
+}
+
+inline uint64_t mix(uint64_t a, uint64_t b) {
+    mul128(&a, &b);
+    return a ^ b;
+}
+
+// Little-endian loads, so hashes are the same on every platform.
+inline uint64_t read64(const unsigned char* p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    v = __builtin_bswap64(v);
+#endif
+    return v;
+}
+
+inline uint64_t read32(const unsigned char* p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    v = __builtin_bswap32(v);
+#endif
+    return v;
+}
+
+}  // namespace detail
+
+/**
+ * 64-bit hash of len bytes, in the style of wyhash: 16 bytes (48 in the
+ * main loop) per 64x64->128 multiply instead of one byte per step.
+ * Different seeds give unrelated hashes.
+ */
+inline uint64_t hash_bytes(const void* data, size_t len, uint64_t seed = 0) {
+    using detail::hash_secret;
+    using detail::mix;
+    using detail::read32;
+    using detail::read64;
+    const unsigned char* p = (const unsigned char*)data;
+    seed ^= mix(seed ^ hash_secret[0], hash_secret[1]);
+    uint64_t a, b;
+    if (len <= 16) {
+        if (len >= 4) {
+            // Two overlapping reads from each end cover 4..16 bytes.
+            const size_t off = (len >> 3) << 2;
+            a = (read32(p) << 32) | read32(p + off);
+            b = (read32(p + len - 4) << 32) | read32(p + len - 4 - off);
+        } else if (len > 0) {
+            a = ((uint64_t)p[0] << 16) | ((uint64_t)p[len >> 1] << 8) | (uint64_t)p[len - 1];
+            b = 0;
+        } else {
+            a = b = 0;
+        }
+    } else {
+        size_t i = len;
+        if (i > 48) {
+            uint64_t seed1 = seed, seed2 = seed;
+            do {
+                seed  = mix(read64(p)      ^ hash_secret[1], read64(p + 8)  ^ seed);
+                seed1 = mix(read64(p + 16) ^ hash_secret[2], read64(p + 24) ^ seed1);
+                seed2 = mix(read64(p + 32) ^ hash_secret[3], read64(p + 40) ^ seed2);
+                p += 48;
+                i -= 48;
+            } while (i > 48);
+            seed ^= seed1 ^ seed2;
+        }
+        while (i > 16) {
+            seed = mix(read64(p) ^ hash_secret[1], read64(p + 8) ^ seed);
+            p += 16;
+            i -= 16;
+        }
+        a = read64(p + i - 16);
+        b = read64(p + i - 8);
+    }
+    a ^= hash_secret[1];
+    b ^= seed;
+    detail::mul128(&a, &b);
+    return mix(a ^ hash_secret[0] ^ len, b ^ hash_secret[1]);
+}
+
+/**
+ * Mixes an integer key into a hash where every output bit depends on every
+ * input bit. One multiply.
+ */
+inline uint64_t hash_u64(uint64_t x, uint64_t seed = 0) {
+    return detail::mix(x ^ seed ^ detail::hash_secret[0], detail::hash_secret[1]);
+}
+
+/**
+ * Seed used by the containers. 0, unless SGL_RANDOM_HASH_SEED is defined:
+ * then every process picks its own, so that an attacker can't precompute
+ * keys that collide (hash flooding), at the cost of a different iteration
+ * order on every run.
+ */
+inline uint64_t hash_seed() {
+#if defined(SGL_RANDOM_HASH_SEED)
+    static const uint64_t seed = hash_u64(Clock::now_ns() ^ Clock::ticks(),
+                                          (uint64_t)(uintptr_t)&seed);
+    return seed;
+#else
+    return 0;
+#endif
+}
+
+/**
+ * Hashes composite keys one field at a time:
+ *
+ *   uint64_t h = Hasher().add(name.str(), name.num_elements()).add_u64(id).finish();
+ *
+ * Field boundaries count: ("ab", "c") and ("a", "bc") hash differently.
+ */
+class Hasher {
+public:
+    explicit Hasher(uint64_t seed = 0) : m_state(seed) {}
+
+    Hasher& add(const void* data, size_t len) {
+        m_state = hash_bytes(data, len, m_state);
+        return *this;
+    }
+
+    Hasher& add_u64(uint64_t x) {
+        m_state = hash_u64(x, m_state ^ detail::hash_secret[2]);
+        return *this;
+    }
+
+    uint64_t finish() const {
+        return m_state;
+    }
+
+private:
+    uint64_t m_state;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+
+////////////////////////////////////////////////////////////////////////////////
+// Generic data structures
+////////////////////////////////////////////////////////////////////////////////
+/**
+ * Types that can be moved around with memcpy/realloc without running their
+ * move constructor and destructor. Defaults to trivially copyable types.
+ * Specialize it for your own types when that's true for them:
+ *
+ * template <> struct is_trivially_relocatable<MyType> : std::true_type {};
+ */
+template <typename T>
+struct is_trivially_relocatable
+    : std::integral_constant<bool, std::is_trivially_copyable<T>::value> {};
+
+template <typename T, typename D>
+struct is_trivially_relocatable<ScopedPtr<T, D>> : is_trivially_relocatable<D> {};
+template <typename T, typename D>
+struct is_trivially_relocatable<ScopedArray<T, D>> : is_trivially_relocatable<D> {};
+template <typename T>
+struct is_trivially_relocatable<RefPtr<T>> : std::true_type {};
+
+namespace detail {
+
+// Move-construct count elements from src into uninitialized dst, then
+// destroy the sources.
+template <typename T>
+inline void relocate(T* dst, T* src, size_t count) {
+    if (is_trivially_relocatable<T>::value) {
+        if (count) memcpy((void*)dst, (const void*)src, count * sizeof(T));
+    } else {
+        for (size_t i = 0; i < count; ++i) {
+            new (dst + i) T(std::move(src[i]));
+            src[i].~T();
+        }
+    }
+}
+
+// Same as relocate, but walks backwards so that dst may overlap the end of
+// src (dst > src).
+template <typename T>
+inline void relocate_backward(T* dst, T* src, size_t count) {
+    if (is_trivially_relocatable<T>::value) {
+        if (count) memmove((void*)dst, (const void*)src, count * sizeof(T));
+    } else {
+        for (size_t i = count; i > 0; --i) {
+            new (dst + i - 1) T(std::move(src[i - 1]));
+            src[i - 1].~T();
+        }
+    }
+}
+
+// Forwards version. dst may overlap the start of src (dst < src).
+template <typename T>
+inline void relocate_forward(T* dst, T* src, size_t count) {
+    if (is_trivially_relocatable<T>::value) {
+        if (count) memmove((void*)dst, (const void*)src, count * sizeof(T));
+    } else {
+        relocate(dst, src, count);
+    }
+}
+
+// Copy-construct count elements from src into uninitialized dst.
+template <typename T>
+inline void copy_construct(T* dst, const T* src, size_t count) {
+    if (std::is_trivially_copyable<T>::value) {
+        if (count) memcpy((void*)dst, (const void*)src, count * sizeof(T));
+    } else {
+        for (size_t i = 0; i < count; ++i) {
+            new (dst + i) T(src[i]);
+        }
+    }
+}
+
+template <typename T>
+inline void destroy(T* ptr, size_t count) {
+    if (!std::is_trivially_destructible<T>::value) {
+        for (size_t i = 0; i < count; ++i) {
+            ptr[i].~T();
+        }
+    }
+}
+
+}  // namespace detail
+
+/**
+ * How an Array stretches when it runs out of room.
+ * Double: fewer reallocations. OneAndHalf: less wasted memory, and freed
+ * blocks can eventually be reused by the allocator for the next growth.
+ */
+enum class ArrayGrowth : uint8_t {
+    Double,
+    OneAndHalf,
+};
+
+/**
+ * Array class designed to be faster than std::vector
+ * Windows: push_back is faster in general but really kicks ass as the size grows.
+ *
+ * Storage is raw memory: only the first num_elements() slots hold
+ * constructed objects, so reserving capacity costs nothing but the
+ * allocation. Arrays of trivially relocatable types grow with realloc.
+ */
+template <typename T, typename Alloc = HeapAllocator>
+class Array {
+public:
+    /**
+     * Empty array. Doesn't allocate.
+     */
+    Array() :
+        m_storage(NULL), m_num_elements(0), m_capacity(0),
+        m_growth(ArrayGrowth::Double), m_storage_is_inline(false), m_alloc() {}
+
+    /**
+     * Empty array that will get its memory from alloc.
+     */
+    explicit Array(const Alloc& alloc) :
+        m_storage(NULL), m_num_elements(0), m_capacity(0),
+        m_growth(ArrayGrowth::Double), m_storage_is_inline(false), m_alloc(alloc) {}
+
+    /**
+     * Allocates space for at least num elements.
+     */
+    explicit Array(size_t reserve, const Alloc& alloc = Alloc()) :
+        m_storage(NULL), m_num_elements(0), m_capacity(0),
+        m_growth(ArrayGrowth::Double), m_storage_is_inline(false), m_alloc(alloc) {
+        if (reserve) {
+            grow_to(friendly_array_size(reserve));
+        }
+    }
+
+    Array(std::initializer_list<T> list, const Alloc& alloc = Alloc()) :
+        m_storage(NULL), m_num_elements(0), m_capacity(0),
+        m_growth(ArrayGrowth::Double), m_storage_is_inline(false), m_alloc(alloc) {
+        if (list.size()) {
+            grow_to(friendly_array_size(list.size()));
+        }
+        for (const auto& e : list) {
+            new (m_storage + m_num_elements++) T(e);
+        }
+    }
+
+    Array(const Array& other) :
+        m_storage(NULL), m_num_elements(0), m_capacity(0),
+        m_growth(other.m_growth), m_storage_is_inline(false), m_alloc(other.m_alloc) {
+        if (other.m_num_elements) {
+            grow_to(friendly_array_size(other.m_num_elements));
+            detail::copy_construct(m_storage, other.m_storage, other.m_num_elements);
+            m_num_elements = other.m_num_elements;
+        }
+    }
+
+    Array(Array&& other) :
+        m_storage(NULL), m_num_elements(0), m_capacity(0),
+        m_growth(other.m_growth), m_storage_is_inline(false), m_alloc(other.m_alloc) {
+        steal(other);
+    }
+
+    T& operator[](size_t index) {
+        sgl_assert(index < m_num_elements);
+        return m_storage[index];
+    }
+
+    const T& operator[](size_t index) const {
+        sgl_assert(index < m_num_elements);
+        return m_storage[index];
+    }
+
+    T* begin() { return m_storage; }
+    T* end() { return m_storage + m_num_elements; }
+    const T* begin() const { return m_storage; }
+    const T* end() const { return m_storage + m_num_elements; }
+
+    void push_back(const T& e) {
+        emplace_back(e);
+    }
+
+    void push_back(T&& e) {
+        emplace_back(std::move(e));
+    }
+
+    /**
+     * Constructs the new element in place from args.
+     */
+    template <typename... Args>
+    T& emplace_back(Args&&... args) {
+        if (m_num_elements == m_capacity) {  // Stretch
+            // args may point into our storage, which is about to move.
+            T tmp(std::forward<Args>(args)...);
+            grow_to(next_capacity(m_num_elements + 1));
+            new (m_storage + m_num_elements) T(std::move(tmp));
+        } else {
+            new (m_storage + m_num_elements) T(std::forward<Args>(args)...);
+        }
+        return m_storage[m_num_elements++];
+    }
+
+    T* ptr() const {
+        return m_storage;
+    }
+
+    size_t num_elements() const {
+        return m_num_elements;
+    }
+
+    /**
+     * Number of elements that fit before the next reallocation.
+     */
+    size_t capacity() const {
+        return m_capacity;
+    }
+
+    const Alloc& allocator() const {
+        return m_alloc;
+    }
+
+    Array& operator= (const Array& other) {
+        if (this == &other) {
+            return *this;
+        }
+        detail::destroy(m_storage, m_num_elements);
+        m_num_elements = 0;
+        if (m_capacity < other.m_num_elements) {
+            release();
+            grow_to(friendly_array_size(other.m_num_elements));
+        }
+        detail::copy_construct(m_storage, other.m_storage, other.m_num_elements);
+        m_num_elements = other.m_num_elements;
+        return *this;
+    }
+
+    Array& operator= (Array&& other) {
+        if (this != &other) {
+            detail::destroy(m_storage, m_num_elements);
+            m_num_elements = 0;
+            release();
+            steal(other);
+        }
+        return *this;
+    }
+
+    /**
+     * Shrinks to num_elements. Use resize(n, fill) to grow.
+     */
+    void resize(size_t num_elements) {
+        sgl_expect(num_elements <= m_num_elements);
+        if (num_elements < m_num_elements) {
+            detail::destroy(m_storage + num_elements, m_num_elements - num_elements);
+            m_num_elements = num_elements;
+        }
+    }
+
+    /**
+     * Shrinks, or grows filling the new slots with copies of fill.
+     */
+    void resize(size_t num_elements, const T& fill) {
+        if (num_elements <= m_num_elements) {
+            resize(num_elements);
+            return;
+        }
+        if (num_elements > m_capacity) {
+            T tmp(fill);  // fill may live in our storage.
+            grow_to(next_capacity(num_elements));
+            fill_construct(num_elements, tmp);
+        } else {
+            fill_construct(num_elements, fill);
+        }
+    }
+
+    /**
+     * Shrinks, or grows leaving the new elements uninitialized, for code
+     * that is about to write all of them anyway. Only for trivial T.
+     */
+    void resize_for_overwrite(size_t num_elements) {
+        static_assert(std::is_trivial<T>::value, "resize_for_overwrite needs a trivial T");
+        if (num_elements > m_capacity) {
+            grow_to(next_capacity(num_elements));
+        }
+        m_num_elements = num_elements;
+    }
+
+    /**
+     * Makes room for at least num_elements without reallocating.
+     */
+    void reserve(size_t num_elements) {
+        if (num_elements > m_capacity) {
+            grow_to(friendly_array_size(num_elements));
+        }
+    }
+
+    /**
+     * Copies count elements to the end. One memcpy for trivially copyable T.
+     */
+    void append(const T* data, size_t count) {
+        if (!count) {
+            return;
+        }
+        if (m_num_elements + count > m_capacity) {
+            if (points_inside(data)) {
+                const size_t offset = (size_t)(data - m_storage);
+                grow_to(next_capacity(m_num_elements + count));
+                data = m_storage + offset;
+            } else {
+                grow_to(next_capacity(m_num_elements + count));
+            }
+        }
+        detail::copy_construct(m_storage + m_num_elements, data, count);
+        m_num_elements += count;
+    }
+
+    void append(const Array& other) {
+        append(other.m_storage, other.m_num_elements);
+    }
+
+    /**
+     * Copies count elements so that the first one ends up at index.
+     */
+    void insert(size_t index, const T* data, size_t count) {
+        sgl_assert(index <= m_num_elements);
+        if (!count) {
+            return;
+        }
+        if (points_inside(data)) {
+            Array copy(count, m_alloc);
+            copy.append(data, count);
+            insert(index, copy.m_storage, count);
+            return;
+        }
+        if (m_num_elements + count > m_capacity) {
+            grow_to(next_capacity(m_num_elements + count));
+        }
+        detail::relocate_backward(m_storage + index + count, m_storage + index,
+                                  m_num_elements - index);
+        detail::copy_construct(m_storage + index, data, count);
+        m_num_elements += count;
+    }
+
+    void insert(size_t index, const T& e) {
+        if (points_inside(&e)) {
+            T tmp(e);
+            insert(index, &tmp, 1);
+        } else {
+            insert(index, &e, 1);
+        }
+    }
+
+    /**
+     * Removes the elements in [first, last). Keeps the order of the rest.
+     */
+    void erase(size_t first, size_t last) {
+        sgl_assert(first <= last && last <= m_num_elements);
+        if (first == last) {
+            return;
+        }
+        detail::destroy(m_storage + first, last - first);
+        detail::relocate_forward(m_storage + first, m_storage + last, m_num_elements - last);
+        m_num_elements -= last - first;
+    }
+
+    void erase(size_t index) {
+        erase(index, index + 1);
+    }
+
+    void pop_back() {
+        sgl_assert(m_num_elements > 0);
+        m_storage[--m_num_elements].~T();
+    }
+
+    /**
+     * Destroys all elements. Keeps the memory.
+     */
+    void clear() {
+        detail::destroy(m_storage, m_num_elements);
+        m_num_elements = 0;
+    }
+
+    /**
+     * Gives back the memory beyond num_elements().
+     */
+    void shrink_to_fit() {
+        if (m_storage_is_inline) {
+            return;
+        }
+        if (m_num_elements == 0) {
+            release();
+        } else if (m_capacity > m_num_elements) {
+            grow_to(m_num_elements);
+        }
+    }
+
+    void set_growth(ArrayGrowth growth) {
+        m_growth = growth;
+    }
+
+    // Not virtual, so never delete a SmallArray through an Array*.
+    ~Array() {
+        detail::destroy(m_storage, m_num_elements);
+        release();
+    }
+
+protected:
     inline size_t friendly_array_size(size_t min_num) {
         // Compute an array size that is a multiple of the cache line size.
-        size_t line_size = cache_line_size();
+        // Uses the compile time line size. This runs on every construction.
+        size_t line_size = compile_time_cache_line_size;
         size_t type_size = sizeof(T);
         // Ceiling division of positive numbers:
         // line_size * ceil(min_num * type_size / line_size)
-        return line_size * (1 + (((min_num * type_size) - 1) / line_size));
+        size_t bytes = line_size * (1 + (((min_num * type_size) - 1) / line_size));
+        return bytes / type_size;
+    }
+
+    size_t next_capacity(size_t min_num) {
+        size_t grown = m_growth == ArrayGrowth::Double ?
+            2 * m_capacity : m_capacity + m_capacity / 2;
+        size_t friendly = friendly_array_size(min_num);
+        return grown > friendly ? grown : friendly;
+    }
+
+    bool points_inside(const T* ptr) const {
+        return (uintptr_t)ptr >= (uintptr_t)m_storage &&
+               (uintptr_t)ptr < (uintptr_t)(m_storage + m_num_elements);
+    }
+
+    void fill_construct(size_t num_elements, const T& fill) {
+        for (size_t i = m_num_elements; i < num_elements; ++i) {
+            new (m_storage + i) T(fill);
+        }
+        m_num_elements = num_elements;
+    }
+
+    /**
+     * For SmallArray: start out on a buffer we don't own.
+     */
+    Array(T* inline_storage, size_t inline_capacity, const Alloc& alloc) :
+        m_storage(inline_storage), m_num_elements(0), m_capacity(inline_capacity),
+        m_growth(ArrayGrowth::Double), m_storage_is_inline(true), m_alloc(alloc) {}
+
+    // Takes other's elements, leaving it empty. We must be empty.
+    void steal(Array& other) {
+        sgl_assert(m_num_elements == 0);
+        if (other.m_storage_is_inline || m_alloc != other.m_alloc) {
+            // Can't take the buffer: move the elements out of it.
+            if (m_capacity < other.m_num_elements) {
+                grow_to(friendly_array_size(other.m_num_elements));
+            }
+            detail::relocate(m_storage, other.m_storage, other.m_num_elements);
+            m_num_elements = other.m_num_elements;
+            other.m_num_elements = 0;
+            return;
+        }
+        release();
+        m_storage            = other.m_storage;
+        m_num_elements       = other.m_num_elements;
+        m_capacity           = other.m_capacity;
+        other.m_storage      = NULL;
+        other.m_num_elements = 0;
+        other.m_capacity     = 0;
+    }
+
+    // Moves the elements to a buffer of new_capacity elements.
+    void grow_to(size_t new_capacity) {
+        sgl_assert(new_capacity >= m_num_elements);
+        const size_t bytes = new_capacity * sizeof(T);
+        T* new_storage = NULL;
+        if (is_trivially_relocatable<T>::value && m_storage && !m_storage_is_inline) {
+            new_storage = (T*)m_alloc.reallocate((void*)m_storage, m_capacity * sizeof(T),
+                                                 bytes, alignof(T));
+        } else {
+            new_storage = (T*)m_alloc.allocate(bytes, alignof(T));
+            detail::relocate(new_storage, m_storage, m_num_elements);
+            release();
+        }
+        m_storage           = new_storage;
+        m_capacity          = new_capacity;
+        m_storage_is_inline = false;
+    }
+
+    // Frees the buffer. Elements must have been destroyed.
+    void release() {
+        if (m_storage && !m_storage_is_inline) {
+            m_alloc.deallocate(m_storage, m_capacity * sizeof(T), alignof(T));
+        }
+        m_storage           = NULL;
+        m_capacity          = 0;
+        m_storage_is_inline = false;
+    }
+
+    T*          m_storage;
+    size_t      m_num_elements;
+    size_t      m_capacity;
+    ArrayGrowth m_growth;
+    bool        m_storage_is_inline;  // Storage belongs to a SmallArray.
+    Alloc       m_alloc;
+};
+
+/**
+ * Array that keeps up to N elements inside the object and only goes to the
+ * heap when it grows past N. Same interface as Array; it can be passed
+ * wherever an Array<T, Alloc>& is expected.
+ *
+ * SmallArray<int, 8> args;  // No allocation until the 9th push_back.
+ */
+template <typename T, size_t N, typename Alloc = HeapAllocator>
+class SmallArray : public Array<T, Alloc> {
+    typedef Array<T, Alloc> Base;
+
+public:
+    explicit SmallArray(const Alloc& alloc = Alloc()) : Base(inline_buffer(), N, alloc) {}
+
+    SmallArray(std::initializer_list<T> list, const Alloc& alloc = Alloc()) :
+        Base(inline_buffer(), N, alloc) {
+        this->reserve(list.size());
+        for (const auto& e : list) {
+            this->push_back(e);
+        }
+    }
+
+    SmallArray(const SmallArray& other) : Base(inline_buffer(), N, other.allocator()) {
+        this->append(other);
+    }
+
+    SmallArray(const Base& other) : Base(inline_buffer(), N, other.allocator()) {
+        this->append(other);
+    }
+
+    SmallArray(SmallArray&& other) : Base(inline_buffer(), N, other.allocator()) {
+        this->steal(other);
+        other.reset_to_inline();
+    }
+
+    SmallArray(Base&& other) : Base(inline_buffer(), N, other.allocator()) {
+        this->steal(other);
+    }
+
+    SmallArray& operator=(const SmallArray& other) {
+        Base::operator=(other);
+        return *this;
+    }
+
+    SmallArray& operator=(const Base& other) {
+        Base::operator=(other);
+        return *this;
+    }
+
+    SmallArray& operator=(SmallArray&& other) {
+        if (this != &other) {
+            this->clear();
+            if (other.m_storage_is_inline || this->m_alloc != other.m_alloc) {
+                this->steal(other);  // Element-wise, into whatever we have.
+            } else {
+                this->release();
+                this->steal(other);
+                other.reset_to_inline();
+            }
+        }
+        return *this;
+    }
+
+    /**
+     * True while the elements live inside the object.
+     */
+    bool is_inline() const {
+        return this->m_storage_is_inline;
+    }
+
+    ~SmallArray() {
+        // The buffer goes away before ~Array runs, so empty it here.
+        this->clear();
+        this->release();
+    }
+
+private:
+    T* inline_buffer() {
+        return reinterpret_cast<T*>(m_buffer);
+    }
+
+    void reset_to_inline() {
+        this->m_storage           = inline_buffer();
+        this->m_capacity          = N;
+        this->m_storage_is_inline = true;
+    }
+
+    alignas(T) unsigned char m_buffer[N * sizeof(T)];
+};
+
+namespace detail {
+
+inline unsigned ctz64(uint64_t x) {
+#if defined(_MSC_VER)
+    unsigned long index;
+    _BitScanForward64(&index, x);
+    return (unsigned)index;
+#else
+    return (unsigned)__builtin_ctzll(x);
+#endif
+}
+
+/*
+ * A Group looks at width bytes at once and returns bit masks of the ones
+ * that match: bit i set means byte (window start + i).
+ *
+ * Hash tables use it on their control bytes, one per slot:
+ * empty slots hold ctrl_empty, taken slots hold the low 7 bits of the hash.
+ * StringView uses it to scan characters.
+ */
+static const unsigned char ctrl_empty = 0x80;
+
+struct GroupMask {
+    uint64_t bits;
+    unsigned shift;  // log2 of the bits used per slot.
+
+    explicit operator bool() const { return bits != 0; }
+    size_t lowest() const { return ctz64(bits) >> shift; }
+    void clear_lowest() { bits &= bits - 1; }
+};
+
+#if defined(__AVX2__)
+struct Group {
+    static const size_t width = 32;
+    __m256i ctrl;
+    explicit Group(const unsigned char* p) :
+        ctrl(_mm256_loadu_si256((const __m256i*)p)) {}
+    GroupMask match(unsigned char h2) const {
+        const __m256i eq = _mm256_cmpeq_epi8(ctrl, _mm256_set1_epi8((char)h2));
+        GroupMask m = { (uint32_t)_mm256_movemask_epi8(eq), 0 };
+        return m;
+    }
+    GroupMask match_empty() const {
+        GroupMask m = { (uint32_t)_mm256_movemask_epi8(ctrl), 0 };
+        return m;
+    }
+};
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+struct Group {
+    static const size_t width = 16;
+    __m128i ctrl;
+    explicit Group(const unsigned char* p) :
+        ctrl(_mm_loadu_si128((const __m128i*)p)) {}
+    GroupMask match(unsigned char h2) const {
+        const __m128i eq = _mm_cmpeq_epi8(ctrl, _mm_set1_epi8((char)h2));
+        GroupMask m = { (uint32_t)_mm_movemask_epi8(eq), 0 };
+        return m;
+    }
+    GroupMask match_empty() const {
+        // Empty is the only control byte with the high bit set.
+        GroupMask m = { (uint32_t)_mm_movemask_epi8(ctrl), 0 };
+        return m;
+    }
+};
+#else
+// Portable: 8 control bytes in a uint64_t.
+struct Group {
+    static const size_t width = 8;
+    static const uint64_t lsbs = 0x0101010101010101ull;
+    static const uint64_t msbs = 0x8080808080808080ull;
+    uint64_t ctrl;
+    explicit Group(const unsigned char* p) {
+        memcpy(&ctrl, p, sizeof(ctrl));
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        ctrl = __builtin_bswap64(ctrl);
+#endif
+    }
+    GroupMask match(unsigned char h2) const {
+        // Can report false positives; callers compare the full hash anyway.
+        const uint64_t x = ctrl ^ (lsbs * h2);
+        GroupMask m = { (x - lsbs) & ~x & msbs, 3 };
+        return m;
+    }
+    GroupMask match_empty() const {
+        GroupMask m = { ctrl & msbs, 3 };
+        return m;
+    }
+};
+#endif
+
+}  // namespace detail
+
+namespace detail {
+
+// Index of the first c in [p, p + n), or n.
+inline size_t find_byte(const char* p, size_t n, char c) {
+    const unsigned char* u = (const unsigned char*)p;
+    const unsigned char b = (unsigned char)c;
+    const size_t w = Group::width;
+    size_t i = 0;
+    // Four Groups per step; most steps find nothing and only OR the masks.
+    for (; i + 4 * w <= n; i += 4 * w) {
+        GroupMask m[4] = { Group(u + i).match(b), Group(u + i + w).match(b),
+                           Group(u + i + 2 * w).match(b), Group(u + i + 3 * w).match(b) };
+        if ((m[0].bits | m[1].bits | m[2].bits | m[3].bits) == 0) {
+            continue;
+        }
+        for (size_t k = 0; k < 4; ++k) {
+            for (; m[k]; m[k].clear_lowest()) {
+                const size_t j = i + k * w + m[k].lowest();
+                if (p[j] == c) {  // The portable Group can be wrong.
+                    return j;
+                }
+            }
+        }
+    }
+    for (; i + w <= n; i += w) {
+        for (GroupMask m = Group(u + i).match(b); m; m.clear_lowest()) {
+            if (p[i + m.lowest()] == c) {
+                return i + m.lowest();
+            }
+        }
+    }
+    for (; i < n; ++i) {
+        if (p[i] == c) {
+            return i;
+        }
+    }
+    return n;
+}
+
+inline bool in_set(char c, const char* set, size_t set_len) {
+    for (size_t j = 0; j < set_len; ++j) {
+        if (set[j] == c) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Index of the first byte of [p, p + n) that is in set, or n.
+// Small sets are one compare per set byte per Group; big ones use a table.
+inline size_t find_any(const char* p, size_t n, const char* set, size_t set_len) {
+    if (set_len == 1) {
+        return find_byte(p, n, set[0]);
+    }
+    size_t i = 0;
+    if (set_len <= 8) {
+        for (; i + Group::width <= n; i += Group::width) {
+            const Group group((const unsigned char*)p + i);
+            GroupMask m = group.match((unsigned char)set[0]);
+            for (size_t j = 1; j < set_len; ++j) {
+                m.bits |= group.match((unsigned char)set[j]).bits;
+            }
+            for (; m; m.clear_lowest()) {
+                if (in_set(p[i + m.lowest()], set, set_len)) {
+                    return i + m.lowest();
+                }
+            }
+        }
+        for (; i < n; ++i) {
+            if (in_set(p[i], set, set_len)) {
+                return i;
+            }
+        }
+        return n;
+    }
+    bool table[256] = {};
+    for (size_t j = 0; j < set_len; ++j) {
+        table[(unsigned char)set[j]] = true;
+    }
+    for (; i < n; ++i) {
+        if (table[(unsigned char)p[i]]) {
+            return i;
+        }
+    }
+    return n;
+}
+
+// Index of the first needle in [p, p + n), or n.
+// Looks for the first and the last byte of the needle a Group at a time,
+// and only compares the whole needle where both match.
+inline size_t find_substring(const char* p, size_t n, const char* needle, size_t m) {
+    if (m == 0) {
+        return 0;
+    }
+    if (m > n) {
+        return n;
+    }
+    if (m == 1) {
+        return find_byte(p, n, needle[0]);
+    }
+    const unsigned char* u = (const unsigned char*)p;
+    const unsigned char first = (unsigned char)needle[0];
+    const unsigned char last = (unsigned char)needle[m - 1];
+    const size_t w = Group::width;
+    size_t i = 0;
+    for (; i + m - 1 + 2 * w <= n; i += 2 * w) {
+        GroupMask a = Group(u + i).match(first);
+        GroupMask b = Group(u + i + w).match(first);
+        a.bits &= Group(u + i + m - 1).match(last).bits;
+        b.bits &= Group(u + i + w + m - 1).match(last).bits;
+        if ((a.bits | b.bits) == 0) {
+            continue;
+        }
+        for (; a; a.clear_lowest()) {
+            if (memcmp(p + i + a.lowest(), needle, m) == 0) {
+                return i + a.lowest();
+            }
+        }
+        for (; b; b.clear_lowest()) {
+            if (memcmp(p + i + w + b.lowest(), needle, m) == 0) {
+                return i + w + b.lowest();
+            }
+        }
+    }
+    for (; i + m <= n; ++i) {
+        if (u[i] == first && memcmp(p + i, needle, m) == 0) {
+            return i;
+        }
+    }
+    return n;
+}
+
+inline bool is_space(char c) {
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\v' || c == '\f';
+}
+
+}  // namespace detail
+
+template <typename Alloc> class BasicString;
+
+/**
+ * Characters that belong to someone else: a pointer and a length.
+ * Not NUL-terminated. Cheap to copy; pass by value.
+ *
+ * The owner must outlive the view. Views of a String become invalid when
+ * the String is changed or destroyed.
+ */
+class StringView {
+public:
+    static const size_t not_found = ~size_t(0);
+
+    StringView() : m_ptr(""), m_len(0) {}
+    StringView(const char* str) : m_ptr(str), m_len(strlen(str)) {}
+    StringView(const char* ptr, size_t len) : m_ptr(ptr), m_len(len) {}
+    template <typename Alloc>
+    StringView(const BasicString<Alloc>& str) : m_ptr(str.str()), m_len(str.num_elements()) {}
+
+    const char* ptr() const { return m_ptr; }
+    size_t num_elements() const { return m_len; }
+    bool empty() const { return m_len == 0; }
+
+    const char& operator[](size_t i) const {
+        sgl_assert(i < m_len);
+        return m_ptr[i];
+    }
+    const char* begin() const { return m_ptr; }
+    const char* end() const { return m_ptr + m_len; }
+
+    /**
+     * Up to count characters starting at pos. Clamped to the view.
+     */
+    StringView substr(size_t pos, size_t count = not_found) const {
+        if (pos > m_len) {
+            pos = m_len;
+        }
+        if (count > m_len - pos) {
+            count = m_len - pos;
+        }
+        return StringView(m_ptr + pos, count);
+    }
+
+    /**
+     * Index of the first c at or after from, or not_found.
+     */
+    size_t find(char c, size_t from = 0) const {
+        if (from >= m_len) {
+            return not_found;
+        }
+        const size_t i = from + detail::find_byte(m_ptr + from, m_len - from, c);
+        return i < m_len ? i : not_found;
+    }
+
+    size_t find(StringView needle, size_t from = 0) const {
+        if (from > m_len) {
+            return not_found;
+        }
+        const size_t n = m_len - from;
+        const size_t i = detail::find_substring(m_ptr + from, n, needle.m_ptr, needle.m_len);
+        return i < n || needle.m_len == 0 ? from + i : not_found;
+    }
+
+    /**
+     * Index of the first character at or after from that is in set.
+     */
+    size_t find_first_of(StringView set, size_t from = 0) const {
+        if (from >= m_len) {
+            return not_found;
+        }
+        const size_t i = from + detail::find_any(m_ptr + from, m_len - from, set.m_ptr, set.m_len);
+        return i < m_len ? i : not_found;
+    }
+
+    bool contains(StringView needle) const {
+        return find(needle) != not_found;
+    }
+
+    bool starts_with(StringView prefix) const {
+        return prefix.m_len <= m_len && memcmp(m_ptr, prefix.m_ptr, prefix.m_len) == 0;
+    }
+
+    bool ends_with(StringView suffix) const {
+        return suffix.m_len <= m_len &&
+               memcmp(m_ptr + m_len - suffix.m_len, suffix.m_ptr, suffix.m_len) == 0;
+    }
+
+    /**
+     * Without leading and trailing whitespace.
+     */
+    StringView trim() const {
+        return trim_left().trim_right();
+    }
+
+    StringView trim_left() const {
+        size_t i = 0;
+        while (i < m_len && detail::is_space(m_ptr[i])) {
+            ++i;
+        }
+        return StringView(m_ptr + i, m_len - i);
+    }
+
+    StringView trim_right() const {
+        size_t len = m_len;
+        while (len > 0 && detail::is_space(m_ptr[len - 1])) {
+            --len;
+        }
+        return StringView(m_ptr, len);
+    }
+
+    bool operator==(StringView other) const {
+        return m_len == other.m_len && memcmp(m_ptr, other.m_ptr, m_len) == 0;
+    }
+    bool operator!=(StringView other) const {
+        return !(*this == other);
+    }
+
+    /**
+     * Byte-wise lexicographic order, so that strings can be sorted.
+     */
+    bool operator<(StringView other) const {
+        const size_t len = m_len < other.m_len ? m_len : other.m_len;
+        const int c = len ? memcmp(m_ptr, other.m_ptr, len) : 0;
+        return c < 0 || (c == 0 && m_len < other.m_len);
+    }
+
+    /**
+     * Same as String::hash() for the same characters.
+     */
+    uint64_t hash() const {
+        return hash_bytes(m_ptr, m_len, hash_seed());
+    }
+
+    class Split;
+    class Tokens;
+    class Lines;
+
+    /**
+     * Lazily yields the fields between separators, empty ones included:
+     * "a,,b" gives "a", "" and "b". An empty view gives one empty field.
+     *
+     *   for (StringView field : line.split(',')) { ... }
+     */
+    Split split(char sep) const;
+
+    /**
+     * Lazily yields the runs of characters that are not in delims, skipping
+     * empty ones: " a  b " split on " " gives "a" and "b".
+     */
+    Tokens tokens(StringView delims) const;
+
+    /**
+     * Lazily yields the lines, without their "\n" or "\r\n". A newline at
+     * the very end doesn't start another line; an empty view has none.
+     */
+    Lines lines() const;
+
+private:
+    const char* m_ptr;
+    size_t      m_len;
+};
+
+class StringView::Split {
+public:
+    class iterator {
+    public:
+        iterator() : m_pos(NULL), m_end(NULL), m_field_end(NULL), m_sep(0), m_done(true) {}
+        iterator(const char* begin, const char* end, char sep) :
+            m_pos(begin), m_end(end), m_field_end(NULL), m_sep(sep), m_done(false) {
+            find_field_end();
+        }
+
+        StringView operator*() const { return StringView(m_pos, (size_t)(m_field_end - m_pos)); }
+        iterator& operator++() {
+            if (m_field_end == m_end) {
+                m_done = true;
+            } else {
+                m_pos = m_field_end + 1;
+                find_field_end();
+            }
+            return *this;
+        }
+        bool operator==(const iterator& other) const {
+            return m_done == other.m_done && (m_done || m_pos == other.m_pos);
+        }
+        bool operator!=(const iterator& other) const { return !(*this == other); }
+
+    private:
+        void find_field_end() {
+            m_field_end = m_pos + detail::find_byte(m_pos, (size_t)(m_end - m_pos), m_sep);
+        }
+
+        const char* m_pos;
+        const char* m_end;
+        const char* m_field_end;
+        char        m_sep;
+        bool        m_done;
+    };
+
+    Split(StringView view, char sep) : m_view(view), m_sep(sep) {}
+    iterator begin() const { return iterator(m_view.begin(), m_view.end(), m_sep); }
+    iterator end() const { return iterator(); }
+
+private:
+    StringView m_view;
+    char       m_sep;
+};
+
+class StringView::Tokens {
+public:
+    class iterator {
+    public:
+        iterator() : m_pos(NULL), m_end(NULL), m_token_end(NULL) {}
+        iterator(const char* begin, const char* end, StringView delims) :
+            m_pos(begin), m_end(end), m_token_end(NULL), m_delims(delims) {
+            next_token();
+        }
+
+        StringView operator*() const { return StringView(m_pos, (size_t)(m_token_end - m_pos)); }
+        iterator& operator++() {
+            m_pos = m_token_end;
+            next_token();
+            return *this;
+        }
+        bool operator==(const iterator& other) const { return m_pos == other.m_pos; }
+        bool operator!=(const iterator& other) const { return m_pos != other.m_pos; }
+
+    private:
+        // Skips delimiters, then finds the end of the token. NULL at the end.
+        void next_token() {
+            while (m_pos < m_end &&
+                   detail::in_set(*m_pos, m_delims.ptr(), m_delims.num_elements())) {
+                ++m_pos;
+            }
+            if (m_pos == m_end) {
+                m_pos = NULL;
+                return;
+            }
+            m_token_end = m_pos + detail::find_any(m_pos, (size_t)(m_end - m_pos),
+                                                   m_delims.ptr(), m_delims.num_elements());
+        }
+
+        const char* m_pos;
+        const char* m_end;
+        const char* m_token_end;
+        StringView  m_delims;
+    };
+
+    Tokens(StringView view, StringView delims) : m_view(view), m_delims(delims) {}
+    iterator begin() const { return iterator(m_view.begin(), m_view.end(), m_delims); }
+    iterator end() const { return iterator(); }
+
+private:
+    StringView m_view;
+    StringView m_delims;
+};
+
+class StringView::Lines {
+public:
+    class iterator {
+    public:
+        iterator() : m_pos(NULL), m_end(NULL), m_line_end(NULL) {}
+        iterator(const char* begin, const char* end) : m_pos(begin), m_end(end), m_line_end(NULL) {
+            find_line_end();
+        }
+
+        StringView operator*() const {
+            size_t len = (size_t)(m_line_end - m_pos);
+            if (len && m_pos[len - 1] == '\r') {
+                --len;
+            }
+            return StringView(m_pos, len);
+        }
+        iterator& operator++() {
+            m_pos = m_line_end == m_end ? m_end : m_line_end + 1;
+            find_line_end();
+            return *this;
+        }
+        bool operator==(const iterator& other) const { return m_pos == other.m_pos; }
+        bool operator!=(const iterator& other) const { return m_pos != other.m_pos; }
+
+    private:
+        // NULL once past the last line.
+        void find_line_end() {
+            if (m_pos == m_end) {
+                m_pos = NULL;
+                return;
+            }
+            m_line_end = m_pos + detail::find_byte(m_pos, (size_t)(m_end - m_pos), '\n');
+        }
+
+        const char* m_pos;
+        const char* m_end;
+        const char* m_line_end;
+    };
+
+    explicit Lines(StringView view) : m_view(view) {}
+    iterator begin() const { return iterator(m_view.begin(), m_view.end()); }
+    iterator end() const { return iterator(); }
+
+private:
+    StringView m_view;
+};
+
+inline StringView::Split StringView::split(char sep) const {
+    return Split(*this, sep);
+}
+
+inline StringView::Tokens StringView::tokens(StringView delims) const {
+    return Tokens(*this, delims);
+}
+
+inline StringView::Lines StringView::lines() const {
+    return Lines(*this);
+}
+
+/**
+ * String class.
+ *
+ * Up to inline_capacity characters live inside the object (small string
+ * optimization): short strings never touch the allocator. Longer ones go to
+ * the heap, growing by doubling when appended to.
+ *
+ * Always NUL-terminated. The characters are read-only from the outside,
+ * which lets the String remember its hash.
+ */
+template <typename Alloc>
+class BasicString {
+public:
+    static const size_t inline_capacity = 23;
+
+    /**
+     * Doesn't allocate.
+     */
+    BasicString() : m_hash(0), m_alloc(), m_inline_size(0) {
+        m_inline[0] = '\0';
+    }
+
+    explicit BasicString(const Alloc& alloc) : m_hash(0), m_alloc(alloc), m_inline_size(0) {
+        m_inline[0] = '\0';
+    }
+
+    BasicString(const char* str, const Alloc& alloc = Alloc()) :
+        m_hash(0), m_alloc(alloc), m_inline_size(0) {
+        init(str, strlen(str));
+    }
+
+    BasicString(const char* str, size_t len, const Alloc& alloc = Alloc()) :
+        m_hash(0), m_alloc(alloc), m_inline_size(0) {
+        init(str, len);
+    }
+
+    explicit BasicString(StringView view, const Alloc& alloc = Alloc()) :
+        m_hash(0), m_alloc(alloc), m_inline_size(0) {
+        init(view.ptr(), view.num_elements());
+    }
+
+    BasicString(const BasicString& other) :
+        m_hash(other.m_hash), m_alloc(other.m_alloc), m_inline_size(0) {
+        init(other.str(), other.num_elements());
+    }
+
+    BasicString(BasicString&& other) : m_hash(0), m_alloc(other.m_alloc), m_inline_size(0) {
+        steal(other);
+    }
+
+    /**
+     * Copy of a String that uses alloc, whatever other uses.
+     */
+    template <typename B>
+    BasicString(const BasicString<B>& other, const Alloc& alloc) :
+        m_hash(other.m_hash), m_alloc(alloc), m_inline_size(0) {
+        init(other.str(), other.num_elements());
+    }
+
+    BasicString& operator=(const BasicString& other) {
+        if (this != &other) {
+            assign(other.str(), other.num_elements());
+            m_hash = other.m_hash;
+        }
+        return *this;
+    }
+
+    BasicString& operator=(BasicString&& other) {
+        if (this != &other) {
+            if (m_alloc != other.m_alloc) {
+                return *this = (const BasicString&)other;  // Can't take the buffer.
+            }
+            release();
+            steal(other);
+        }
+        return *this;
+    }
+
+    BasicString& operator=(const char* str) {
+        assign(str, strlen(str));
+        return *this;
+    }
+
+    ~BasicString() {
+        release();
+    }
+
+    /**
+     * In place, amortized O(length of str). str may point into this String.
+     */
+    BasicString& append(const char* str, size_t len) {
+        const size_t size = num_elements();
+        if (size + len > capacity()) {
+            grow(size + len, str, len);
+        } else {
+            char* data = mutable_data();
+            memcpy(data + size, str, len);
+            set_size(size + len);
+        }
+        m_hash = 0;
+        return *this;
+    }
+
+    BasicString& append(const char* str) { return append(str, strlen(str)); }
+    template <typename B>
+    BasicString& append(const BasicString<B>& other) { return append(other.str(), other.num_elements()); }
+    BasicString& append(StringView view) { return append(view.ptr(), view.num_elements()); }
+    BasicString& append(char c) { return append(&c, 1); }
+
+    BasicString& operator+=(const char* str) { return append(str); }
+    template <typename B>
+    BasicString& operator+=(const BasicString<B>& other) { return append(other); }
+    BasicString& operator+=(StringView view) { return append(view); }
+    BasicString& operator+=(char c) { return append(c); }
+
+    /**
+     * New String with other at the end. Use append to build strings up.
+     */
+    BasicString appended(const BasicString& other) const {
+        BasicString result(str(), num_elements(), other.num_elements(), m_alloc);
+        result.append(other.str(), other.num_elements());
+        return result;
+    }
+
+    /**
+     * Room for num characters without reallocating.
+     */
+    void reserve(size_t num) {
+        if (num > capacity()) {
+            grow(num, NULL, 0);
+        }
+    }
+
+    /**
+     * Empties the String. Keeps the heap buffer, if any.
+     */
+    void clear() {
+        set_size(0);
+        m_hash = 0;
+    }
+
+    /**
+     * Never NULL. Empty and moved-from Strings read as "".
+     */
+    const char* str() const {
+        return is_inline() ? m_inline : m_heap.ptr;
+    }
+
+    size_t num_elements() const {
+        return is_inline() ? m_inline_size : m_heap.size;
+    }
+
+    size_t capacity() const {
+        return is_inline() ? inline_capacity : m_heap.capacity;
+    }
+
+    bool is_inline() const {
+        return m_inline_size != on_heap;
+    }
+
+    const Alloc& allocator() const {
+        return m_alloc;
+    }
+
+    /**
+     * hash_bytes of the characters with hash_seed(). Free after
+     * cache_hash(); otherwise computed on every call. Never writes, so
+     * threads can share a const String.
+     */
+    uint64_t hash() const {
+        return m_hash ? m_hash : hash_bytes(str(), num_elements(), hash_seed());
+    }
+
+    /**
+     * Computes the hash and remembers it until the String changes, so
+     * looking a long key up again and again doesn't rehash it.
+     */
+    uint64_t cache_hash() {
+        m_hash = hash_bytes(str(), num_elements(), hash_seed());
+        return m_hash;
+    }
+
+    template <typename B>
+    bool operator==(const BasicString<B>& other) const {
+        if (m_hash && other.m_hash && m_hash != other.m_hash) {
+            return false;
+        }
+        return num_elements() == other.num_elements() &&
+               memcmp(str(), other.str(), num_elements()) == 0;
+    }
+    bool operator==(const char* other) const {
+        return strlen(other) == num_elements() && memcmp(str(), other, num_elements()) == 0;
+    }
+    bool operator==(StringView other) const {
+        return other.num_elements() == num_elements() &&
+               memcmp(str(), other.ptr(), num_elements()) == 0;
+    }
+    template <typename T>
+    bool operator!=(const T& other) const { return !(*this == other); }
+
+    /**
+     * Same order as StringView.
+     */
+    bool operator<(StringView other) const {
+        return StringView(str(), num_elements()) < other;
+    }
+
+    const char& operator[](size_t i) const {
+        sgl_assert(i < num_elements());
+        return str()[i];
+    }
+    const char* begin() const { return str(); }
+    const char* end() const { return str() + num_elements(); }
+
+private:
+    static const unsigned char on_heap = 0xff;
+
+    // Copy of [str, str + len) with room for extra more characters.
+    BasicString(const char* str, size_t len, size_t extra, const Alloc& alloc) :
+        m_hash(0), m_alloc(alloc), m_inline_size(0) {
+        init(str, len, extra);
+    }
+
+    char* mutable_data() {
+        return is_inline() ? m_inline : m_heap.ptr;
+    }
+
+    void set_size(size_t size) {
+        if (is_inline()) {
+            m_inline_size = (unsigned char)size;
+            m_inline[size] = '\0';
+        } else {
+            m_heap.size = size;
+            m_heap.ptr[size] = '\0';
+        }
+    }
+
+    // We are empty and inline. Leaves room for extra more characters.
+    void init(const char* str, size_t len, size_t extra = 0) {
+        if (len + extra > inline_capacity) {
+            m_heap.ptr = (char*)m_alloc.allocate(len + extra + 1, 1);
+            m_heap.capacity = len + extra;
+            m_inline_size = on_heap;
+        }
+        memcpy(mutable_data(), str, len);
+        set_size(len);
+    }
+
+    // str may point into this String.
+    void assign(const char* str, size_t len) {
+        if (len > capacity()) {
+            char* data = (char*)m_alloc.allocate(len + 1, 1);
+            memcpy(data, str, len);
+            release();
+            m_heap.ptr      = data;
+            m_heap.capacity = len;
+            m_inline_size   = on_heap;
+            set_size(len);
+        } else {
+            memmove(mutable_data(), str, len);
+            set_size(len);
+        }
+        m_hash = 0;
+    }
+
+    // To the heap with room for at least num characters, then appends
+    // [str, str + len). The old buffer is freed last, since str may be in it.
+    void grow(size_t num, const char* str, size_t len) {
+        const size_t size = num_elements();
+        size_t new_capacity = capacity() * 2;
+        if (new_capacity < num) {
+            new_capacity = num;
+        }
+        char* data = (char*)m_alloc.allocate(new_capacity + 1, 1);
+        memcpy(data, this->str(), size);
+        if (len) {
+            memcpy(data + size, str, len);
+        }
+        release();
+        m_heap.ptr      = data;
+        m_heap.capacity = new_capacity;
+        m_inline_size   = on_heap;
+        set_size(size + len);
+    }
+
+    // Takes other's characters and leaves it empty. We must be empty.
+    void steal(BasicString& other) {
+        if (other.is_inline()) {
+            memcpy(m_inline, other.m_inline, (size_t)other.m_inline_size + 1);
+            m_inline_size = other.m_inline_size;
+        } else {
+            m_heap = other.m_heap;
+            m_inline_size = on_heap;
+        }
+        m_hash = other.m_hash;
+        other.m_hash = 0;
+        other.m_inline_size = 0;
+        other.m_inline[0] = '\0';
+    }
+
+    // Frees the heap buffer. Leaves us in an invalid state.
+    void release() {
+        if (!is_inline()) {
+            m_alloc.deallocate(m_heap.ptr, m_heap.capacity + 1, 1);
+        }
+    }
+
+    template <typename B> friend class BasicString;
+
+    struct Heap {
+        char*  ptr;
+        size_t size;
+        size_t capacity;  // Not counting the terminator.
+    };
+    union {
+        Heap m_heap;
+        char m_inline[inline_capacity + 1];
+    };
+    uint64_t         m_hash;  // 0 unless cache_hash() was called.
+    Alloc            m_alloc;
+    unsigned char    m_inline_size;  // on_heap when the characters are in m_heap.
+};
+
+/**
+ * Nothing in a String points into itself.
+ */
+template <typename Alloc>
+struct is_trivially_relocatable<BasicString<Alloc>> : is_trivially_relocatable<Alloc> {};
+
+typedef BasicString<HeapAllocator> String;
+
+/**
+ * Accumulates fragments and makes a String out of them once:
+ *
+ *   StringBuilder b;
+ *   b.append("user ").append(name).appendf(" logged in after %d tries", tries);
+ *   String line = b.to_string();
+ *
+ * The first N bytes live inside the builder, so a typical line is built
+ * without touching the allocator until to_string().
+ */
+template <typename Alloc, size_t N = 256>
+class BasicStringBuilder : public Noncopyable {
+public:
+    explicit BasicStringBuilder(const Alloc& alloc = Alloc()) : m_buffer(alloc) {}
+
+    BasicStringBuilder& append(const char* str, size_t len) {
+        m_buffer.append(str, len);
+        return *this;
+    }
+
+    BasicStringBuilder& append(const char* str) { return append(str, strlen(str)); }
+    template <typename B>
+    BasicStringBuilder& append(const BasicString<B>& str) { return append(str.str(), str.num_elements()); }
+    BasicStringBuilder& append(char c) {
+        m_buffer.push_back(c);
+        return *this;
+    }
+
+    /**
+     * printf-style, straight into the buffer.
+     */
+#if defined(__GNUC__)
+    __attribute__((format(printf, 2, 3)))
+#endif
+    BasicStringBuilder& appendf(const char* fmt, ...) {
+        va_list args;
+        va_start(args, fmt);
+        va_list again;
+        va_copy(again, args);
+        char small[128];
+        const int len = vsnprintf(small, sizeof(small), fmt, args);
+        va_end(args);
+        if (len >= 0 && (size_t)len < sizeof(small)) {
+            append(small, (size_t)len);
+        } else if (len >= 0) {
+            // vsnprintf always writes a terminator; make room for it, then drop it.
+            const size_t size = m_buffer.num_elements();
+            m_buffer.resize(size + (size_t)len + 1, '\0');
+            vsnprintf(m_buffer.ptr() + size, (size_t)len + 1, fmt, again);
+            m_buffer.resize(size + (size_t)len);
+        }
+        va_end(again);
+        return *this;
+    }
+
+    size_t num_elements() const {
+        return m_buffer.num_elements();
+    }
+
+    void clear() {
+        m_buffer.clear();
+    }
+
+    /**
+     * One allocation, of exactly the right size (none for short results).
+     */
+    BasicString<Alloc> to_string() const {
+        return BasicString<Alloc>(m_buffer.ptr(), m_buffer.num_elements(), m_buffer.allocator());
+    }
+
+private:
+    SmallArray<char, N, Alloc> m_buffer;  // Not NUL-terminated.
+};
+
+typedef BasicStringBuilder<HeapAllocator> StringBuilder;
+
+/**
+ * djb2 hashing. One byte per step; hash_bytes is much faster.
+ */
+static inline uint64_t djb2(char* data) {
+    uint64_t hash = 5381;
+    while (*data != '\0') {
+        hash = (hash * 33) ^ (uint64_t)(*data);
+        ++data;
+    }
+    return hash;
+}
+
+/**
+ * Hash functors for HashMap and HashSet.
+ * Provided for integers, enums, pointers and strings. Specialize for your
+ * own keys, or pass any functor returning a well mixed uint64_t.
+ *
+ * A functor with an is_transparent typedef is also called with types other
+ * than the key (find(const char*) on a String-keyed map); those must hash
+ * the same as the equal key would.
+ */
+template <typename K, typename Enable = void>
+struct Hash;
+
+template <typename K>
+struct Hash<K, typename std::enable_if<std::is_integral<K>::value ||
+                                       std::is_enum<K>::value>::type> {
+    uint64_t operator()(K key) const {
+        return hash_u64((uint64_t)key, hash_seed());
+    }
+};
+
+template <typename T>
+struct Hash<T*> {
+    uint64_t operator()(const T* ptr) const {
+        return hash_u64((uint64_t)(uintptr_t)ptr, hash_seed());
+    }
+};
+
+template <typename A>
+struct Hash<BasicString<A>> {
+    typedef void is_transparent;
+
+    template <typename B>
+    uint64_t operator()(const BasicString<B>& str) const {
+        return str.hash();
+    }
+    uint64_t operator()(const char* str) const {
+        return hash_bytes(str, strlen(str), hash_seed());
+    }
+    uint64_t operator()(StringView view) const {
+        return view.hash();
+    }
+};
+
+template <>
+struct Hash<StringView> {
+    uint64_t operator()(StringView view) const {
+        return view.hash();
+    }
+};
+
+/**
+ * Equality functor. Same rules as Hash.
+ */
+template <typename K>
+struct Equal {
+    bool operator()(const K& a, const K& b) const {
+        return a == b;
+    }
+};
+
+template <typename A>
+struct Equal<BasicString<A>> {
+    template <typename Q>
+    bool operator()(const BasicString<A>& a, const Q& b) const {
+        return a == b;
+    }
+};
+
+namespace detail {
+
+// Stored key from a lookup key, using the container's allocator if K takes one.
+template <typename K, typename Q, typename A>
+typename std::enable_if<std::is_constructible<K, const Q&, const A&>::value, K>::type
+make_key(const Q& key, const A& alloc) {
+    return K(key, alloc);
+}
+
+template <typename K, typename Q, typename A>
+typename std::enable_if<!std::is_constructible<K, const Q&, const A&>::value, K>::type
+make_key(const Q& key, const A&) {
+    return K(key);
+}
+
+template <typename K, typename V>
+struct MapSlot {
+    uint64_t hash;
+    K key;
+    V value;
+};
+
+template <typename K>
+struct SetSlot {
+    uint64_t hash;
+    K key;
+};
+
+}  // namespace detail
+
+template <typename K, typename V>
+struct is_trivially_relocatable<detail::MapSlot<K, V>> :
+    std::integral_constant<bool, is_trivially_relocatable<K>::value &&
+                                 is_trivially_relocatable<V>::value> {};
+
+template <typename K>
+struct is_trivially_relocatable<detail::SetSlot<K>> : is_trivially_relocatable<K> {};
+
+class Writer;
+inline Writer& stdout_writer();
+inline std::mutex& stdout_writer_lock();
+
+namespace detail {
+
+template <typename W, typename T>
+typename std::enable_if<std::is_arithmetic<T>::value || std::is_pointer<T>::value>::type
+print_debug_value(W& out, T x) { out.write(x); }
+
+template <typename W, typename A>
+void print_debug_value(W& out, const BasicString<A>& str) { out.write(str); }
+
+template <typename W, typename T>
+typename std::enable_if<std::is_same<T, StringView>::value>::type
+print_debug_value(W& out, const T& view) { out.write(view); }
+
+template <typename W, typename T>
+typename std::enable_if<!std::is_arithmetic<T>::value && !std::is_pointer<T>::value &&
+                        !std::is_same<T, StringView>::value>::type
+print_debug_value(W& out, const T&) { out.write('?'); }
+
+/*
+ * The table behind HashMap and HashSet.
+ *
+ * Open addressing with SIMD probing: next to the slots there is an array of
+ * one-byte tags holding 7 bits of each hash, and lookups compare a whole
+ * Group of tags (16 with SSE2, 32 with AVX2) in a couple of instructions.
+ * Only slots whose tag matches are looked at.
+ *
+ * Capacity is a power of two and the table is kept at most 7/8 full.
+ * Probing is linear, one slot at a time, in Group-sized windows.
+ *
+ * Slot has a uint64_t hash and a key. Every slot keeps its full hash, so
+ * growing never rehashes keys and most mismatches never compare them.
+ */
+template <typename Slot, typename HashT, typename EqT, typename Alloc>
+class HashTable {
+public:
+    static const size_t default_size = 32;
+
+    HashTable(size_t size, const Alloc& alloc, const HashT& hash, const EqT& eq) :
+        m_slots(NULL), m_ctrl(NULL), m_capacity(0), m_num_elements(0),
+        m_alloc(alloc), m_hash(hash), m_eq(eq) {
+        allocate(capacity_for(size));
+    }
+
+    HashTable(const HashTable& other) :
+        m_slots(NULL), m_ctrl(NULL), m_capacity(0), m_num_elements(0),
+        m_alloc(other.m_alloc), m_hash(other.m_hash), m_eq(other.m_eq) {
+        copy_from(other);
+    }
+
+    HashTable(HashTable&& other) :
+        m_slots(other.m_slots), m_ctrl(other.m_ctrl), m_capacity(other.m_capacity),
+        m_num_elements(other.m_num_elements),
+        m_alloc(other.m_alloc), m_hash(other.m_hash), m_eq(other.m_eq) {
+        other.forget();
+    }
+
+    HashTable& operator=(const HashTable& other) {
+        if (this != &other) {
+            destroy();
+            copy_from(other);
+        }
+        return *this;
+    }
+
+    HashTable& operator=(HashTable&& other) {
+        if (this != &other) {
+            destroy();
+            if (m_alloc == other.m_alloc) {
+                m_slots        = other.m_slots;
+                m_ctrl         = other.m_ctrl;
+                m_capacity     = other.m_capacity;
+                m_num_elements = other.m_num_elements;
+                other.forget();
+            } else {
+                copy_from(other);
+            }
+        }
+        return *this;
+    }
+
+    ~HashTable() {
+        destroy();
+    }
+
+    size_t num_elements() const {
+        return m_num_elements;
+    }
+
+    size_t capacity() const {
+        return m_capacity;
+    }
+
+    /**
+     * Makes room for num elements, so inserting them won't rehash.
+     */
+    void reserve(size_t num) {
+        const size_t capacity = capacity_for(num);
+        if (capacity > m_capacity) {
+            rehash(capacity);
+        }
+    }
+
+    /**
+     * Removes everything. Keeps the capacity.
+     */
+    void clear() {
+        if (!m_slots) {
+            return;
+        }
+        destroy_slots();
+        memset(m_ctrl, ctrl_empty, m_capacity + group_width);
+        m_num_elements = 0;
+    }
+
+    /**
+     * Visits the full slots in table order.
+     */
+    template <typename SlotT>
+    class Iterator {
+    public:
+        Iterator(SlotT* slots, const unsigned char* ctrl, size_t i, size_t capacity) :
+            m_slots(slots), m_ctrl(ctrl), m_i(i), m_capacity(capacity) {
+            skip_empty();
+        }
+        SlotT& operator*() const { return m_slots[m_i]; }
+        SlotT* operator->() const { return &m_slots[m_i]; }
+        Iterator& operator++() {
+            ++m_i;
+            skip_empty();
+            return *this;
+        }
+        bool operator==(const Iterator& other) const { return m_i == other.m_i; }
+        bool operator!=(const Iterator& other) const { return m_i != other.m_i; }
+
+    private:
+        void skip_empty() {
+            while (m_i < m_capacity && m_ctrl[m_i] == ctrl_empty) {
+                ++m_i;
+            }
+        }
+
+        SlotT*               m_slots;
+        const unsigned char* m_ctrl;
+        size_t               m_i;
+        size_t               m_capacity;
+    };
+
+protected:
+    static const size_t group_width = Group::width;
+    static const size_t not_found = ~size_t(0);
+
+    static unsigned char h2(uint64_t hash) {
+        return (unsigned char)(hash & 0x7f);
+    }
+
+    size_t h1(uint64_t hash) const {
+        return (size_t)(hash >> 7) & (m_capacity - 1);
+    }
+
+    // Index of the slot holding key, or not_found.
+    template <typename Q>
+    size_t find_slot(uint64_t hash, const Q& key) const {
+        if (m_num_elements == 0) {
+            return not_found;
+        }
+        const size_t mask = m_capacity - 1;
+        const unsigned char tag = h2(hash);
+        size_t pos = h1(hash);
+        for (;;) {
+            Group group(m_ctrl + pos);
+            for (GroupMask m = group.match(tag); m; m.clear_lowest()) {
+                const size_t i = (pos + m.lowest()) & mask;
+                const Slot& slot = m_slots[i];
+                if (slot.hash == hash && m_eq(slot.key, key)) {
+                    return i;
+                }
+            }
+            if (group.match_empty()) {
+                return not_found;
+            }
+            pos = (pos + group_width) & mask;
+        }
+    }
+
+    // True if the next claim_slot moves the table.
+    bool must_grow() const {
+        return !m_slots || m_num_elements + 1 > m_capacity - m_capacity / 8;
+    }
+
+    // Index of a slot for a new element with this hash, growing if needed.
+    // The slot counts as full already; the caller constructs it.
+    size_t claim_slot(uint64_t hash) {
+        if (!m_slots) {
+            allocate(capacity_for(1));  // Moved from.
+        } else if (m_num_elements + 1 > m_capacity - m_capacity / 8) {
+            rehash(m_capacity * 2);
+        }
+        const size_t i = find_empty(hash);
+        set_ctrl(i, h2(hash));
+        m_num_elements++;
+        return i;
+    }
+
+    // Backward-shift deletion: the elements after the hole move back, so
+    // there are no tombstones and erasing never makes lookups slower.
+    void erase_at(size_t hole) {
+        const size_t mask = m_capacity - 1;
+        m_slots[hole].~Slot();
+        // Pull back every element of the run after the hole that may move,
+        // i.e. whose home is not between the hole and where it sits now.
+        for (size_t j = (hole + 1) & mask; m_ctrl[j] != ctrl_empty; j = (j + 1) & mask) {
+            const size_t home = h1(m_slots[j].hash);
+            if (((j - home) & mask) >= ((j - hole) & mask)) {
+                relocate(&m_slots[hole], &m_slots[j], 1);
+                set_ctrl(hole, m_ctrl[j]);
+                hole = j;
+            }
+        }
+        set_ctrl(hole, ctrl_empty);
+        m_num_elements--;
+    }
+
+    template <typename Q>
+    uint64_t hash_of(const Q& key) const {
+        return m_hash(key);
+    }
+
+    // Builds the dump in out's buffer and flushes once at the end.
+    template <typename W>
+    void print_slots(W& out) const {
+        out.write("---------------Dict debug ------\n");
+        for (size_t i = 0; i < m_capacity; ++i) {
+            if (m_ctrl[i] == ctrl_empty) {
+                continue;
+            }
+            out.write("Field ").write(i).write(", ").write(m_slots[i].hash).write(", ");
+            print_debug_value(out, m_slots[i].key);
+            print_value(out, m_slots[i]);
+            out.write('\n');
+        }
+        out.write("-------------------------\n");
+        out.flush();
+    }
+
+    Slot*          m_slots;
+    unsigned char* m_ctrl;  // m_capacity + group_width bytes, right after the slots.
+    size_t         m_capacity;
+    size_t         m_num_elements;
+    Alloc          m_alloc;
+    HashT          m_hash;
+    EqT            m_eq;
+
+private:
+    template <typename W, typename K, typename V>
+    static void print_value(W& out, const MapSlot<K, V>& slot) {
+        out.write(", ");
+        print_debug_value(out, slot.value);
+    }
+    template <typename W, typename K>
+    static void print_value(W&, const SetSlot<K>&) {}
+
+    // Smallest power of two that holds num at 7/8 load.
+    static size_t capacity_for(size_t num) {
+        size_t capacity = group_width;
+        while (capacity - capacity / 8 < num) {
+            capacity *= 2;
+        }
+        return capacity;
+    }
+
+    void set_ctrl(size_t i, unsigned char c) {
+        m_ctrl[i] = c;
+        if (i < group_width - 1) {
+            m_ctrl[m_capacity + i] = c;  // Clone, so windows can run off the end.
+        }
+    }
+
+    // First empty slot at or after hash's home position.
+    size_t find_empty(uint64_t hash) const {
+        const size_t mask = m_capacity - 1;
+        size_t pos = h1(hash);
+        for (;;) {
+            GroupMask m = Group(m_ctrl + pos).match_empty();
+            if (m) {
+                return (pos + m.lowest()) & mask;
+            }
+            pos = (pos + group_width) & mask;
+        }
+    }
+
+    // One pass: every element goes straight to its place in the new table.
+    void rehash(size_t new_capacity) {
+        Slot* old_slots = m_slots;
+        unsigned char* old_ctrl = m_ctrl;
+        const size_t old_capacity = m_capacity;
+        const size_t num_elements = m_num_elements;
+        allocate(new_capacity);
+        for (size_t i = 0; i < old_capacity; ++i) {
+            if (old_ctrl[i] != ctrl_empty) {
+                const size_t j = find_empty(old_slots[i].hash);
+                relocate(&m_slots[j], &old_slots[i], 1);
+                set_ctrl(j, old_ctrl[i]);
+            }
+        }
+        m_num_elements = num_elements;
+        if (old_slots) {
+            m_alloc.deallocate(old_slots, bytes_for(old_capacity), alignof(Slot));
+        }
+    }
+
+    static size_t bytes_for(size_t capacity) {
+        return capacity * sizeof(Slot) + capacity + group_width;
+    }
+
+    // Fresh, empty table. Doesn't free the old one.
+    void allocate(size_t capacity) {
+        sgl_assert(capacity >= group_width && (capacity & (capacity - 1)) == 0);
+        m_slots = (Slot*)m_alloc.allocate(bytes_for(capacity), alignof(Slot));
+        m_ctrl = (unsigned char*)(m_slots + capacity);
+        m_capacity = capacity;
+        m_num_elements = 0;
+        memset(m_ctrl, ctrl_empty, capacity + group_width);
+    }
+
+    // We must be destroyed or fresh.
+    void copy_from(const HashTable& other) {
+        allocate(other.m_capacity ? other.m_capacity : capacity_for(0));
+        if (!other.m_slots) {
+            return;
+        }
+        memcpy(m_ctrl, other.m_ctrl, m_capacity + group_width);
+        for (size_t i = 0; i < m_capacity; ++i) {
+            if (m_ctrl[i] != ctrl_empty) {
+                new (&m_slots[i]) Slot(other.m_slots[i]);
+            }
+        }
+        m_num_elements = other.m_num_elements;
+    }
+
+    void destroy_slots() {
+        if (!std::is_trivially_destructible<Slot>::value) {
+            for (size_t i = 0; i < m_capacity; ++i) {
+                if (m_ctrl[i] != ctrl_empty) {
+                    m_slots[i].~Slot();
+                }
+            }
+        }
+    }
+
+    void destroy() {
+        if (!m_slots) {
+            return;
+        }
+        destroy_slots();
+        m_alloc.deallocate(m_slots, bytes_for(m_capacity), alignof(Slot));
+        forget();
+    }
+
+    void forget() {
+        m_slots        = NULL;
+        m_ctrl         = NULL;
+        m_capacity     = 0;
+        m_num_elements = 0;
+    }
+};
+
+}  // namespace detail
+
+template <typename K, typename V, typename HashT, typename EqT, typename Alloc>
+class ConcurrentHashMap;
+
+/**
+ * Hash table mapping K to V. See detail::HashTable for how it works.
+ *
+ * Lookups take the key type, or anything else when HashT is transparent;
+ * String-keyed maps can be searched with any String, a StringView or a
+ * const char* without building a key.
+ *
+ * Iteration visits entries with .key and .value in no particular order.
+ * Inserting or erasing invalidates iterators.
+ */
+template <typename K, typename V, typename HashT = Hash<K>, typename EqT = Equal<K>,
+          typename Alloc = HeapAllocator>
+class HashMap : public detail::HashTable<detail::MapSlot<K, V>, HashT, EqT, Alloc> {
+    typedef detail::HashTable<detail::MapSlot<K, V>, HashT, EqT, Alloc> Base;
+    typedef detail::MapSlot<K, V> Slot;
+
+public:
+    typedef typename Base::template Iterator<Slot> iterator;
+    typedef typename Base::template Iterator<const Slot> const_iterator;
+
+    /**
+     * Room for size elements before the first rehash.
+     */
+    explicit HashMap(size_t size, const Alloc& alloc = Alloc(),
+                     const HashT& hash = HashT(), const EqT& eq = EqT()) :
+        Base(size, alloc, hash, eq) {}
+    explicit HashMap(const Alloc& alloc) : HashMap(Base::default_size, alloc) {}
+    HashMap() : HashMap(Base::default_size) {}
+
+    /**
+     * Returns false, and leaves the old value alone, if key is already there.
+     */
+    bool insert(const K& key, const V& val) { return insert_impl(this->hash_of(key), key, val); }
+    template <typename Q, typename H = HashT, typename = typename H::is_transparent>
+    bool insert(const Q& key, const V& val) { return insert_impl(this->hash_of(key), key, val); }
+
+    /**
+     * Inserts, or overwrites the value if key is already there.
+     */
+    void insert_or_assign(const K& key, const V& val) { insert_or_assign_impl(this->hash_of(key), key, val); }
+    template <typename Q, typename H = HashT, typename = typename H::is_transparent>
+    void insert_or_assign(const Q& key, const V& val) {
+        insert_or_assign_impl(this->hash_of(key), key, val);
+    }
+
+    /**
+     * Returns false if key wasn't there.
+     */
+    bool erase(const K& key) { return erase_impl(this->hash_of(key), key); }
+    template <typename Q, typename H = HashT, typename = typename H::is_transparent>
+    bool erase(const Q& key) { return erase_impl(this->hash_of(key), key); }
+
+    bool contains(const K& key) const { return index_of(key) != Base::not_found; }
+    template <typename Q, typename H = HashT, typename = typename H::is_transparent>
+    bool contains(const Q& key) const {
+        return index_of(key) != Base::not_found;
+    }
+
+    /**
+     * Refers to the value in the table, so nothing is copied. Inserting or
+     * erasing invalidates it.
+     */
+    Maybe<V&> find(const K& key) { return find_impl(this->hash_of(key), key); }
+    Maybe<const V&> find(const K& key) const { return find_impl(this->hash_of(key), key); }
+    template <typename Q, typename H = HashT, typename = typename H::is_transparent>
+    Maybe<V&> find(const Q& key) { return find_impl(this->hash_of(key), key); }
+    template <typename Q, typename H = HashT, typename = typename H::is_transparent>
+    Maybe<const V&> find(const Q& key) const { return find_impl(this->hash_of(key), key); }
+
+    iterator begin() { return iterator(this->m_slots, this->m_ctrl, 0, this->m_capacity); }
+    iterator end() { return iterator(this->m_slots, this->m_ctrl, this->m_capacity, this->m_capacity); }
+    const_iterator begin() const { return const_iterator(this->m_slots, this->m_ctrl, 0, this->m_capacity); }
+    const_iterator end() const {
+        return const_iterator(this->m_slots, this->m_ctrl, this->m_capacity, this->m_capacity);
+    }
+
+    void print_debug_info() const {
+        std::lock_guard<std::mutex> lock(stdout_writer_lock());
+        this->print_slots(stdout_writer());
+    }
+
+private:
+    // Both hash once and call the _impl functions below.
+    template <typename, typename, typename, typename, typename> friend class ConcurrentHashMap;
+    friend class Interner;
+
+    template <typename Q>
+    size_t index_of(const Q& key) const {
+        return this->find_slot(this->hash_of(key), key);
+    }
+
+    // The _impl functions take key's hash, computed by the caller.
+    template <typename Q>
+    bool insert_impl(uint64_t hash, const Q& key, const V& val) {
+        if (this->find_slot(hash, key) != Base::not_found) {
+            return false;
+        }
+        insert_new(hash, key, val);
+        return true;
+    }
+
+    template <typename Q>
+    void insert_or_assign_impl(uint64_t hash, const Q& key, const V& val) {
+        const size_t i = this->find_slot(hash, key);
+        if (i != Base::not_found) {
+            this->m_slots[i].value = val;
+        } else {
+            insert_new(hash, key, val);
+        }
+    }
+
+    template <typename Q>
+    bool erase_impl(uint64_t hash, const Q& key) {
+        const size_t i = this->find_slot(hash, key);
+        if (i == Base::not_found) {
+            return false;
+        }
+        this->erase_at(i);
+        return true;
+    }
+
+    template <typename Q>
+    Maybe<V&> find_impl(uint64_t hash, const Q& key) const {
+        const size_t i = this->find_slot(hash, key);
+        if (i == Base::not_found) {
+            return Maybe<V&>();
+        }
+        return Maybe<V&>(this->m_slots[i].value);
+    }
+
+    // key must not be there yet.
+    // Copies key, and val if the table is about to move, before claiming a
+    // slot: both may point into the table.
+    template <typename Q>
+    void insert_new(uint64_t hash, const Q& key, const V& val) {
+        K stored = detail::make_key<K>(key, this->m_alloc);
+        if (this->must_grow()) {
+            V copy(val);
+            const size_t i = this->claim_slot(hash);
+            new (&this->m_slots[i]) Slot{hash, std::move(stored), std::move(copy)};
+        } else {
+            const size_t i = this->claim_slot(hash);
+            new (&this->m_slots[i]) Slot{hash, std::move(stored), val};
+        }
+    }
+};
+
+/**
+ * Set of K. Same table as HashMap, without the values.
+ * Iteration visits entries with .key.
+ */
+template <typename K, typename HashT = Hash<K>, typename EqT = Equal<K>,
+          typename Alloc = HeapAllocator>
+class HashSet : public detail::HashTable<detail::SetSlot<K>, HashT, EqT, Alloc> {
+    typedef detail::HashTable<detail::SetSlot<K>, HashT, EqT, Alloc> Base;
+    typedef detail::SetSlot<K> Slot;
+
+public:
+    typedef typename Base::template Iterator<const Slot> const_iterator;
+
+    explicit HashSet(size_t size, const Alloc& alloc = Alloc(),
+                     const HashT& hash = HashT(), const EqT& eq = EqT()) :
+        Base(size, alloc, hash, eq) {}
+    explicit HashSet(const Alloc& alloc) : HashSet(Base::default_size, alloc) {}
+    HashSet() : HashSet(Base::default_size) {}
+
+    /**
+     * Returns false if key was already there.
+     */
+    bool insert(const K& key) { return insert_impl(key); }
+    template <typename Q, typename H = HashT, typename = typename H::is_transparent>
+    bool insert(const Q& key) { return insert_impl(key); }
+
+    /**
+     * Returns false if key wasn't there.
+     */
+    bool erase(const K& key) { return erase_impl(key); }
+    template <typename Q, typename H = HashT, typename = typename H::is_transparent>
+    bool erase(const Q& key) { return erase_impl(key); }
+
+    bool contains(const K& key) const { return index_of(key) != Base::not_found; }
+    template <typename Q, typename H = HashT, typename = typename H::is_transparent>
+    bool contains(const Q& key) const {
+        return index_of(key) != Base::not_found;
+    }
+
+    const_iterator begin() const { return const_iterator(this->m_slots, this->m_ctrl, 0, this->m_capacity); }
+    const_iterator end() const {
+        return const_iterator(this->m_slots, this->m_ctrl, this->m_capacity, this->m_capacity);
+    }
+
+    void print_debug_info() const {
+        std::lock_guard<std::mutex> lock(stdout_writer_lock());
+        this->print_slots(stdout_writer());
+    }
+
+private:
+    template <typename Q>
+    size_t index_of(const Q& key) const {
+        return this->find_slot(this->hash_of(key), key);
+    }
+
+    template <typename Q>
+    bool insert_impl(const Q& key) {
+        const uint64_t hash = this->hash_of(key);
+        if (this->find_slot(hash, key) != Base::not_found) {
+            return false;
+        }
+        K stored = detail::make_key<K>(key, this->m_alloc);
+        const size_t i = this->claim_slot(hash);
+        new (&this->m_slots[i]) Slot{hash, std::move(stored)};
+        return true;
+    }
+
+    template <typename Q>
+    bool erase_impl(const Q& key) {
+        const size_t i = index_of(key);
+        if (i == Base::not_found) {
+            return false;
+        }
+        this->erase_at(i);
+        return true;
+    }
+};
+
+/**
+ * Hash table mapping Strings to ValT.
+ */
+template <typename ValT, typename Alloc = HeapAllocator>
+using Dict = HashMap<BasicString<Alloc>, ValT, Hash<BasicString<Alloc>>,
+                     Equal<BasicString<Alloc>>, Alloc>;
+
+////////////////////////////////////////////////////////////////////////////////
+// Interning
+////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * Handle to a string in an Interner. Two Symbols from the same Interner are
+ * equal exactly when their strings are, so comparing and hashing them is
+ * integer work. The default Symbol is invalid.
+ */
+struct Symbol {
+    uint32_t id;
+
+    Symbol() : id(0) {}
+    explicit Symbol(uint32_t symbol_id) : id(symbol_id) {}
+
+    bool valid() const { return id != 0; }
+    bool operator==(Symbol other) const { return id == other.id; }
+    bool operator!=(Symbol other) const { return id != other.id; }
+    bool operator<(Symbol other) const { return id < other.id; }
+};
+
+template <>
+struct Hash<Symbol> {
+    uint64_t operator()(Symbol symbol) const {
+        return hash_u64(symbol.id, hash_seed());
+    }
+};
+
+/**
+ * Deduplicates strings. Each distinct string is copied once, NUL-terminated,
+ * into an Arena, and gets the next Symbol id (1, 2, 3...). Ids are dense, so
+ * Array<T> indexed by id works as a map too.
+ *
+ * Strings are never freed or moved: str() views stay valid for the life of
+ * the Interner. Not thread safe.
+ */
+class Interner : public Noncopyable {
+public:
+    explicit Interner(size_t expected = 0) : m_ids(expected) {
+        m_strings.reserve(expected + 1);
+        m_strings.push_back(StringView());  // Id 0 is the invalid Symbol.
+    }
+
+    /**
+     * The Symbol for str, adding str if it is new.
+     */
+    Symbol intern(StringView str) {
+        // One hash and one probe; a miss goes straight to insert_new.
+        const uint64_t hash = m_ids.hash_of(str);
+        const Maybe<uint32_t&> id = m_ids.find_impl(hash, str);
+        if (id.valid()) {
+            return Symbol(id.value());
+        }
+        sgl_assert(m_strings.num_elements() < 0xffffffffu);
+        const size_t len = str.num_elements();
+        char* copy = (char*)m_chars.allocate(len + 1, 1);
+        memcpy(copy, str.ptr(), len);
+        copy[len] = '\0';
+        const StringView stored(copy, len);
+        const uint32_t new_id = (uint32_t)m_strings.num_elements();
+        m_strings.push_back(stored);
+        m_ids.insert_new(hash, stored, new_id);
+        return Symbol(new_id);
+    }
+
+    /**
+     * The Symbol for str if it was interned, or the invalid Symbol.
+     */
+    Symbol find(StringView str) const {
+        return m_ids.find(str).map([](uint32_t id) { return Symbol(id); }).value_or(Symbol());
+    }
+
+    /**
+     * NUL-terminated: str(s).ptr() is a C string.
+     */
+    StringView str(Symbol symbol) const {
+        sgl_assert(symbol.valid() && symbol.id < m_strings.num_elements());
+        return m_strings[symbol.id];
+    }
+
+    /**
+     * Number of distinct strings. Ids run from 1 to num_symbols().
+     */
+    size_t num_symbols() const {
+        return m_strings.num_elements() - 1;
+    }
+
+private:
+    Arena                         m_chars;
+    Array<StringView>             m_strings;  // By id.
+    HashMap<StringView, uint32_t> m_ids;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// Numbers
+////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * Room for anything format() writes, terminator included.
+ */
+static const size_t format_buffer_size = 32;
+
+namespace detail {
+
+static const char digit_pairs[201] =
+    "00010203040506070809"
+    "10111213141516171819"
+    "20212223242526272829"
+    "30313233343536373839"
+    "40414243444546474849"
+    "50515253545556575859"
+    "60616263646566676869"
+    "70717273747576777879"
+    "80818283848586878889"
+    "90919293949596979899";
+
+inline size_t count_digits(uint64_t x) {
+    size_t n = 1;
+    for (;;) {
+        if (x < 10) return n;
+        if (x < 100) return n + 1;
+        if (x < 1000) return n + 2;
+        if (x < 10000) return n + 3;
+        x /= 10000;
+        n += 4;
+    }
+}
+
+// Two digits per division, written back to front.
+inline size_t format_u64(uint64_t x, char* out) {
+    const size_t len = count_digits(x);
+    char* p = out + len;
+    *p = '\0';
+    while (x >= 100) {
+        const size_t i = (size_t)(x % 100) * 2;
+        x /= 100;
+        p -= 2;
+        p[0] = digit_pairs[i];
+        p[1] = digit_pairs[i + 1];
+    }
+    if (x >= 10) {
+        p[-2] = digit_pairs[x * 2];
+        p[-1] = digit_pairs[x * 2 + 1];
+    } else {
+        p[-1] = (char)('0' + x);
+    }
+    return len;
+}
+
+inline size_t format_i64(int64_t x, char* out) {
+    if (x < 0) {
+        *out = '-';
+        return 1 + format_u64(0 - (uint64_t)x, out + 1);
+    }
+    return format_u64((uint64_t)x, out);
+}
+
+/*
+ * Unsigned integer with room for any double scaled by the powers of ten
+ * that exact conversions need (a bit over 1100 bits). Lives on the stack.
+ */
+struct BigNum {
+    static const size_t max_words = 40;
+    uint32_t words[max_words];  // Least significant first.
+    size_t   size;              // No leading zero words.
+
+    explicit BigNum(uint64_t x = 0) : size(0) {
+        while (x) {
+            words[size++] = (uint32_t)x;
+            x >>= 32;
+        }
+    }
+
+    void mul_small(uint32_t m) {
+        uint64_t carry = 0;
+        for (size_t i = 0; i < size; ++i) {
+            const uint64_t t = (uint64_t)words[i] * m + carry;
+            words[i] = (uint32_t)t;
+            carry = t >> 32;
+        }
+        if (carry) {
+            sgl_assert(size < max_words);
+            words[size++] = (uint32_t)carry;
+        }
+    }
+
+    void mul_pow10(unsigned k) {
+        static const uint32_t small[10] = { 1, 10, 100, 1000, 10000, 100000, 1000000,
+                                            10000000, 100000000, 1000000000 };
+        for (; k >= 9; k -= 9) {
+            mul_small(small[9]);
+        }
+        if (k) {
+            mul_small(small[k]);
+        }
+    }
+
+    void shift_left(unsigned bits) {
+        if (size == 0) {
+            return;
+        }
+        const size_t w = bits / 32;
+        const unsigned b = bits % 32;
+        sgl_assert(size + w + 1 <= max_words);
+        words[size + w] = 0;
+        for (size_t i = size; i-- > 0;) {
+            if (b) {
+                words[i + w + 1] |= words[i] >> (32 - b);
+            }
+            words[i + w] = words[i] << b;
+        }
+        for (size_t i = 0; i < w; ++i) {
+            words[i] = 0;
+        }
+        size += w + 1;
+        trim();
+    }
+
+    void add(const BigNum& other) {
+        uint64_t carry = 0;
+        const size_t n = size > other.size ? size : other.size;
+        for (size_t i = 0; i < n; ++i) {
+            const uint64_t t = (uint64_t)(i < size ? words[i] : 0) +
+                               (i < other.size ? other.words[i] : 0) + carry;
+            words[i] = (uint32_t)t;
+            carry = t >> 32;
+        }
+        size = n;
+        if (carry) {
+            sgl_assert(size < max_words);
+            words[size++] = (uint32_t)carry;
+        }
+    }
+
+    // *this >= other.
+    void sub(const BigNum& other) {
+        int64_t borrow = 0;
+        for (size_t i = 0; i < size; ++i) {
+            int64_t t = (int64_t)words[i] - (i < other.size ? other.words[i] : 0) - borrow;
+            borrow = t < 0;
+            if (t < 0) {
+                t += (int64_t)1 << 32;
+            }
+            words[i] = (uint32_t)t;
+        }
+        trim();
+    }
+
+    void trim() {
+        while (size > 0 && words[size - 1] == 0) {
+            --size;
+        }
+    }
+
+    static int compare(const BigNum& a, const BigNum& b) {
+        if (a.size != b.size) {
+            return a.size < b.size ? -1 : 1;
+        }
+        for (size_t i = a.size; i-- > 0;) {
+            if (a.words[i] != b.words[i]) {
+                return a.words[i] < b.words[i] ? -1 : 1;
+            }
+        }
+        return 0;
+    }
+};
+
+/*
+ * Grisu3 (Loitsch, "Printing floating-point numbers quickly and accurately").
+ * Digits from 64-bit arithmetic against a cached power of ten; gives up,
+ * returning 0, on the few inputs where it can't prove the result is the
+ * shortest and closest. Same contract as shortest_digits otherwise.
+ */
+struct CachedPower {
+    uint64_t f;
+    int16_t  e;       // Binary exponent: 10^k ~= f * 2^e.
+    int16_t  k;
+};
+
+static const CachedPower cached_powers[] = {
+    { 0xfa8fd5a0081c0288ull, -1220, -348 }, { 0xbaaee17fa23ebf76ull, -1193, -340 },
+    { 0x8b16fb203055ac76ull, -1166, -332 }, { 0xcf42894a5dce35eaull, -1140, -324 },
+    { 0x9a6bb0aa55653b2dull, -1113, -316 }, { 0xe61acf033d1a45dfull, -1087, -308 },
+    { 0xab70fe17c79ac6caull, -1060, -300 }, { 0xff77b1fcbebcdc4full, -1034, -292 },
+    { 0xbe5691ef416bd60cull, -1007, -284 }, { 0x8dd01fad907ffc3cull, -980, -276 },
+    { 0xd3515c2831559a83ull, -954, -268 }, { 0x9d71ac8fada6c9b5ull, -927, -260 },
+    { 0xea9c227723ee8bcbull, -901, -252 }, { 0xaecc49914078536dull, -874, -244 },
+    { 0x823c12795db6ce57ull, -847, -236 }, { 0xc21094364dfb5637ull, -821, -228 },
+    { 0x9096ea6f3848984full, -794, -220 }, { 0xd77485cb25823ac7ull, -768, -212 },
+    { 0xa086cfcd97bf97f4ull, -741, -204 }, { 0xef340a98172aace5ull, -715, -196 },
+    { 0xb23867fb2a35b28eull, -688, -188 }, { 0x84c8d4dfd2c63f3bull, -661, -180 },
+    { 0xc5dd44271ad3cdbaull, -635, -172 }, { 0x936b9fcebb25c996ull, -608, -164 },
+    { 0xdbac6c247d62a584ull, -582, -156 }, { 0xa3ab66580d5fdaf6ull, -555, -148 },
+    { 0xf3e2f893dec3f126ull, -529, -140 }, { 0xb5b5ada8aaff80b8ull, -502, -132 },
+    { 0x87625f056c7c4a8bull, -475, -124 }, { 0xc9bcff6034c13053ull, -449, -116 },
+    { 0x964e858c91ba2655ull, -422, -108 }, { 0xdff9772470297ebdull, -396, -100 },
+    { 0xa6dfbd9fb8e5b88full, -369, -92 }, { 0xf8a95fcf88747d94ull, -343, -84 },
+    { 0xb94470938fa89bcfull, -316, -76 }, { 0x8a08f0f8bf0f156bull, -289, -68 },
+    { 0xcdb02555653131b6ull, -263, -60 }, { 0x993fe2c6d07b7facull, -236, -52 },
+    { 0xe45c10c42a2b3b06ull, -210, -44 }, { 0xaa242499697392d3ull, -183, -36 },
+    { 0xfd87b5f28300ca0eull, -157, -28 }, { 0xbce5086492111aebull, -130, -20 },
+    { 0x8cbccc096f5088ccull, -103, -12 }, { 0xd1b71758e219652cull, -77, -4 },
+    { 0x9c40000000000000ull, -50, 4 }, { 0xe8d4a51000000000ull, -24, 12 },
+    { 0xad78ebc5ac620000ull, 3, 20 }, { 0x813f3978f8940984ull, 30, 28 },
+    { 0xc097ce7bc90715b3ull, 56, 36 }, { 0x8f7e32ce7bea5c70ull, 83, 44 },
+    { 0xd5d238a4abe98068ull, 109, 52 }, { 0x9f4f2726179a2245ull, 136, 60 },
+    { 0xed63a231d4c4fb27ull, 162, 68 }, { 0xb0de65388cc8ada8ull, 189, 76 },
+    { 0x83c7088e1aab65dbull, 216, 84 }, { 0xc45d1df942711d9aull, 242, 92 },
+    { 0x924d692ca61be758ull, 269, 100 }, { 0xda01ee641a708deaull, 295, 108 },
+    { 0xa26da3999aef774aull, 322, 116 }, { 0xf209787bb47d6b85ull, 348, 124 },
+    { 0xb454e4a179dd1877ull, 375, 132 }, { 0x865b86925b9bc5c2ull, 402, 140 },
+    { 0xc83553c5c8965d3dull, 428, 148 }, { 0x952ab45cfa97a0b3ull, 455, 156 },
+    { 0xde469fbd99a05fe3ull, 481, 164 }, { 0xa59bc234db398c25ull, 508, 172 },
+    { 0xf6c69a72a3989f5cull, 534, 180 }, { 0xb7dcbf5354e9beceull, 561, 188 },
+    { 0x88fcf317f22241e2ull, 588, 196 }, { 0xcc20ce9bd35c78a5ull, 614, 204 },
+    { 0x98165af37b2153dfull, 641, 212 }, { 0xe2a0b5dc971f303aull, 667, 220 },
+    { 0xa8d9d1535ce3b396ull, 694, 228 }, { 0xfb9b7cd9a4a7443cull, 720, 236 },
+    { 0xbb764c4ca7a44410ull, 747, 244 }, { 0x8bab8eefb6409c1aull, 774, 252 },
+    { 0xd01fef10a657842cull, 800, 260 }, { 0x9b10a4e5e9913129ull, 827, 268 },
+    { 0xe7109bfba19c0c9dull, 853, 276 }, { 0xac2820d9623bf429ull, 880, 284 },
+    { 0x80444b5e7aa7cf85ull, 907, 292 }, { 0xbf21e44003acdd2dull, 933, 300 },
+    { 0x8e679c2f5e44ff8full, 960, 308 }, { 0xd433179d9c8cb841ull, 986, 316 },
+    { 0x9e19db92b4e31ba9ull, 1013, 324 }, { 0xeb96bf6ebadf77d9ull, 1039, 332 },
+    { 0xaf87023b9bf0ee6bull, 1066, 340 },
+};
+
+// Rounded high half of the product.
+inline uint64_t mul_round(uint64_t a, uint64_t b) {
+    mul128(&a, &b);
+    return b + (a >> 63);
+}
+
+// Moves the last digit down while that gets closer to w, and checks that
+// the digits are safely inside the interval (Grisu3's round_weed).
+inline bool round_weed(char* digits, size_t n, uint64_t distance_too_high_w,
+                       uint64_t unsafe_interval, uint64_t rest, uint64_t ten_kappa,
+                       uint64_t unit) {
+    const uint64_t small_distance = distance_too_high_w - unit;
+    const uint64_t big_distance = distance_too_high_w + unit;
+    while (rest < small_distance && unsafe_interval - rest >= ten_kappa &&
+           (rest + ten_kappa < small_distance ||
+            small_distance - rest >= rest + ten_kappa - small_distance)) {
+        --digits[n - 1];
+        rest += ten_kappa;
+    }
+    if (rest < big_distance && unsafe_interval - rest >= ten_kappa &&
+        (rest + ten_kappa < big_distance ||
+         big_distance - rest > rest + ten_kappa - big_distance)) {
+        return false;
+    }
+    return 2 * unit <= rest && rest <= unsafe_interval - 4 * unit;
+}
+
+inline size_t grisu_digits(uint64_t f, int e, bool uneven_gaps, char* digits, int* k) {
+    // The upper and lower neighbours' midpoints, normalized to a common exponent.
+    uint64_t plus = (f << 1) + 1;
+    int plus_e = e - 1;
+    while (!(plus >> 63)) {
+        plus <<= 1;
+        --plus_e;
+    }
+    uint64_t minus = uneven_gaps ? (f << 2) - 1 : (f << 1) - 1;
+    const int minus_e = uneven_gaps ? e - 2 : e - 1;
+    minus <<= minus_e - plus_e;
+    int w_e = e;
+    while (!(f >> 63)) {
+        f <<= 1;
+        --w_e;
+    }
+    sgl_assert(w_e == plus_e);
+
+    // A power of ten that puts the scaled exponent in [-60, -32].
+    const int min_e = -60 - (w_e + 64);
+    const int approx_k = (int)std::ceil((min_e + 63) * 0.30102999566398114);
+    const CachedPower& power = cached_powers[(348 + approx_k - 1) / 8 + 1];
+    const uint64_t w = mul_round(f, power.f);
+    uint64_t too_low = mul_round(minus, power.f) - 1;
+    uint64_t too_high = mul_round(plus, power.f) + 1;
+    const int shift = -(w_e + power.e + 64);
+    sgl_assert(shift >= 32 && shift <= 60);
+    const uint64_t one = (uint64_t)1 << shift;
+    uint64_t unsafe_interval = too_high - too_low;
+    uint64_t unit = 1;
+
+    static const uint32_t pow10[10] = { 1, 10, 100, 1000, 10000, 100000, 1000000,
+                                        10000000, 100000000, 1000000000 };
+    uint32_t integrals = (uint32_t)(too_high >> shift);
+    uint64_t fractionals = too_high & (one - 1);
+    int kappa = integrals ? (int)count_digits(integrals) : 0;
+    size_t n = 0;
+    while (kappa > 0) {
+        const uint32_t divisor = pow10[kappa - 1];
+        digits[n++] = (char)('0' + integrals / divisor);
+        integrals %= divisor;
+        --kappa;
+        const uint64_t rest = ((uint64_t)integrals << shift) + fractionals;
+        if (rest < unsafe_interval) {
+            *k = kappa - power.k + (int)n;
+            return round_weed(digits, n, too_high - w, unsafe_interval, rest,
+                              (uint64_t)divisor << shift, unit) ? n : 0;
+        }
+    }
+    for (;;) {
+        fractionals *= 10;
+        unit *= 10;
+        unsafe_interval *= 10;
+        digits[n++] = (char)('0' + (fractionals >> shift));
+        fractionals &= one - 1;
+        --kappa;
+        if (fractionals < unsafe_interval) {
+            *k = kappa - power.k + (int)n;
+            return round_weed(digits, n, (too_high - w) * unit, unsafe_interval, fractionals,
+                              one, unit) ? n : 0;
+        }
+    }
+}
+
+/*
+ * Shortest digits that read back as v = f * 2^e, a positive double or
+ * float. Grisu3 when it can; otherwise Burger & Dybvig's free-format
+ * algorithm, with exact BigNum arithmetic:
+ * digits are generated until the number is closer to v than to either
+ * neighbour of its type. v = 0.d1 d2 d3... * 10^k. Returns the digit count.
+ * uneven_gaps: f is a power of two above the smallest normal, so the gap
+ * below v is half as wide as the one above.
+ */
+inline size_t shortest_digits(uint64_t f, int e, bool uneven_gaps, char* digits, int* k) {
+    const bool even = (f & 1) == 0;
+    const size_t fast = grisu_digits(f, e, uneven_gaps, digits, k);
+    if (fast) {
+        return fast;
+    }
+
+    // v = r / s, and the neighbours are at (r - mm) / s and (r + mp) / s.
+    BigNum r(f), s(1), mp(1), mm(1);
+    if (e >= 0) {
+        r.shift_left((unsigned)e + (uneven_gaps ? 2 : 1));
+        s = BigNum(uneven_gaps ? 4 : 2);
+        mp.shift_left((unsigned)e + (uneven_gaps ? 1 : 0));
+        mm.shift_left((unsigned)e);
+    } else {
+        r.shift_left(uneven_gaps ? 2 : 1);
+        s.shift_left((unsigned)(uneven_gaps ? 2 - e : 1 - e));
+        if (uneven_gaps) {
+            mp = BigNum(2);
+        }
+    }
+
+    // Estimate k from the exponent; it is right or one too small.
+    int bitlen = 0;
+    while (bitlen < 64 && (f >> bitlen)) {
+        ++bitlen;
+    }
+    int est = (int)std::ceil((e + bitlen - 1) * 0.30102999566398114 - 1e-10);
+    if (est >= 0) {
+        s.mul_pow10((unsigned)est);
+    } else {
+        r.mul_pow10((unsigned)-est);
+        mp.mul_pow10((unsigned)-est);
+        mm.mul_pow10((unsigned)-est);
+    }
+    BigNum high(r);
+    high.add(mp);
+    const int c = BigNum::compare(high, s);
+    if (even ? c >= 0 : c > 0) {
+        ++est;
+    } else {
+        r.mul_small(10);
+        mp.mul_small(10);
+        mm.mul_small(10);
+    }
+    *k = est;
+
+    size_t n = 0;
+    for (;;) {
+        int d = 0;
+        while (BigNum::compare(r, s) >= 0) {
+            r.sub(s);
+            ++d;
+        }
+        const int low_cmp = BigNum::compare(r, mm);
+        const bool low = even ? low_cmp <= 0 : low_cmp < 0;
+        high = r;
+        high.add(mp);
+        const int high_cmp = BigNum::compare(high, s);
+        bool up = even ? high_cmp >= 0 : high_cmp > 0;
+        if (!low && !up) {
+            digits[n++] = (char)('0' + d);
+            r.mul_small(10);
+            mp.mul_small(10);
+            mm.mul_small(10);
+            continue;
+        }
+        if (low && up) {
+            BigNum twice(r);
+            twice.mul_small(2);
+            up = BigNum::compare(twice, s) >= 0;
+        }
+        sgl_assert(d + up <= 9);
+        digits[n++] = (char)('0' + d + up);
+        return n;
+    }
+}
+
+// v must be finite and > 0.
+inline size_t shortest_digits(double v, char* digits, int* k) {
+    uint64_t bits;
+    memcpy(&bits, &v, sizeof(bits));
+    const int biased = (int)((bits >> 52) & 0x7ff);
+    const uint64_t hidden = (uint64_t)1 << 52;
+    const uint64_t f = bits & (hidden - 1);
+    if (biased == 0) {
+        return shortest_digits(f, -1074, false, digits, k);
+    }
+    return shortest_digits(f | hidden, biased - 1075, f == 0 && biased > 1, digits, k);
+}
+
+inline size_t shortest_digits(float v, char* digits, int* k) {
+    uint32_t bits;
+    memcpy(&bits, &v, sizeof(bits));
+    const int biased = (int)((bits >> 23) & 0xff);
+    const uint32_t hidden = (uint32_t)1 << 23;
+    const uint32_t f = bits & (hidden - 1);
+    if (biased == 0) {
+        return shortest_digits(f, -149, false, digits, k);
+    }
+    return shortest_digits(f | hidden, biased - 150, f == 0 && biased > 1, digits, k);
+}
+
+/*
+ * Shortest text that reads back as the same double or float: fixed
+ * notation for exponents -5 to 16, scientific otherwise ("1e+300").
+ * "nan", "inf", "-inf".
+ */
+template <typename T>
+inline size_t format_shortest(T v, char* out) {
+    char* p = out;
+    if (std::isnan(v)) {
+        memcpy(out, "nan", 4);
+        return 3;
+    }
+    if (std::signbit(v)) {
+        *p++ = '-';
+        v = -v;
+    }
+    if (v == 0) {
+        memcpy(p, "0", 2);
+        return (size_t)(p - out) + 1;
+    }
+    if (std::isinf(v)) {
+        memcpy(p, "inf", 4);
+        return (size_t)(p - out) + 3;
+    }
+    // Integers below 2^digits are their own shortest form.
+    const T exact = (T)((uint64_t)1 << std::numeric_limits<T>::digits);
+    if (v < exact && v == (T)(uint64_t)v) {
+        return (size_t)(p - out) + format_u64((uint64_t)v, p);
+    }
+
+    char digits[20];
+    int k;
+    const size_t n = shortest_digits(v, digits, &k);
+    const int exp10 = k - 1;
+    if (exp10 >= 0 && exp10 < 17) {
+        const size_t int_digits = (size_t)exp10 + 1;
+        if (n <= int_digits) {
+            memcpy(p, digits, n);
+            memset(p + n, '0', int_digits - n);
+            p += int_digits;
+        } else {
+            memcpy(p, digits, int_digits);
+            p[int_digits] = '.';
+            memcpy(p + int_digits + 1, digits + int_digits, n - int_digits);
+            p += n + 1;
+        }
+    } else if (exp10 < 0 && exp10 >= -5) {
+        const size_t zeros = (size_t)(-exp10 - 1);
+        *p++ = '0';
+        *p++ = '.';
+        memset(p, '0', zeros);
+        memcpy(p + zeros, digits, n);
+        p += zeros + n;
+    } else {
+        *p++ = digits[0];
+        if (n > 1) {
+            *p++ = '.';
+            memcpy(p, digits + 1, n - 1);
+            p += n - 1;
+        }
+        *p++ = 'e';
+        *p++ = exp10 < 0 ? '-' : '+';
+        p += format_u64((uint64_t)(exp10 < 0 ? -exp10 : exp10), p);
+    }
+    *p = '\0';
+    return (size_t)(p - out);
+}
+
+inline bool is_digit(char c) {
+    return c >= '0' && c <= '9';
+}
+
+// Digits only, no sign. False if empty, not all digits, or too big.
+inline bool parse_u64(const char* p, const char* end, uint64_t* result) {
+    if (p == end) {
+        return false;
+    }
+    uint64_t x = 0;
+    for (; p < end; ++p) {
+        if (!is_digit(*p)) {
+            return false;
+        }
+        const uint64_t d = (uint64_t)(*p - '0');
+        if (x > (UINT64_MAX - d) / 10) {
+            return false;
+        }
+        x = x * 10 + d;
+    }
+    *result = x;
+    return true;
+}
+
+inline bool equals_ignoring_case(StringView str, const char* lower) {
+    const size_t len = strlen(lower);
+    if (str.num_elements() != len) {
+        return false;
+    }
+    for (size_t i = 0; i < len; ++i) {
+        const char c = str[i];
+        if ((c >= 'A' && c <= 'Z' ? (char)(c - 'A' + 'a') : c) != lower[i]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Rewrites a number parse_double accepted as [-]0.DIGITSeEXP into buffer,
+// which needs max_decimal_digits + 32 bytes. Digits past the first 800
+// significant ones can't change how a double or float rounds, except by
+// being nonzero, so they collapse into one sticky '1'.
+static const size_t max_decimal_digits = 800;
+
+inline void canonical_decimal(StringView str, char* buffer) {
+    const char* p = str.begin();
+    const char* end = str.end();
+    size_t n = 0;
+    if (p < end && (*p == '-' || *p == '+')) {
+        if (*p++ == '-') {
+            buffer[n++] = '-';
+        }
+    }
+    buffer[n++] = '0';
+    buffer[n++] = '.';
+    int64_t exp10 = 0;  // Of the digit before the first one written.
+    size_t digits = 0;
+    bool point = false;
+    bool sticky = false;
+    for (; p < end && (*p == '.' || is_digit(*p)); ++p) {
+        if (*p == '.') {
+            point = true;
+        } else if (digits == 0 && *p == '0') {
+            exp10 -= point;
+        } else {
+            exp10 += !point;
+            if (digits < max_decimal_digits) {
+                buffer[n++] = *p;
+                ++digits;
+            } else {
+                sticky |= *p != '0';
+            }
+        }
+    }
+    if (sticky) {
+        buffer[n++] = '1';
+    }
+    if (digits == 0) {
+        buffer[n++] = '0';
+    }
+    if (p < end && (*p == 'e' || *p == 'E')) {
+        ++p;
+        bool negative = false;
+        if (p < end && (*p == '-' || *p == '+')) {
+            negative = *p++ == '-';
+        }
+        int64_t e = 0;
+        for (; p < end && is_digit(*p); ++p) {
+            if (e < 100000) {  // Over or underflows either way.
+                e = e * 10 + (*p - '0');
+            }
+        }
+        exp10 += negative ? -e : e;
+    }
+    buffer[n++] = 'e';
+    format_i64(exp10, buffer + n);
+}
+
+#if defined(__linux__) || defined(__MACH__)
+// The C locale, so that '.' is the decimal point whatever setlocale says.
+inline locale_t c_locale() {
+    static const locale_t locale = newlocale(LC_ALL_MASK, "C", (locale_t)0);
+    return locale;
+}
+#elif defined(_WIN32)
+inline _locale_t c_locale() {
+    static const _locale_t locale = _create_locale(LC_ALL, "C");
+    return locale;
+}
+#endif
+
+// Anything parse_double's fast path can't do exactly goes through strtod,
+// in the C locale, on the canonical form. Nothing is allocated.
+inline double parse_double_slow(StringView str) {
+    char buffer[max_decimal_digits + 32];
+    canonical_decimal(str, buffer);
+#if defined(__linux__) || defined(__MACH__)
+    return c_locale() ? strtod_l(buffer, NULL, c_locale()) : strtod(buffer, NULL);
+#elif defined(_WIN32)
+    return c_locale() ? _strtod_l(buffer, NULL, c_locale()) : strtod(buffer, NULL);
+#else
+    return strtod(buffer, NULL);  // Assumes the C locale.
+#endif
+}
+
+inline float parse_float_slow(StringView str) {
+    char buffer[max_decimal_digits + 32];
+    canonical_decimal(str, buffer);
+#if defined(__linux__) || defined(__MACH__)
+    return c_locale() ? strtof_l(buffer, NULL, c_locale()) : strtof(buffer, NULL);
+#elif defined(_WIN32)
+    return c_locale() ? _strtof_l(buffer, NULL, c_locale()) : strtof(buffer, NULL);
+#else
+    return strtof(buffer, NULL);  // Assumes the C locale.
+#endif
+}
+
+// True if d is exactly halfway between two floats. Rounding such a double
+// to float can go the wrong way for the decimal it came from; any other
+// double rounds to the same float as that decimal would.
+inline bool is_float_midpoint(double d) {
+    const float f = (float)d;
+    if ((double)f == d || std::isnan(d)) {
+        return false;
+    }
+    if (std::isinf(f)) {
+        const double max = std::numeric_limits<float>::max();
+        return std::fabs(d) == max + std::ldexp(1.0, 103);  // Half an ulp above FLT_MAX.
+    }
+    const float other = std::nextafter(f, d > (double)f ? HUGE_VALF : -HUGE_VALF);
+    return d == ((double)f + (double)other) / 2;
+}
+
+// [sign] digits [. digits] [e [sign] digits], or inf, infinity, nan.
+inline bool parse_double(StringView str, double* result) {
+    static const double pow10[23] = {
+        1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+        1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+    };
+    const char* p = str.begin();
+    const char* end = str.end();
+    bool negative = false;
+    if (p < end && (*p == '-' || *p == '+')) {
+        negative = *p++ == '-';
+    }
+    const StringView word(p, (size_t)(end - p));
+    if (equals_ignoring_case(word, "inf") || equals_ignoring_case(word, "infinity")) {
+        *result = negative ? -HUGE_VAL : HUGE_VAL;
+        return true;
+    }
+    if (equals_ignoring_case(word, "nan")) {
+        *result = NAN;
+        return true;
+    }
+
+    uint64_t mantissa = 0;
+    int significant = 0;  // Digits in mantissa, after leading zeros.
+    int exp10 = 0;
+    bool any_digits = false;
+    bool truncated = false;
+    for (; p < end && is_digit(*p); ++p) {
+        any_digits = true;
+        if (significant < 19) {
+            mantissa = mantissa * 10 + (uint64_t)(*p - '0');
+            significant += mantissa != 0;
+        } else {
+            ++exp10;
+            truncated |= *p != '0';
+        }
+    }
+    if (p < end && *p == '.') {
+        for (++p; p < end && is_digit(*p); ++p) {
+            any_digits = true;
+            if (significant < 19) {
+                mantissa = mantissa * 10 + (uint64_t)(*p - '0');
+                significant += mantissa != 0;
+                --exp10;
+            } else {
+                truncated |= *p != '0';
+            }
+        }
+    }
+    if (!any_digits) {
+        return false;
+    }
+    if (p < end && (*p == 'e' || *p == 'E')) {
+        ++p;
+        bool exp_negative = false;
+        if (p < end && (*p == '-' || *p == '+')) {
+            exp_negative = *p++ == '-';
+        }
+        uint64_t e;
+        if (!parse_u64(p, end, &e)) {
+            return false;
+        }
+        if (e > 100000) {
+            e = 100000;  // Over or underflows either way.
+        }
+        exp10 += exp_negative ? -(int)e : (int)e;
+    } else if (p != end) {
+        return false;
+    }
+
+    // Both operands exact, so the one rounding is the right one (Clinger).
+    double value;
+    if (!truncated && mantissa <= ((uint64_t)1 << 53) && exp10 >= -22 && exp10 <= 22) {
+        value = (double)mantissa;
+        value = exp10 < 0 ? value / pow10[-exp10] : value * pow10[exp10];
+    } else if (mantissa == 0 && !truncated) {
+        value = 0;
+    } else {
+        *result = parse_double_slow(str);
+        return true;
+    }
+    *result = negative ? -value : value;
+    return true;
+}
+
+}  // namespace detail
+
+/**
+ * Writes value into out, which needs format_buffer_size bytes, and
+ * NUL-terminates it. Returns the length. Never allocates and ignores the
+ * locale.
+ *
+ * Floats and doubles come out in the shortest form that parses back to
+ * the same value of the same type: 0.1 and 0.1f are "0.1", 1e300 is
+ * "1e+300". A long double is formatted as a double.
+ */
+template <typename T>
+typename std::enable_if<std::is_integral<T>::value && std::is_signed<T>::value, size_t>::type
+format(T value, char* out) {
+    return detail::format_i64((int64_t)value, out);
+}
+
+template <typename T>
+typename std::enable_if<std::is_integral<T>::value && !std::is_signed<T>::value, size_t>::type
+format(T value, char* out) {
+    return detail::format_u64((uint64_t)value, out);
+}
+
+template <typename T>
+typename std::enable_if<std::is_floating_point<T>::value, size_t>::type
+format(T value, char* out) {
+    typedef typename std::conditional<std::is_same<T, float>::value, float, double>::type F;
+    return detail::format_shortest((F)value, out);
+}
+
+/**
+ * Appends value to out.
+ */
+template <typename T, typename Alloc>
+void format(T value, BasicString<Alloc>* out) {
+    char buffer[format_buffer_size];
+    out->append(buffer, format(value, buffer));
+}
+
+/**
+ * Parses all of str as a T: parse<int64_t>("-42"). Invalid on anything
+ * else, including surrounding spaces and values that don't fit.
+ * Ignores the locale.
+ */
+template <typename T>
+typename std::enable_if<std::is_integral<T>::value && std::is_signed<T>::value, Maybe<T>>::type
+parse(StringView str) {
+    const char* p = str.begin();
+    const bool negative = p < str.end() && *p == '-';
+    if (p < str.end() && (*p == '-' || *p == '+')) {
+        ++p;
+    }
+    uint64_t magnitude;
+    if (!detail::parse_u64(p, str.end(), &magnitude)) {
+        return Maybe<T>();
+    }
+    const uint64_t max = (uint64_t)std::numeric_limits<T>::max();
+    if (magnitude > max + (negative ? 1 : 0)) {
+        return Maybe<T>();
+    }
+    return Maybe<T>(negative ? (T)(0 - magnitude) : (T)magnitude);
+}
+
+template <typename T>
+typename std::enable_if<std::is_integral<T>::value && !std::is_signed<T>::value, Maybe<T>>::type
+parse(StringView str) {
+    const char* p = str.begin();
+    if (p < str.end() && *p == '+') {
+        ++p;
+    }
+    uint64_t value;
+    if (!detail::parse_u64(p, str.end(), &value) ||
+        value > (uint64_t)std::numeric_limits<T>::max()) {
+        return Maybe<T>();
+    }
+    return Maybe<T>((T)value);
+}
+
+/**
+ * Correctly rounded. Common inputs (up to 19 digits, exponents within 22)
+ * take a fast exact path; the rest fall back to strtod.
+ */
+template <typename T>
+typename std::enable_if<std::is_floating_point<T>::value, Maybe<T>>::type
+parse(StringView str) {
+    double value;
+    if (!detail::parse_double(str, &value)) {
+        return Maybe<T>();
+    }
+    return Maybe<T>((T)value);
+}
+
+/**
+ * Rounds once, straight to float: going through a double that lands
+ * halfway between two floats would round twice.
+ */
+template <>
+inline Maybe<float> parse<float>(StringView str) {
+    double value;
+    if (!detail::parse_double(str, &value)) {
+        return Maybe<float>();
+    }
+    if (detail::is_float_midpoint(value)) {
+        return Maybe<float>(detail::parse_float_slow(str));
+    }
+    return Maybe<float>((float)value);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Sorting and searching
+////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * Ordering functor used by default by sort, stable_sort and lower_bound.
+ */
+template <typename T>
+struct Less {
+    bool operator()(const T& a, const T& b) const {
+        return a < b;
+    }
+};
+
+namespace detail {
+
+static const size_t insertion_sort_threshold = 24;
+static const size_t ninther_threshold = 128;
+static const size_t partial_insertion_sort_limit = 8;
+
+template <typename T, typename LessT>
+inline void insertion_sort(T* begin, T* end, const LessT& less) {
+    if (begin == end) {
+        return;
+    }
+    for (T* cur = begin + 1; cur != end; ++cur) {
+        if (less(*cur, *(cur - 1))) {
+            T tmp(std::move(*cur));
+            T* sift = cur;
+            do {
+                *sift = std::move(*(sift - 1));
+                --sift;
+            } while (sift != begin && less(tmp, *(sift - 1)));
+            *sift = std::move(tmp);
+        }
+    }
+}
+
+// Same, but *(begin - 1) must be no greater than anything in the range,
+// which saves the bounds check.
+template <typename T, typename LessT>
+inline void unguarded_insertion_sort(T* begin, T* end, const LessT& less) {
+    if (begin == end) {
+        return;
+    }
+    for (T* cur = begin + 1; cur != end; ++cur) {
+        if (less(*cur, *(cur - 1))) {
+            T tmp(std::move(*cur));
+            T* sift = cur;
+            do {
+                *sift = std::move(*(sift - 1));
+                --sift;
+            } while (less(tmp, *(sift - 1)));
+            *sift = std::move(tmp);
+        }
+    }
+}
+
+// Insertion sort that gives up, returning false, once it has moved more
+// than a few elements.
+template <typename T, typename LessT>
+inline bool partial_insertion_sort(T* begin, T* end, const LessT& less) {
+    if (begin == end) {
+        return true;
+    }
+    size_t moved = 0;
+    for (T* cur = begin + 1; cur != end; ++cur) {
+        if (less(*cur, *(cur - 1))) {
+            T tmp(std::move(*cur));
+            T* sift = cur;
+            do {
+                *sift = std::move(*(sift - 1));
+                --sift;
+            } while (sift != begin && less(tmp, *(sift - 1)));
+            *sift = std::move(tmp);
+            moved += (size_t)(cur - sift);
+        }
+        if (moved > partial_insertion_sort_limit) {
+            return false;
+        }
+    }
+    return true;
+}
+
+template <typename T, typename LessT>
+inline void sort2(T* a, T* b, const LessT& less) {
+    if (less(*b, *a)) std::swap(*a, *b);
+}
+
+template <typename T, typename LessT>
+inline void sort3(T* a, T* b, T* c, const LessT& less) {
+    sort2(a, b, less);
+    sort2(b, c, less);
+    sort2(a, b, less);
+}
+
+template <typename T, typename LessT>
+void sift_down(T* heap, size_t i, size_t n, const LessT& less) {
+    T tmp(std::move(heap[i]));
+    for (;;) {
+        size_t child = 2 * i + 1;
+        if (child >= n) break;
+        if (child + 1 < n && less(heap[child], heap[child + 1])) ++child;
+        if (!less(tmp, heap[child])) break;
+        heap[i] = std::move(heap[child]);
+        i = child;
+    }
+    heap[i] = std::move(tmp);
+}
+
+template <typename T, typename LessT>
+void heap_sort(T* begin, T* end, const LessT& less) {
+    const size_t n = (size_t)(end - begin);
+    for (size_t i = n / 2; i > 0; --i) {
+        sift_down(begin, i - 1, n, less);
+    }
+    for (size_t i = n; i > 1; --i) {
+        std::swap(begin[0], begin[i - 1]);
+        sift_down(begin, 0, i - 1, less);
+    }
+}
+
+// Partitions around *begin: smaller elements to the left, the rest to the
+// right. Returns where the pivot ended up, and whether nothing had to move.
+// Needs an element no less than the pivot after it, which the median
+// selection guarantees.
+template <typename T, typename LessT>
+T* partition_right(T* begin, T* end, const LessT& less, bool* already_partitioned) {
+    T pivot(std::move(*begin));
+    T* first = begin;
+    T* last  = end;
+    while (less(*++first, pivot)) {}
+    if (first - 1 == begin) {
+        while (first < last && !less(*--last, pivot)) {}
+    } else {
+        while (!less(*--last, pivot)) {}
+    }
+    *already_partitioned = first >= last;
+    while (first < last) {
+        std::swap(*first, *last);
+        while (less(*++first, pivot)) {}
+        while (!less(*--last, pivot)) {}
+    }
+    T* pivot_pos = first - 1;
+    *begin = std::move(*pivot_pos);
+    *pivot_pos = std::move(pivot);
+    return pivot_pos;
+}
+
+// Puts everything equal to the pivot *begin on the left. Used when the
+// pivot equals the element before the range, so all of that side is done.
+template <typename T, typename LessT>
+T* partition_left(T* begin, T* end, const LessT& less) {
+    T pivot(std::move(*begin));
+    T* first = begin;
+    T* last  = end;
+    while (less(pivot, *--last)) {}
+    if (last + 1 == end) {
+        while (first < last && !less(pivot, *++first)) {}
+    } else {
+        while (!less(pivot, *++first)) {}
+    }
+    while (first < last) {
+        std::swap(*first, *last);
+        while (less(pivot, *--last)) {}
+        while (!less(pivot, *++first)) {}
+    }
+    T* pivot_pos = last;
+    *begin = std::move(*pivot_pos);
+    *pivot_pos = std::move(pivot);
+    return pivot_pos;
+}
+
+template <typename T, typename LessT>
+void pdqsort_loop(T* begin, T* end, const LessT& less, int bad_allowed, bool leftmost) {
+    for (;;) {
+        const size_t size = (size_t)(end - begin);
+        if (size < insertion_sort_threshold) {
+            if (leftmost) {
+                insertion_sort(begin, end, less);
+            } else {
+                unguarded_insertion_sort(begin, end, less);
+            }
+            return;
+        }
+
+        // Median of 3, or pseudo-median of 9 for big ranges, into *begin.
+        const size_t s2 = size / 2;
+        if (size > ninther_threshold) {
+            sort3(begin, begin + s2, end - 1, less);
+            sort3(begin + 1, begin + (s2 - 1), end - 2, less);
+            sort3(begin + 2, begin + (s2 + 1), end - 3, less);
+            sort3(begin + (s2 - 1), begin + s2, begin + (s2 + 1), less);
+            std::swap(*begin, *(begin + s2));
+        } else {
+            sort3(begin + s2, begin, end - 1, less);
+        }
+
+        // Lots of equal elements: skip past all of them in one go.
+        if (!leftmost && !less(*(begin - 1), *begin)) {
+            begin = partition_left(begin, end, less) + 1;
+            continue;
+        }
+
+        bool already_partitioned;
+        T* pivot_pos = partition_right(begin, end, less, &already_partitioned);
+        const size_t l_size = (size_t)(pivot_pos - begin);
+        const size_t r_size = (size_t)(end - (pivot_pos + 1));
+
+        if (l_size < size / 8 || r_size < size / 8) {
+            // Bad pivot. After too many, switch to heap sort so the worst
+            // case stays O(n log n). Otherwise shuffle a few elements to
+            // break up whatever pattern caused it.
+            if (--bad_allowed == 0) {
+                heap_sort(begin, end, less);
+                return;
+            }
+            if (l_size >= insertion_sort_threshold) {
+                std::swap(*begin, *(begin + l_size / 4));
+                std::swap(*(pivot_pos - 1), *(pivot_pos - l_size / 4));
+                if (l_size > ninther_threshold) {
+                    std::swap(*(begin + 1), *(begin + (l_size / 4 + 1)));
+                    std::swap(*(begin + 2), *(begin + (l_size / 4 + 2)));
+                    std::swap(*(pivot_pos - 2), *(pivot_pos - (l_size / 4 + 1)));
+                    std::swap(*(pivot_pos - 3), *(pivot_pos - (l_size / 4 + 2)));
+                }
+            }
+            if (r_size >= insertion_sort_threshold) {
+                std::swap(*(pivot_pos + 1), *(pivot_pos + (1 + r_size / 4)));
+                std::swap(*(end - 1), *(end - r_size / 4));
+                if (r_size > ninther_threshold) {
+                    std::swap(*(pivot_pos + 2), *(pivot_pos + (2 + r_size / 4)));
+                    std::swap(*(pivot_pos + 3), *(pivot_pos + (3 + r_size / 4)));
+                    std::swap(*(end - 2), *(end - (1 + r_size / 4)));
+                    std::swap(*(end - 3), *(end - (2 + r_size / 4)));
+                }
+            }
+        } else if (already_partitioned &&
+                   partial_insertion_sort(begin, pivot_pos, less) &&
+                   partial_insertion_sort(pivot_pos + 1, end, less)) {
+            // Looked sorted, and was.
+            return;
+        }
+
+        // Recurse on the left, loop on the right.
+        pdqsort_loop(begin, pivot_pos, less, bad_allowed, leftmost);
+        begin = pivot_pos + 1;
+        leftmost = false;
+    }
+}
+
+// Merge sort. buffer has room for (end - begin) / 2 + 1 uninitialized Ts.
+template <typename T, typename LessT>
+void merge_sort(T* begin, T* end, T* buffer, const LessT& less) {
+    const size_t n = (size_t)(end - begin);
+    if (n <= insertion_sort_threshold) {
+        insertion_sort(begin, end, less);
+        return;
+    }
+    T* mid = begin + n / 2;
+    merge_sort(begin, mid, buffer, less);
+    merge_sort(mid, end, buffer, less);
+    if (!less(*mid, *(mid - 1))) {
+        return;  // Already in order.
+    }
+    // Move the left run out, then merge back into place. Ties take the
+    // left element, which keeps the sort stable.
+    const size_t left = (size_t)(mid - begin);
+    for (size_t i = 0; i < left; ++i) {
+        new (buffer + i) T(std::move(begin[i]));
+    }
+    T* a = buffer;
+    T* a_end = buffer + left;
+    T* b = mid;
+    T* out = begin;
+    while (a != a_end && b != end) {
+        if (less(*b, *a)) {
+            *out++ = std::move(*b++);
+        } else {
+            *out++ = std::move(*a++);
+        }
+    }
+    while (a != a_end) {
+        *out++ = std::move(*a++);
+    }
+    destroy(buffer, left);
+}
+
+template <typename T>
+struct RadixKey {
+    // Unsigned integers sort as they are; signed ones with the sign bit
+    // flipped.
+    typedef typename std::make_unsigned<T>::type Bits;
+    static Bits bits(T x) {
+        return std::is_signed<T>::value ? (Bits)((Bits)x ^ ((Bits)1 << (sizeof(T) * 8 - 1))) : (Bits)x;
+    }
+};
+
+template <typename F, typename B>
+struct RadixFloatKey {
+    // Positive floats: flip the sign bit. Negative ones: flip everything,
+    // so that bigger magnitudes come first.
+    typedef B Bits;
+    static Bits bits(F x) {
+        Bits b;
+        memcpy(&b, &x, sizeof(b));
+        const Bits sign = (Bits)1 << (sizeof(B) * 8 - 1);
+        return (b & sign) ? (Bits)~b : (Bits)(b | sign);
+    }
+};
+
+template <>
+struct RadixKey<float> : RadixFloatKey<float, uint32_t> {};
+template <>
+struct RadixKey<double> : RadixFloatKey<double, uint64_t> {};
+
+template <typename T>
+struct Identity {
+    const T& operator()(const T& x) const { return x; }
+};
+
+}  // namespace detail
+
+/**
+ * Unstable in-place sort: pattern-defeating quicksort. Median-of-3 (or
+ * of 9) pivots, insertion sort below 24 elements, detection of already
+ * sorted runs and of many equal keys, and heap sort when pivots keep
+ * coming out bad, so it's O(n log n) in the worst case.
+ */
+template <typename T, typename LessT>
+void sort(T* begin, T* end, const LessT& less) {
+    const size_t n = (size_t)(end - begin);
+    int log2 = 0;
+    for (size_t s = n; s > 1; s >>= 1) {
+        ++log2;
+    }
+    detail::pdqsort_loop(begin, end, less, log2 + 1, true);
+}
+
+template <typename T, typename A, typename LessT>
+void sort(Array<T, A>& array, const LessT& less) {
+    sort(array.begin(), array.end(), less);
+}
+
+template <typename T, typename A>
+void sort(Array<T, A>& array) {
+    sort(array.begin(), array.end(), Less<T>());
+}
+
+/**
+ * Stable sort: merge sort with insertion sort at the leaves. Allocates
+ * room for half the elements.
+ */
+template <typename T, typename LessT>
+void stable_sort(T* begin, T* end, const LessT& less) {
+    const size_t n = (size_t)(end - begin);
+    if (n <= detail::insertion_sort_threshold) {
+        detail::insertion_sort(begin, end, less);
+        return;
+    }
+    HeapAllocator heap;
+    const size_t size = (n / 2 + 1) * sizeof(T);
+    T* buffer = (T*)heap.allocate(size, alignof(T));
+    detail::merge_sort(begin, end, buffer, less);
+    heap.deallocate(buffer, size, alignof(T));
+}
+
+template <typename T, typename A, typename LessT>
+void stable_sort(Array<T, A>& array, const LessT& less) {
+    stable_sort(array.begin(), array.end(), less);
+}
+
+template <typename T, typename A>
+void stable_sort(Array<T, A>& array) {
+    stable_sort(array.begin(), array.end(), Less<T>());
+}
+
+/**
+ * Stable LSD radix sort, a byte per pass, on key(element), which must be
+ * an integer or a floating point number. All byte histograms are counted
+ * in one read of the data, and passes where every key has the same byte
+ * are skipped, so 64-bit ids that only use their low bits take few passes.
+ * Floats sort by value, -0 before +0, NaNs at the ends.
+ *
+ * Needs a trivially copyable T and allocates a second array of n elements.
+ * Small inputs go to sort() instead.
+ *
+ * radix_sort(ids);
+ * radix_sort(records, [](const Record& r) { return r.timestamp; });
+ */
+template <typename T, typename A, typename KeyF>
+void radix_sort(Array<T, A>& array, const KeyF& key) {
+    static_assert(std::is_trivially_copyable<T>::value, "radix_sort needs a trivially copyable T");
+    typedef typename std::decay<typename std::result_of<KeyF(const T&)>::type>::type K;
+    typedef detail::RadixKey<K> Radix;
+    typedef typename Radix::Bits Bits;
+    static const size_t passes = sizeof(Bits);
+
+    const size_t n = array.num_elements();
+    if (n < 256) {
+        stable_sort(array.begin(), array.end(), [&key](const T& a, const T& b) {
+            return Radix::bits(key(a)) < Radix::bits(key(b));
+        });
+        return;
+    }
+
+    size_t counts[passes][256];
+    memset(counts, 0, sizeof(counts));
+    T* src = array.ptr();
+    for (size_t i = 0; i < n; ++i) {
+        const Bits b = Radix::bits(key(src[i]));
+        for (size_t p = 0; p < passes; ++p) {
+            ++counts[p][(b >> (p * 8)) & 0xff];
+        }
+    }
+
+    HeapAllocator heap;
+    T* const buffer = (T*)heap.allocate(n * sizeof(T), alignof(T));
+    T* dst = buffer;
+    const Bits first = Radix::bits(key(src[0]));
+    for (size_t p = 0; p < passes; ++p) {
+        size_t* count = counts[p];
+        if (count[(first >> (p * 8)) & 0xff] == n) {
+            continue;  // Every key has the same byte here.
+        }
+        size_t offset = 0;
+        for (size_t d = 0; d < 256; ++d) {
+            const size_t c = count[d];
+            count[d] = offset;
+            offset += c;
+        }
+        for (size_t i = 0; i < n; ++i) {
+            const size_t d = (size_t)(Radix::bits(key(src[i])) >> (p * 8)) & 0xff;
+            memcpy((void*)&dst[count[d]++], (const void*)&src[i], sizeof(T));
+        }
+        T* tmp = src;
+        src = dst;
+        dst = tmp;
+    }
+    if (src != array.ptr()) {
+        memcpy((void*)array.ptr(), (const void*)src, n * sizeof(T));
+    }
+    heap.deallocate(buffer, n * sizeof(T), alignof(T));
+}
+
+template <typename T, typename A>
+void radix_sort(Array<T, A>& array) {
+    radix_sort(array, detail::Identity<T>());
+}
+
+/**
+ * Index of the first element of the sorted range that is not less than
+ * value, or n. The loop has no data-dependent branch, just a conditional
+ * move per halving, so it doesn't pay for mispredictions.
+ */
+template <typename T, typename Q, typename LessT>
+size_t lower_bound(const T* data, size_t n, const Q& value, const LessT& less) {
+    if (n == 0) {
+        return 0;
+    }
+    const T* base = data;
+    while (n > 1) {
+        const size_t half = n / 2;
+        base = less(base[half], value) ? base + half : base;
+        n -= half;
+    }
+    return (size_t)(base - data) + (less(*base, value) ? 1 : 0);
+}
+
+template <typename T, typename A, typename Q, typename LessT>
+size_t lower_bound(const Array<T, A>& array, const Q& value, const LessT& less) {
+    return lower_bound(array.ptr(), array.num_elements(), value, less);
+}
+
+template <typename T, typename A>
+size_t lower_bound(const Array<T, A>& array, const T& value) {
+    return lower_bound(array.ptr(), array.num_elements(), value, Less<T>());
+}
+
+/**
+ * Sorted elements stored in Eytzinger (BFS) order: the children of k are
+ * 2k and 2k + 1. A search walks down from the root, and the next levels
+ * are contiguous, so they can be prefetched while comparing. Faster than
+ * binary search on a sorted array once it no longer fits in cache.
+ *
+ * Built once from sorted data; read-only afterwards.
+ */
+template <typename T, typename LessT = Less<T>>
+class EytzingerArray {
+public:
+    EytzingerArray(const T* sorted, size_t n, const LessT& less = LessT()) : m_less(less) {
+        build(sorted, n);
+    }
+
+    template <typename A>
+    explicit EytzingerArray(const Array<T, A>& sorted, const LessT& less = LessT()) : m_less(less) {
+        build(sorted.ptr(), sorted.num_elements());
+    }
+
+    /**
+     * First element not less than value, or NULL.
+     */
+    template <typename Q>
+    const T* lower_bound(const Q& value) const {
+        const size_t n = num_elements();
+        const T* data = m_data.ptr();
+        size_t k = 1;
+        while (k <= n) {
+#if defined(__GNUC__) || defined(__clang__)
+            // Four levels down, sixteen elements: one cache line of ints.
+            __builtin_prefetch(data + k * 16);
+#endif
+            k = 2 * k + (m_less(data[k], value) ? 1 : 0);
+        }
+        // Undo the right turns taken after the last left turn.
+        k >>= detail::ctz64(~(uint64_t)k) + 1;
+        return k ? &data[k] : NULL;
+    }
+
+    template <typename Q>
+    bool contains(const Q& value) const {
+        const T* found = lower_bound(value);
+        return found && !m_less(value, *found);
+    }
+
+    size_t num_elements() const {
+        return m_data.num_elements() ? m_data.num_elements() - 1 : 0;
+    }
+
+private:
+    void build(const T* sorted, size_t n) {
+        if (n == 0) {
+            return;
+        }
+        m_data.reserve(n + 1);
+        m_data.resize(n + 1, sorted[0]);  // Slot 0 is unused.
+        size_t next = 0;
+        fill(sorted, n, 1, &next);
+    }
+
+    // In-order walk of the implicit tree, taking sorted elements in order.
+    void fill(const T* sorted, size_t n, size_t k, size_t* next) {
+        if (k <= n) {
+            fill(sorted, n, 2 * k, next);
+            m_data[k] = sorted[(*next)++];
+            fill(sorted, n, 2 * k + 1, next);
+        }
+    }
+
+    Array<T> m_data;
+    LessT    m_less;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// Files
+////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * Read-only pointer and count. The Ts belong to someone else.
+ */
+template <typename T>
+class ArrayView {
+public:
+    ArrayView() : m_ptr(NULL), m_len(0) {}
+    ArrayView(const T* ptr, size_t len) : m_ptr(ptr), m_len(len) {}
+    template <typename A>
+    ArrayView(const Array<T, A>& array) : m_ptr(array.ptr()), m_len(array.num_elements()) {}
+
+    const T& operator[](size_t i) const {
+        sgl_assert(i < m_len);
+        return m_ptr[i];
+    }
+
+    const T* ptr() const { return m_ptr; }
+    size_t num_elements() const { return m_len; }
+    const T* begin() const { return m_ptr; }
+    const T* end() const { return m_ptr + m_len; }
+
+private:
+    const T* m_ptr;
+    size_t   m_len;
+};
+
+/**
+ * A whole file mapped read-only into memory. Reading it is reading memory:
+ * nothing is copied, and pages are loaded by the OS as they are touched.
+ *
+ * Maybe<MappedFile> file = MappedFile::open("data.csv", MappedFile::sequential);
+ * if (file.valid()) {
+ *     for (StringView line : file.value().lines()) { ... }
+ * }
+ *
+ * Hints can be combined. They are advice: where the OS doesn't support one
+ * it is ignored. On Windows all of them are.
+ */
+class MappedFile {
+public:
+    enum Hint {
+        sequential = 1 << 0,  // Read ahead aggressively, drop pages behind.
+        random     = 1 << 1,  // Don't read ahead.
+        will_need  = 1 << 2,  // Start loading the whole file now.
+        huge_pages = 1 << 3,  // Back with transparent huge pages (Linux).
+    };
+
+    MappedFile() : m_data(NULL), m_size(0) {}
+
+    MappedFile(MappedFile&& other) : m_data(other.m_data), m_size(other.m_size) {
+        other.m_data = NULL;
+        other.m_size = 0;
+    }
+
+    MappedFile& operator=(MappedFile&& other) {
+        if (this != &other) {
+            close();
+            m_data = other.m_data;
+            m_size = other.m_size;
+            other.m_data = NULL;
+            other.m_size = 0;
+        }
+        return *this;
+    }
+
+    ~MappedFile() {
+        close();
+    }
+
+    /**
+     * Empty if the file can't be opened or mapped. An empty file maps to
+     * an empty view.
+     */
+    static Maybe<MappedFile> open(const char* path, unsigned hints = 0) {
+        MappedFile file;
+#if defined(__linux__) || defined(__MACH__)
+        const int fd = ::open(path, O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            return Maybe<MappedFile>();
+        }
+        struct stat st;
+        if (fstat(fd, &st) != 0) {
+            ::close(fd);
+            return Maybe<MappedFile>();
+        }
+        if (st.st_size > 0) {
+            void* ptr = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (ptr == MAP_FAILED) {
+                ::close(fd);
+                return Maybe<MappedFile>();
+            }
+            file.m_data = (const char*)ptr;
+            file.m_size = (size_t)st.st_size;
+        }
+        ::close(fd);  // The mapping keeps the file alive.
+#elif defined(_WIN32)
+        HANDLE handle = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+                                    FILE_ATTRIBUTE_NORMAL, NULL);
+        if (handle == INVALID_HANDLE_VALUE) {
+            return Maybe<MappedFile>();
+        }
+        LARGE_INTEGER size;
+        if (!GetFileSizeEx(handle, &size)) {
+            CloseHandle(handle);
+            return Maybe<MappedFile>();
+        }
+        if (size.QuadPart > 0) {
+            HANDLE mapping = CreateFileMappingA(handle, NULL, PAGE_READONLY, 0, 0, NULL);
+            void* ptr = mapping ? MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0) : NULL;
+            if (mapping) {
+                CloseHandle(mapping);  // The view keeps the mapping alive.
+            }
+            if (!ptr) {
+                CloseHandle(handle);
+                return Maybe<MappedFile>();
+            }
+            file.m_data = (const char*)ptr;
+            file.m_size = (size_t)size.QuadPart;
+        }
+        CloseHandle(handle);
+#else
+        (void)path;
+        return Maybe<MappedFile>();
+#endif
+        file.advise(hints);
+        return Maybe<MappedFile>(std::move(file));
+    }
+
+    /**
+     * Gives the OS new hints about the whole mapping.
+     */
+    void advise(unsigned hints) {
+        if (!m_data) {
+            return;
+        }
+#if defined(__linux__) || defined(__MACH__)
+        void* ptr = (void*)m_data;
+        if (hints & sequential) madvise(ptr, m_size, MADV_SEQUENTIAL);
+        if (hints & random)     madvise(ptr, m_size, MADV_RANDOM);
+        if (hints & will_need)  madvise(ptr, m_size, MADV_WILLNEED);
+#if defined(MADV_HUGEPAGE)
+        if (hints & huge_pages) madvise(ptr, m_size, MADV_HUGEPAGE);
+#endif
+#endif
+        (void)hints;
+    }
+
+    /**
+     * Unmaps. Views into the file are dangling after this.
+     */
+    void close() {
+        if (m_data) {
+#if defined(__linux__) || defined(__MACH__)
+            munmap((void*)m_data, m_size);
+#elif defined(_WIN32)
+            UnmapViewOfFile(m_data);
+#endif
+        }
+        m_data = NULL;
+        m_size = 0;
+    }
+
+    const char* data() const { return m_data ? m_data : ""; }
+    size_t size() const { return m_size; }
+
+    StringView view() const { return StringView(data(), m_size); }
+    StringView::Lines lines() const { return view().lines(); }
+
+    /**
+     * The file from offset on, as an array of Ts. Trailing bytes that don't
+     * make a whole T are left out. offset must be aligned for T; the
+     * mapping itself starts on a page boundary.
+     */
+    template <typename T>
+    ArrayView<T> records(size_t offset = 0) const {
+        static_assert(std::is_trivially_copyable<T>::value, "records needs a trivially copyable T");
+        sgl_assert(offset <= m_size && (offset & (alignof(T) - 1)) == 0);
+        if (offset >= m_size) {
+            return ArrayView<T>();
+        }
+        return ArrayView<T>((const T*)(m_data + offset), (m_size - offset) / sizeof(T));
+    }
+
+private:
+    MappedFile(const MappedFile&);
+    MappedFile& operator=(const MappedFile&);
+
+    const char* m_data;
+    size_t      m_size;
+};
+
+////////////////////////////////////////////////////////////////////////////////
+// Output
+////////////////////////////////////////////////////////////////////////////////
+
+/**
+ * Buffered output to a FILE, bypassing stdio. write() copies into a
+ * user-space buffer and formats numbers straight into it, like format(),
+ * without parsing a format string. Nothing reaches the OS until the buffer
+ * fills or flush() is called. Only one thread may write to a Writer.
+ *
+ * start_background_flush() hands full buffers to a flusher thread. The
+ * flusher writes everything queued with a single writev(). The writing
+ * thread only waits when max_buffers buffers are in flight.
+ */
+class Writer : public Noncopyable {
+public:
+    static const size_t default_buffer_size = 64 * 1024;
+    static const size_t max_buffers = 8;
+
+    explicit Writer(FILE* file, size_t buffer_size = default_buffer_size) :
+        m_file(file),
+        m_capacity(buffer_size < 2 * format_buffer_size ? 2 * format_buffer_size : buffer_size),
+        m_used(0), m_num_buffers(1), m_writing(false), m_stop(false), m_failed(false) {
+        m_buffer = new char[m_capacity];
+    }
+
+    ~Writer() {
+        stop_background_flush();
+        flush();
+        delete[] m_buffer;
+        for (char* buffer : m_free) {
+            delete[] buffer;
+        }
+    }
+
+    Writer& write(const char* str, size_t len) {
+        if (len <= m_capacity - m_used) {
+            memcpy(m_buffer + m_used, str, len);
+            m_used += len;
+            return *this;
+        }
+        return write_slow(str, len);
+    }
+
+    Writer& write(const char* str) { return write(str, strlen(str)); }
+    Writer& write(StringView view) { return write(view.ptr(), view.num_elements()); }
+    template <typename A>
+    Writer& write(const BasicString<A>& str) { return write(str.str(), str.num_elements()); }
+
+    Writer& write(char c) {
+        if (m_used == m_capacity) {
+            hand_off();
+        }
+        m_buffer[m_used++] = c;
+        return *this;
+    }
+
+    /**
+     * Integers and floating point, the same text as format().
+     */
+    template <typename T>
+    typename std::enable_if<std::is_arithmetic<T>::value, Writer&>::type
+    write(T value) {
+        if (m_capacity - m_used < format_buffer_size) {
+            hand_off();
+        }
+        m_used += format(value, m_buffer + m_used);
+        return *this;
+    }
+
+    /**
+     * Lowercase hex with a 0x prefix.
+     */
+    Writer& write(const void* ptr) {
+        char hex[2 + 2 * sizeof(uintptr_t)];
+        uintptr_t x = (uintptr_t)ptr;
+        size_t i = sizeof(hex);
+        do {
+            hex[--i] = "0123456789abcdef"[x & 15];
+            x >>= 4;
+        } while (x);
+        hex[--i] = 'x';
+        hex[--i] = '0';
+        return write(hex + i, sizeof(hex) - i);
+    }
+
+    /**
+     * printf-style, for what the fast paths don't cover. Formats in place
+     * when it fits.
+     */
+#if defined(__GNUC__)
+    __attribute__((format(printf, 2, 3)))
+#endif
+    Writer& writef(const char* fmt, ...) {
+        va_list args;
+        va_start(args, fmt);
+        va_list again;
+        va_copy(again, args);
+        const size_t room = m_capacity - m_used;
+        const int len = vsnprintf(m_buffer + m_used, room, fmt, args);
+        va_end(args);
+        if (len >= 0 && (size_t)len < room) {
+            m_used += (size_t)len;
+        } else if (len >= 0) {
+            char* text = new char[(size_t)len + 1];
+            vsnprintf(text, (size_t)len + 1, fmt, again);
+            write(text, (size_t)len);
+            delete[] text;
+        }
+        va_end(again);
+        return *this;
+    }
+
+    /**
+     * Hands everything written so far to the OS, and waits for the flusher
+     * if there is one. False if a write failed since the last flush.
+     */
+    bool flush() {
+        hand_off();
+        if (!m_flusher.joinable()) {
+            const bool ok = !m_failed;
+            m_failed = false;
+            return ok;
+        }
+        std::unique_lock<std::mutex> lock(m_lock);
+        m_done.wait(lock, [this] { return m_full.num_elements() == 0 && !m_writing; });
+        const bool ok = !m_failed;
+        m_failed = false;
+        return ok;
+    }
+
+    void start_background_flush() {
+        if (!m_flusher.joinable()) {
+            m_stop = false;
+            m_flusher = std::thread([this] { flusher_loop(); });
+        }
+    }
+
+    /**
+     * Writes out everything queued and joins the flusher.
+     */
+    void stop_background_flush() {
+        if (!m_flusher.joinable()) {
+            return;
+        }
+        hand_off();
+        {
+            std::lock_guard<std::mutex> lock(m_lock);
+            m_stop = true;
+        }
+        m_work.notify_one();
+        m_flusher.join();
+    }
+
+private:
+    struct Chunk {
+        const char* data;
+        size_t      size;
+    };
+
+    Writer& write_slow(const char* str, size_t len) {
+        if (len >= m_capacity && !m_flusher.joinable()) {
+            // Too big to be worth copying.
+            hand_off();
+            const Chunk chunk = { str, len };
+            m_failed |= !write_chunks(m_file, &chunk, 1);
+            return *this;
+        }
+        for (;;) {
+            const size_t n = len < m_capacity - m_used ? len : m_capacity - m_used;
+            memcpy(m_buffer + m_used, str, n);
+            m_used += n;
+            str += n;
+            len -= n;
+            if (len == 0) {
+                return *this;
+            }
+            hand_off();
+        }
+    }
+
+    // Empties m_buffer: writes it out, or queues it for the flusher and
+    // takes a free one.
+    void hand_off() {
+        if (m_used == 0) {
+            return;
+        }
+        const Chunk chunk = { m_buffer, m_used };
+        m_used = 0;
+        if (!m_flusher.joinable()) {
+            m_failed |= !write_chunks(m_file, &chunk, 1);
+            return;
+        }
+        std::unique_lock<std::mutex> lock(m_lock);
+        m_full.push_back(chunk);
+        m_work.notify_one();
+        m_done.wait(lock, [this] { return m_free.num_elements() > 0 || m_num_buffers < max_buffers; });
+        if (m_free.num_elements() > 0) {
+            m_buffer = m_free[m_free.num_elements() - 1];
+            m_free.pop_back();
+        } else {
+            m_num_buffers++;
+            lock.unlock();
+            m_buffer = new char[m_capacity];
+        }
+    }
+
+    void flusher_loop() {
+        Array<Chunk> batch;
+        std::unique_lock<std::mutex> lock(m_lock);
+        for (;;) {
+            m_work.wait(lock, [this] { return m_stop || m_full.num_elements() > 0; });
+            if (m_full.num_elements() == 0) {
+                return;
+            }
+            batch.append(m_full);
+            m_full.clear();
+            m_writing = true;
+            lock.unlock();
+            const bool ok = write_chunks(m_file, batch.ptr(), batch.num_elements());
+            lock.lock();
+            m_failed |= !ok;
+            for (const Chunk& chunk : batch) {
+                m_free.push_back(const_cast<char*>(chunk.data));
+            }
+            batch.clear();
+            m_writing = false;
+            m_done.notify_all();
+        }
+    }
+
+    static bool write_chunks(FILE* file, const Chunk* chunks, size_t count) {
+        // Anything printf'd before goes out first.
+        fflush(file);
+#if defined(_WIN32)
+        bool ok = true;
+        for (size_t i = 0; i < count; ++i) {
+            ok &= fwrite(chunks[i].data, 1, chunks[i].size, file) == chunks[i].size;
+        }
+        return fflush(file) == 0 && ok;
+#else
+        const int fd = fileno(file);
+        struct iovec iov[64];
+        while (count > 0) {
+            int num_iov = 0;
+            for (; num_iov < 64 && (size_t)num_iov < count; ++num_iov) {
+                iov[num_iov].iov_base = const_cast<char*>(chunks[num_iov].data);
+                iov[num_iov].iov_len = chunks[num_iov].size;
+            }
+            chunks += num_iov;
+            count -= (size_t)num_iov;
+            struct iovec* v = iov;
+            while (num_iov > 0) {
+                const ssize_t written = writev(fd, v, num_iov);
+                if (written < 0) {
+                    if (errno == EINTR) {
+                        continue;
+                    }
+                    return false;
+                }
+                // Skip what went out, then retry the rest.
+                size_t left = (size_t)written;
+                while (num_iov > 0 && left >= v->iov_len) {
+                    left -= v->iov_len;
+                    ++v;
+                    --num_iov;
+                }
+                if (num_iov > 0) {
+                    v->iov_base = (char*)v->iov_base + left;
+                    v->iov_len -= left;
+                }
+            }
+        }
+        return true;
+#endif
+    }
+
+    FILE*   m_file;
+    char*   m_buffer;
+    size_t  m_capacity;
+    size_t  m_used;
+
+    // Background flushing. Guarded by m_lock while the flusher runs.
+    std::thread             m_flusher;
+    std::mutex              m_lock;
+    std::condition_variable m_work;  // Chunks queued, or stop.
+    std::condition_variable m_done;  // A batch was written.
+    Array<Chunk>            m_full;
+    Array<char*>            m_free;
+    size_t                  m_num_buffers;
+    bool                    m_writing;
+    bool                    m_stop;
+    bool                    m_failed;
+};
+
+/**
+ * The Writer behind dbg() and print_debug_info(). Flushed at exit. It is
+ * shared by the whole process: hold stdout_writer_lock() while writing to
+ * it, as dbg() and print_debug_info() do.
+ */
+inline Writer& stdout_writer() {
+    static Writer writer(stdout);
+    return writer;
+}
+
+inline std::mutex& stdout_writer_lock() {
+    static std::mutex lock;
+    return lock;
+}
+
+template<typename T>
+void dbg(const T& that) {
+    std::lock_guard<std::mutex> lock(stdout_writer_lock());
+    stdout_writer().write(that.str());
+    stdout_writer().flush();
+}
+
+template<typename T>
+void dbg(const std::initializer_list<T>& list) {
+    std::lock_guard<std::mutex> lock(stdout_writer_lock());
+    Writer& out = stdout_writer();
+    for(auto it = list.begin(); it != list.end(); it++) {
+        out.write(it->str());
+        if(it != list.end() - 1) {
+            out.write(' ');
+        }
+    }
+    out.flush();
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Snapshots
+////////////////////////////////////////////////////////////////////////////////
+
+/*
+ * On-disk format, version 1. Little-endian, no pointers, so a file can be
+ * mapped anywhere and used in place:
+ *
+ *   0   "sglsnap\0"
+ *   8   u32 version
+ *   12  u32 kind: 1 Array, 2 String, 3 Dict
+ *   16  u64 element size: sizeof(T) for an Array, 1 for a String, sizeof(value) for a Dict
+ *   24  u64 count: elements, bytes or entries
+ *   32  u64 payload size
+ *   40  u64 hash_bytes() of the payload
+ *   48  zeros up to 64, where the payload starts
+ *
+ * An Array or String payload is the raw elements. A Dict payload is a
+ * frozen open-addressing table with the same layout as HashTable, probed
+ * with seed 0 so that it doesn't depend on the process:
+ *
+ *   0   u64 capacity, a power of two of at least 32
+ *   8   u64 entries
+ *   16  u64 key bytes
+ *   24  u64 zero
+ *   32  control bytes: capacity, then a copy of the first 32
+ *   ..  capacity x { u64 hash, u64 key offset, u64 key length }
+ *   ..  capacity x value
+ *   ..  keys, each followed by a NUL
+ */
+namespace detail {
+
+static const char snapshot_magic[8] = "sglsnap";
+static const uint32_t snapshot_version = 1;
+static const size_t snapshot_header_size = 64;
+static const size_t snapshot_tail = 32;  // Widest Group.
+
+enum SnapshotKind {
+    snapshot_array  = 1,
+    snapshot_string = 2,
+    snapshot_dict   = 3,
+};
+
+struct SnapshotEntry {
+    uint64_t hash;
+    uint64_t key_offset;
+    uint64_t key_len;
+};
+
+// Payloads are written as they are in memory.
+inline bool host_is_little_endian() {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    return false;
+#else
+    return true;
+#endif
+}
+
+inline void write64(unsigned char* p, uint64_t v) {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    v = __builtin_bswap64(v);
+#endif
+    memcpy(p, &v, sizeof(v));
+}
+
+inline void write32(unsigned char* p, uint32_t v) {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+    v = __builtin_bswap32(v);
+#endif
+    memcpy(p, &v, sizeof(v));
+}
+
+inline bool write_snapshot(const char* path, SnapshotKind kind, uint64_t element_size,
+                           uint64_t count, const void* payload, size_t size) {
+    if (!host_is_little_endian()) {
+        return false;
+    }
+    unsigned char header[snapshot_header_size];
+    memset(header, 0, sizeof(header));
+    memcpy(header, snapshot_magic, sizeof(snapshot_magic));
+    write32(header + 8, snapshot_version);
+    write32(header + 12, (uint32_t)kind);
+    write64(header + 16, element_size);
+    write64(header + 24, count);
+    write64(header + 32, size);
+    write64(header + 40, hash_bytes(payload, size));
+    // Written next to path and renamed over it: the old file stays intact
+    // for whoever still has it mapped, and nobody sees half a snapshot.
+    String tmp(path);
+    tmp += ".tmp";
+    FILE* f = fopen(tmp.str(), "wb");
+    if (!f) {
+        return false;
+    }
+    bool ok = fwrite(header, 1, sizeof(header), f) == sizeof(header) &&
+              (size == 0 || fwrite(payload, 1, size, f) == size);
+    ok = fclose(f) == 0 && ok;
+#if defined(_WIN32)
+    ok = ok && MoveFileExA(tmp.str(), path, MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+    ok = ok && rename(tmp.str(), path) == 0;
+#endif
+    if (!ok) {
+        remove(tmp.str());
+    }
+    return ok;
+}
+
+// Offsets of the sections of a Dict payload.
+struct DictLayout {
+    DictLayout(uint64_t capacity_, uint64_t value_size, uint64_t key_bytes) :
+        capacity(capacity_),
+        entries(32 + capacity_ + snapshot_tail),
+        values(entries + capacity_ * sizeof(SnapshotEntry)),
+        keys(values + capacity_ * value_size),
+        size(keys + key_bytes) {}
+
+    uint64_t capacity;
+    uint64_t entries;
+    uint64_t values;
+    uint64_t keys;
+    uint64_t size;
+};
+
+}  // namespace detail
+
+/**
+ * Read-only hash table from Strings to Ts, living in a Snapshot. Lookups
+ * go straight to the mapped file. Only valid while the Snapshot is.
+ */
+template <typename T>
+class FrozenDict {
+public:
+    FrozenDict() :
+        m_ctrl(NULL), m_entries(NULL), m_values(NULL), m_keys(NULL), m_capacity(0), m_num_elements(0) {}
+
+    size_t num_elements() const {
+        return m_num_elements;
+    }
+
+    Maybe<const T&> find(StringView key) const {
+        if (m_num_elements == 0) {
+            return Maybe<const T&>();
+        }
+        const uint64_t hash = hash_bytes(key.ptr(), key.num_elements());
+        const size_t mask = m_capacity - 1;
+        const unsigned char tag = (unsigned char)(hash & 0x7f);
+        size_t pos = (size_t)(hash >> 7) & mask;
+        for (;;) {
+            detail::Group group(m_ctrl + pos);
+            for (detail::GroupMask m = group.match(tag); m; m.clear_lowest()) {
+                const size_t i = (pos + m.lowest()) & mask;
+                const detail::SnapshotEntry& entry = m_entries[i];
+                if (entry.hash == hash && entry.key_len == key.num_elements() &&
+                    memcmp(m_keys + entry.key_offset, key.ptr(), key.num_elements()) == 0) {
+                    return Maybe<const T&>(m_values[i]);
+                }
+            }
+            if (group.match_empty()) {
+                return Maybe<const T&>();
+            }
+            pos = (pos + detail::Group::width) & mask;
+        }
+    }
+
+    bool contains(StringView key) const {
+        return find(key).valid();
+    }
+
+    /**
+     * Calls f(key, value) for every entry, in table order.
+     */
+    template <typename F>
+    void visit(const F& f) const {
+        for (size_t i = 0; i < m_capacity; ++i) {
+            if (m_ctrl[i] != detail::ctrl_empty) {
+                const detail::SnapshotEntry& entry = m_entries[i];
+                f(StringView(m_keys + entry.key_offset, (size_t)entry.key_len), m_values[i]);
+            }
+        }
+    }
+
+private:
+    friend class Snapshot;
+
+    const unsigned char*         m_ctrl;
+    const detail::SnapshotEntry* m_entries;
+    const T*                     m_values;
+    const char*                  m_keys;
+    size_t                       m_capacity;
+    size_t                       m_num_elements;
+};
+
+/**
+ * A snapshot file mapped into memory. open() checks the header and,
+ * unless told not to, the checksum; after that array(), string() and
+ * dict() hand out views into the mapping without copying or parsing.
+ * They are empty if the snapshot holds something else.
+ *
+ * Maybe<Snapshot> snapshot = Snapshot::open("ids.snap");
+ * int id = snapshot.value().dict<int>().value().find("key").value_or(-1);
+ */
+class Snapshot {
+public:
+    Snapshot() : m_kind(0), m_element_size(0), m_count(0) {}
+
+    /**
+     * Empty if the file is missing, isn't a snapshot of this version, or
+     * fails the checksum. Skipping verification saves a pass over the
+     * file; only do it for files this process can trust.
+     */
+    static Maybe<Snapshot> open(const char* path, bool verify = true) {
+        Maybe<MappedFile> file = MappedFile::open(path, MappedFile::will_need);
+        if (!file.valid() || !detail::host_is_little_endian()) {
+            return Maybe<Snapshot>();
+        }
+        const unsigned char* p = (const unsigned char*)file.value().data();
+        const size_t size = file.value().size();
+        if (size < detail::snapshot_header_size ||
+            memcmp(p, detail::snapshot_magic, sizeof(detail::snapshot_magic)) != 0 ||
+            detail::read32(p + 8) != detail::snapshot_version ||
+            detail::read64(p + 32) != size - detail::snapshot_header_size) {
+            return Maybe<Snapshot>();
+        }
+        if (verify && hash_bytes(p + detail::snapshot_header_size, size - detail::snapshot_header_size) !=
+                      detail::read64(p + 40)) {
+            return Maybe<Snapshot>();
+        }
+        Snapshot snapshot;
+        snapshot.m_kind = (uint32_t)detail::read32(p + 12);
+        snapshot.m_element_size = detail::read64(p + 16);
+        snapshot.m_count = detail::read64(p + 24);
+        snapshot.m_file = std::move(file.value());
+        return Maybe<Snapshot>(std::move(snapshot));
+    }
+
+    template <typename T>
+    Maybe<ArrayView<T>> array() const {
+        static_assert(std::is_trivial<T>::value, "Snapshots hold plain bytes");
+        if (m_kind != detail::snapshot_array || m_element_size != sizeof(T) ||
+            m_count > payload_size() / sizeof(T) || m_count * sizeof(T) != payload_size()) {
+            return Maybe<ArrayView<T>>();
+        }
+        return Maybe<ArrayView<T>>(ArrayView<T>((const T*)payload(), (size_t)m_count));
+    }
+
+    Maybe<StringView> string() const {
+        if (m_kind != detail::snapshot_string || m_count != payload_size()) {
+            return Maybe<StringView>();
+        }
+        return Maybe<StringView>(StringView((const char*)payload(), (size_t)m_count));
+    }
+
+    template <typename T>
+    Maybe<FrozenDict<T>> dict() const {
+        static_assert(std::is_trivial<T>::value, "Snapshots hold plain bytes");
+        static_assert(alignof(T) <= 32, "Dict values are 32-byte aligned at most");
+        const unsigned char* p = payload();
+        if (m_kind != detail::snapshot_dict || m_element_size != sizeof(T) || payload_size() < 32) {
+            return Maybe<FrozenDict<T>>();
+        }
+        const uint64_t capacity = detail::read64(p);
+        const uint64_t num_elements = detail::read64(p + 8);
+        // Checked one by one, so that the layout below can't overflow.
+        if (capacity < detail::snapshot_tail || (capacity & (capacity - 1)) != 0 ||
+            capacity > payload_size() || num_elements != m_count || num_elements >= capacity ||
+            detail::read64(p + 16) > payload_size()) {
+            return Maybe<FrozenDict<T>>();
+        }
+        const detail::DictLayout layout(capacity, sizeof(T), detail::read64(p + 16));
+        if (layout.size != payload_size()) {
+            return Maybe<FrozenDict<T>>();
+        }
+        FrozenDict<T> dict;
+        dict.m_ctrl = p + 32;
+        dict.m_entries = (const detail::SnapshotEntry*)(p + layout.entries);
+        dict.m_values = (const T*)(p + layout.values);
+        dict.m_keys = (const char*)(p + layout.keys);
+        dict.m_capacity = (size_t)capacity;
+        dict.m_num_elements = (size_t)num_elements;
+        return Maybe<FrozenDict<T>>(dict);
+    }
+
+private:
+    const unsigned char* payload() const {
+        return (const unsigned char*)m_file.data() + detail::snapshot_header_size;
+    }
+
+    uint64_t payload_size() const {
+        return m_file.size() - detail::snapshot_header_size;
+    }
+
+    MappedFile m_file;
+    uint32_t   m_kind;
+    uint64_t   m_element_size;
+    uint64_t   m_count;
+};
+
+/**
+ * Writes array to path as a snapshot. T must be plain data without
+ * pointers. False on I/O errors.
+ *
+ * All save_snapshot overloads write path + ".tmp" and rename it over path,
+ * so Snapshots already open on path keep their old contents.
+ */
+template <typename T, typename A>
+bool save_snapshot(const char* path, const Array<T, A>& array) {
+    static_assert(std::is_trivial<T>::value, "Snapshots hold plain bytes");
+    return detail::write_snapshot(path, detail::snapshot_array, sizeof(T), array.num_elements(),
+                                  array.ptr(), array.num_elements() * sizeof(T));
+}
+
+template <typename A>
+bool save_snapshot(const char* path, const BasicString<A>& str) {
+    return detail::write_snapshot(path, detail::snapshot_string, 1, str.num_elements(),
+                                  str.str(), str.num_elements());
+}
+
+/**
+ * Freezes dict into a table that Snapshot::dict() can probe in place.
+ */
+template <typename V, typename H, typename E, typename A>
+bool save_snapshot(const char* path, const HashMap<BasicString<A>, V, H, E, A>& dict) {
+    static_assert(std::is_trivial<V>::value, "Snapshots hold plain bytes");
+    static_assert(alignof(V) <= 32, "Dict values are 32-byte aligned at most");
+    size_t capacity = detail::snapshot_tail;
+    while (capacity - capacity / 8 < dict.num_elements() + 1) {
+        capacity *= 2;
+    }
+    size_t key_bytes = 0;
+    for (const auto& slot : dict) {
+        key_bytes += slot.key.num_elements() + 1;
+    }
+    const detail::DictLayout layout(capacity, sizeof(V), key_bytes);
+    Array<unsigned char> payload((size_t)layout.size);
+    payload.resize((size_t)layout.size, 0);
+    unsigned char* p = payload.ptr();
+    detail::write64(p, capacity);
+    detail::write64(p + 8, dict.num_elements());
+    detail::write64(p + 16, key_bytes);
+    unsigned char* ctrl = p + 32;
+    memset(ctrl, detail::ctrl_empty, capacity + detail::snapshot_tail);
+    detail::SnapshotEntry* entries = (detail::SnapshotEntry*)(p + layout.entries);
+    V* values = (V*)(p + layout.values);
+    char* keys = (char*)(p + layout.keys);
+
+    const size_t mask = capacity - 1;
+    size_t key_offset = 0;
+    for (const auto& slot : dict) {
+        const size_t len = slot.key.num_elements();
+        const uint64_t hash = hash_bytes(slot.key.str(), len);
+        size_t i = (size_t)(hash >> 7) & mask;
+        while (ctrl[i] != detail::ctrl_empty) {
+            i = (i + 1) & mask;
+        }
+        ctrl[i] = (unsigned char)(hash & 0x7f);
+        if (i < detail::snapshot_tail) {
+            ctrl[capacity + i] = ctrl[i];
+        }
+        entries[i].hash = hash;
+        entries[i].key_offset = key_offset;
+        entries[i].key_len = len;
+        values[i] = slot.value;
+        memcpy(keys + key_offset, slot.key.str(), len);
+        key_offset += len + 1;
+    }
+    return detail::write_snapshot(path, detail::snapshot_dict, sizeof(V), dict.num_elements(),
+                                  payload.ptr(), payload.num_elements());
+}
+
+/**
+ * Reads a snapshot written by save_snapshot into out, replacing what was
+ * there. False, with out untouched, if the file doesn't hold one.
+ */
+template <typename T, typename A>
+bool load_snapshot(const char* path, Array<T, A>* out) {
+    Maybe<Snapshot> snapshot = Snapshot::open(path);
+    Maybe<ArrayView<T>> view = snapshot.valid() ? snapshot.value().array<T>() : Maybe<ArrayView<T>>();
+    if (!view.valid()) {
+        return false;
+    }
+    out->clear();
+    out->append(view.value().ptr(), view.value().num_elements());
+    return true;
+}
+
+template <typename A>
+bool load_snapshot(const char* path, BasicString<A>* out) {
+    Maybe<Snapshot> snapshot = Snapshot::open(path);
+    Maybe<StringView> view = snapshot.valid() ? snapshot.value().string() : Maybe<StringView>();
+    if (!view.valid()) {
+        return false;
+    }
+    *out = BasicString<A>(view.value().ptr(), view.value().num_elements());
+    return true;
+}
+
+template <typename V, typename H, typename E, typename A>
+bool load_snapshot(const char* path, HashMap<BasicString<A>, V, H, E, A>* out) {
+    Maybe<Snapshot> snapshot = Snapshot::open(path);
+    Maybe<FrozenDict<V>> dict = snapshot.valid() ? snapshot.value().dict<V>() : Maybe<FrozenDict<V>>();
+    if (!dict.valid()) {
+        return false;
+    }
+    out->clear();
+    out->reserve(dict.value().num_elements());
+    dict.value().visit([out](StringView key, const V& value) {
+        out->insert_or_assign(BasicString<A>(key.ptr(), key.num_elements()), value);
+    });
+    return true;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Threads
+////////////////////////////////////////////////////////////////////////////////
+
+class ThreadPool;
+class TaskGroup;
+
+namespace detail {
+
+struct Task {
+    void (*run)(Task*);  // Runs and deletes the task.
+    TaskGroup* group;
+};
+
+template <typename F>
+struct FunctionTask : Task {
+    explicit FunctionTask(F&& fn) : f(std::move(fn)) { run = &invoke; }
+    explicit FunctionTask(const F& fn) : f(fn) { run = &invoke; }
+
+    static void invoke(Task* task) {
+        FunctionTask* self = static_cast<FunctionTask*>(task);
+        self->f();
+        delete self;
+    }
+
+    F f;
+};
+
+/*
+ * Chase-Lev work-stealing deque, with the memory orders from Le et al.,
+ * "Correct and Efficient Work-Stealing for Weak Memory Models" (2013).
+ * The owner pushes and pops at the bottom, other threads steal from the top.
+ * top and bottom live on separate cache lines.
+ */
+class WorkDeque : public Noncopyable {
+    struct Buffer {
+        explicit Buffer(int64_t capacity) :
+            mask(capacity - 1), slots(new std::atomic<Task*>[(size_t)capacity]), retired(NULL) {}
+        ~Buffer() { delete[] slots; }
+
+        // Release/acquire on the slots themselves, on top of the fences, so
+        // that thread sanitizers can follow the task from owner to thief.
+        // Both are plain moves on x86.
+        Task* get(int64_t i) const { return slots[i & mask].load(std::memory_order_acquire); }
+        void put(int64_t i, Task* t) { slots[i & mask].store(t, std::memory_order_release); }
+
+        int64_t             mask;
+        std::atomic<Task*>* slots;
+        Buffer*             retired;  // Smaller buffers thieves may still be reading.
+    };
+
+public:
+    explicit WorkDeque(int64_t capacity = 256) : m_top(0), m_bottom(0) {
+        m_buffer.store(new Buffer(capacity), std::memory_order_relaxed);
+    }
+
+    ~WorkDeque() {
+        Buffer* b = m_buffer.load(std::memory_order_relaxed);
+        while (b) {
+            Buffer* retired = b->retired;
+            delete b;
+            b = retired;
+        }
+    }
+
+    // Owner only.
+    void push(Task* task) {
+        const int64_t b = m_bottom.load(std::memory_order_relaxed);
+        const int64_t t = m_top.load(std::memory_order_acquire);
+        Buffer* buffer = m_buffer.load(std::memory_order_relaxed);
+        if (b - t > buffer->mask) {
+            buffer = grow(buffer, t, b);
+        }
+        buffer->put(b, task);
+        std::atomic_thread_fence(std::memory_order_release);
+        m_bottom.store(b + 1, std::memory_order_relaxed);
+    }
+
+    // Owner only. NULL when empty.
+    Task* pop() {
+        const int64_t b = m_bottom.load(std::memory_order_relaxed) - 1;
+        Buffer* buffer = m_buffer.load(std::memory_order_relaxed);
+        m_bottom.store(b, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        int64_t t = m_top.load(std::memory_order_relaxed);
+        if (t > b) {
+            m_bottom.store(b + 1, std::memory_order_relaxed);
+            return NULL;
+        }
+        Task* task = buffer->get(b);
+        if (t == b) {
+            // Last one: race the thieves for it.
+            if (!m_top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst,
+                                               std::memory_order_relaxed)) {
+                task = NULL;
+            }
+            m_bottom.store(b + 1, std::memory_order_relaxed);
+        }
+        return task;
+    }
+
+    // Any thread. NULL when empty or when another thief won.
+    Task* steal() {
+        int64_t t = m_top.load(std::memory_order_acquire);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        const int64_t b = m_bottom.load(std::memory_order_acquire);
+        if (t >= b) {
+            return NULL;
+        }
+        Task* task = m_buffer.load(std::memory_order_acquire)->get(t);
+        if (!m_top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst,
+                                           std::memory_order_relaxed)) {
+            return NULL;
+        }
+        return task;
+    }
+
+    bool empty() const {
+        return m_bottom.load(std::memory_order_relaxed) <= m_top.load(std::memory_order_relaxed);
+    }
+
+private:
+    Buffer* grow(Buffer* old, int64_t t, int64_t b) {
+        Buffer* buffer = new Buffer((old->mask + 1) * 2);
+        for (int64_t i = t; i < b; ++i) {
+            buffer->put(i, old->get(i));
+        }
+        buffer->retired = old;
+        m_buffer.store(buffer, std::memory_order_release);
+        return buffer;
+    }
+
+    alignas(compile_time_cache_line_size) std::atomic<int64_t> m_top;
+    alignas(compile_time_cache_line_size) std::atomic<int64_t> m_bottom;
+    std::atomic<Buffer*> m_buffer;
+};
+
+struct Worker;
+
+// The worker running on this thread, if it belongs to a pool.
+inline Worker*& current_worker() {
+    static thread_local Worker* worker = NULL;
+    return worker;
+}
+
+}  // namespace detail
+
+/**
+ * Runs tasks on a fixed set of threads.
+ *
+ * Each worker has its own deque. Tasks spawned from a worker go to the
+ * bottom of its deque and it takes them back LIFO; idle workers steal from
+ * the top of someone else's. Tasks from other threads go through a shared
+ * queue.
+ *
+ * Tasks are submitted through a TaskGroup:
+ *
+ * ThreadPool pool;
+ * TaskGroup group(&pool);
+ * for (size_t i = 0; i < n; ++i) group.run([&, i]{ work(i); });
+ * group.wait();
+ */
+class ThreadPool : public Noncopyable {
+public:
+    /**
+     * num_threads == 0 starts one worker per logical core, minus one for
+     * the thread that waits on the tasks and helps run them.
+     */
+    explicit ThreadPool(size_t num_threads = 0);
+    ~ThreadPool();
+
+    size_t num_threads() const { return m_num_workers; }
+
+private:
+    friend class TaskGroup;
+
+    void submit(detail::Task* task);
+
+    // Takes a task from anywhere: the current worker's deque, the shared
+    // queue, or another worker. NULL if nothing was found.
+    detail::Task* find_task(detail::Worker* self);
+    bool has_work() const;
+    void wake_one();
+    void worker_loop(detail::Worker* self);
+    static void execute(detail::Task* task);
+
+    detail::Worker*          m_workers;
+    size_t                   m_num_workers;
+    std::mutex               m_queue_lock;
+    Array<detail::Task*>     m_queue;
+    std::atomic<size_t>      m_queue_size;
+    std::mutex               m_sleep_lock;
+    std::condition_variable  m_wake;
+    uint64_t                 m_wake_epoch;  // Guarded by m_sleep_lock.
+    std::atomic<uint32_t>    m_sleepers;
+    std::atomic<bool>        m_stop;
+};
+
+namespace detail {
+
+struct alignas(compile_time_cache_line_size) Worker {
+    WorkDeque   deque;
+    ThreadPool* pool;
+    uint32_t    rng;
+    std::thread thread;
+};
+
+}  // namespace detail
+
+/**
+ * A set of tasks that can be waited on. wait() doesn't block while there
+ * are tasks left anywhere in the pool: it runs them.
+ */
+class TaskGroup : public Noncopyable {
+public:
+    explicit TaskGroup(ThreadPool* pool) : m_pool(pool), m_pending(0) {}
+
+    ~TaskGroup() {
+        wait();
+    }
+
+    template <typename F>
+    void run(F&& f) {
+        typedef typename std::decay<F>::type Fn;
+        detail::Task* task = new detail::FunctionTask<Fn>(std::forward<F>(f));
+        task->group = this;
+        m_pending.fetch_add(1, std::memory_order_relaxed);
+        m_pool->submit(task);
+    }
+
+    /**
+     * Returns once every task run() so far has finished.
+     */
+    void wait() {
+        detail::Worker* self = detail::current_worker();
+        if (self && self->pool != m_pool) {
+            self = NULL;
+        }
+        while (m_pending.load(std::memory_order_acquire) != 0) {
+            detail::Task* task = m_pool->find_task(self);
+            if (task) {
+                ThreadPool::execute(task);
+            } else {
+                std::this_thread::yield();
+            }
+        }
+    }
+
+    ThreadPool* pool() const { return m_pool; }
+
+private:
+    friend class ThreadPool;
+
+    ThreadPool*         m_pool;
+    std::atomic<size_t> m_pending;
+};
+
+inline ThreadPool::ThreadPool(size_t num_threads) :
+    m_workers(NULL),
+    m_num_workers(num_threads),
+    m_queue_size(0),
+    m_wake_epoch(0),
+    m_sleepers(0),
+    m_stop(false) {
+    if (m_num_workers == 0) {
+        const size_t cores = cpu_info().logical_cores;
+        m_num_workers = cores > 1 ? cores - 1 : 1;
+    }
+    HeapAllocator heap;
+    m_workers = (detail::Worker*)heap.allocate(m_num_workers * sizeof(detail::Worker),
+                                               alignof(detail::Worker));
+    for (size_t i = 0; i < m_num_workers; ++i) {
+        detail::Worker* w = new (&m_workers[i]) detail::Worker();
+        w->pool = this;
+        w->rng  = (uint32_t)(i * 2654435761u) | 1;
+    }
+    // Start them once every deque exists, since they steal from each other.
+    for (size_t i = 0; i < m_num_workers; ++i) {
+        detail::Worker* w = &m_workers[i];
+        w->thread = std::thread([this, w]{ worker_loop(w); });
+    }
+}
+
+inline ThreadPool::~ThreadPool() {
+    {
+        std::lock_guard<std::mutex> lock(m_sleep_lock);
+        m_stop.store(true);
+        ++m_wake_epoch;
+    }
+    m_wake.notify_all();
+    for (size_t i = 0; i < m_num_workers; ++i) {
+        m_workers[i].thread.join();
+    }
+    for (size_t i = 0; i < m_num_workers; ++i) {
+        m_workers[i].~Worker();
+    }
+    HeapAllocator().deallocate(m_workers, m_num_workers * sizeof(detail::Worker),
+                               alignof(detail::Worker));
+}
+
+inline void ThreadPool::submit(detail::Task* task) {
+    detail::Worker* self = detail::current_worker();
+    if (self && self->pool == this) {
+        self->deque.push(task);
+    } else {
+        std::lock_guard<std::mutex> lock(m_queue_lock);
+        m_queue.push_back(task);
+        m_queue_size.store(m_queue.num_elements(), std::memory_order_relaxed);
+    }
+    wake_one();
+}
+
+inline detail::Task* ThreadPool::find_task(detail::Worker* self) {
+    if (self) {
+        detail::Task* task = self->deque.pop();
+        if (task) {
+            return task;
+        }
+    }
+    if (m_queue_size.load(std::memory_order_relaxed)) {
+        std::lock_guard<std::mutex> lock(m_queue_lock);
+        if (m_queue.num_elements()) {
+            detail::Task* task = m_queue[m_queue.num_elements() - 1];
+            m_queue.pop_back();
+            m_queue_size.store(m_queue.num_elements(), std::memory_order_relaxed);
+            return task;
+        }
+    }
+    // One pass over the other workers, from a random start.
+    uint32_t start = 0;
+    if (self) {
+        self->rng ^= self->rng << 13;
+        self->rng ^= self->rng >> 17;
+        self->rng ^= self->rng << 5;
+        start = self->rng;
+    }
+    for (size_t i = 0; i < m_num_workers; ++i) {
+        detail::Worker* victim = &m_workers[(start + i) % m_num_workers];
+        if (victim != self) {
+            detail::Task* task = victim->deque.steal();
+            if (task) {
+                return task;
+            }
+        }
+    }
+    return NULL;
+}
+
+inline bool ThreadPool::has_work() const {
+    if (m_queue_size.load(std::memory_order_relaxed)) {
+        return true;
+    }
+    for (size_t i = 0; i < m_num_workers; ++i) {
+        if (!m_workers[i].deque.empty()) {
+            return true;
+        }
+    }
+    return false;
+}
+
+inline void ThreadPool::wake_one() {
+    // Pairs with the fence in worker_loop: either the sleeper sees the new
+    // task, or we see the sleeper.
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (m_sleepers.load(std::memory_order_relaxed)) {
+        {
+            std::lock_guard<std::mutex> lock(m_sleep_lock);
+            ++m_wake_epoch;
+        }
+        m_wake.notify_one();
+    }
+}
+
+inline void ThreadPool::execute(detail::Task* task) {
+    TaskGroup* group = task->group;
+    task->run(task);
+    group->m_pending.fetch_sub(1, std::memory_order_release);
+}
+
+inline void ThreadPool::worker_loop(detail::Worker* self) {
+    detail::current_worker() = self;
+    for (;;) {
+        detail::Task* task = NULL;
+        for (int spin = 0; spin < 64 && !task; ++spin) {
+            task = find_task(self);
+        }
+        if (task) {
+            execute(task);
+            continue;
+        }
+        std::unique_lock<std::mutex> lock(m_sleep_lock);
+        m_sleepers.fetch_add(1);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (!has_work()) {
+            if (m_stop.load()) {
+                m_sleepers.fetch_sub(1);
+                break;
+            }
+            const uint64_t epoch = m_wake_epoch;
+            m_wake.wait(lock, [&]{ return m_wake_epoch != epoch; });
+        }
+        m_sleepers.fetch_sub(1);
+    }
+    detail::current_worker() = NULL;
+}
+
+/*
+ * Pool shared by the parallel algorithms. Started on the first call.
+ */
+inline ThreadPool& default_thread_pool() {
+    static ThreadPool pool;
+    return pool;
+}
+
+/*
+ * Parallel algorithms.
+ *
+ * The range is cut into chunks of grain elements (0 picks a grain from the
+ * size and the number of threads), which are handed out by recursive
+ * splitting so that idle workers steal big pieces first. Below
+ * parallel_serial_threshold elements, or with a single chunk, everything
+ * runs on the calling thread.
+ *
+ * For Arrays, chunk boundaries fall on cache line boundaries when the
+ * element size allows it, so no two threads write to the same line.
+ */
+static const size_t parallel_serial_threshold = 4096;
+
+namespace detail {
+
+// About eight chunks per thread, so there is something left to steal.
+inline size_t default_grain(size_t n, size_t threads) {
+    const size_t grain = n / (8 * (threads + 1));
+    return grain < parallel_serial_threshold ? parallel_serial_threshold : grain;
+}
+
+struct ChunkLayout {
+    // head: elements before the first cache line boundary.
+    ChunkLayout(size_t n, size_t g, size_t head, size_t threads) :
+        size(n), first(head), grain(g ? g : default_grain(n, threads)) {
+        if (first >= grain) first = 0;
+        count = n <= first + grain ? 1 : 2 + (n - first - grain - 1) / grain;
+    }
+
+    size_t lo(size_t k) const { return k == 0 ? 0 : first + k * grain; }
+    size_t hi(size_t k) const {
+        const size_t end = first + (k + 1) * grain;
+        return end < size ? end : size;
     }
 
-    T*       m_storage;
-    size_t   m_num_elements;
-    size_t   m_size;
+    size_t size;
+    size_t first;
+    size_t grain;
+    size_t count;
+};
+
+// A value on a cache line of its own, for per-chunk results written by
+// different threads.
+template <typename T>
+struct alignas(compile_time_cache_line_size) Padded {
+    explicit Padded(const T& v) : value(v) {}
+    T value;
 };
 
+// Grain rounded up to whole cache lines, and the elements before the first
+// line boundary. Both unchanged if T doesn't tile a line.
+template <typename T>
+inline ChunkLayout aligned_layout(const T* ptr, size_t n, size_t grain, size_t threads) {
+    const size_t line = compile_time_cache_line_size;
+    const uintptr_t misalign = (uintptr_t)ptr % line;
+    if (sizeof(T) > line || line % sizeof(T) != 0 || misalign % sizeof(T) != 0) {
+        return ChunkLayout(n, grain, 0, threads);
+    }
+    const size_t per_line = line / sizeof(T);
+    if (grain == 0) {
+        grain = default_grain(n, threads);
+    }
+    grain = (grain + per_line - 1) / per_line * per_line;
+    const size_t head = ((line - misalign) % line) / sizeof(T);
+    return ChunkLayout(n, grain, head, threads);
+}
+
+// Runs f(k) for every chunk k in [first, last), splitting off the upper
+// half as a task until one chunk is left. The tasks take a copy of f:
+// callers pass a temporary, which is gone by the time they wait().
+template <typename F>
+void run_chunks(TaskGroup* group, size_t first, size_t last, const F& f) {
+    while (last - first > 1) {
+        const size_t mid = first + (last - first) / 2;
+        group->run([group, mid, last, f]{ run_chunks(group, mid, last, f); });
+        last = mid;
+    }
+    f(first);
+}
+
+template <typename F>
+void for_each_chunk(const ChunkLayout& layout, ThreadPool* pool, const F& f) {
+    if (layout.count == 1 || layout.size < parallel_serial_threshold) {
+        f(0, layout.size);
+        return;
+    }
+    TaskGroup group(pool);
+    run_chunks(&group, 0, layout.count, [&layout, &f](size_t k) { f(layout.lo(k), layout.hi(k)); });
+    group.wait();
+}
+
+template <typename T, typename A>
+typename std::enable_if<std::is_trivial<T>::value>::type resize_output(Array<T, A>* out, size_t n) {
+    out->resize_for_overwrite(n);
+}
+
+template <typename T, typename A>
+typename std::enable_if<!std::is_trivial<T>::value>::type resize_output(Array<T, A>* out, size_t n) {
+    if (out->num_elements() > n) {
+        out->resize(n);
+    } else {
+        out->resize(n, T());
+    }
+}
+
+// Inclusive scan of [lo, hi) into dst, on top of *carry if there is one.
+template <typename T, typename Op>
+void scan_chunk(const T* src, T* dst, size_t lo, size_t hi, const T* carry, const Op& op) {
+    T acc = carry ? op(*carry, src[lo]) : src[lo];
+    dst[lo] = acc;
+    for (size_t i = lo + 1; i < hi; ++i) {
+        acc = op(acc, src[i]);
+        dst[i] = acc;
+    }
+}
+
+inline ThreadPool* pool_or_default(ThreadPool* pool) {
+    return pool ? pool : &default_thread_pool();
+}
+
+}  // namespace detail
+
+/**
+ * Calls f(lo, hi) on disjoint chunks that cover [begin, end).
+ *
+ * parallel_for(0, n, [&](size_t lo, size_t hi) {
+ *     for (size_t i = lo; i < hi; ++i) out[i] = work(i);
+ * });
+ */
+template <typename F>
+void parallel_for(size_t begin, size_t end, const F& f, size_t grain = 0, ThreadPool* pool = NULL) {
+    sgl_assert(begin <= end);
+    pool = detail::pool_or_default(pool);
+    const detail::ChunkLayout layout(end - begin, grain, 0, pool->num_threads());
+    detail::for_each_chunk(layout, pool, [begin, &f](size_t lo, size_t hi) { f(begin + lo, begin + hi); });
+}
+
+/**
+ * Calls f(element) for every element.
+ */
+template <typename T, typename A, typename F>
+void parallel_for_each(Array<T, A>& array, const F& f, size_t grain = 0, ThreadPool* pool = NULL) {
+    pool = detail::pool_or_default(pool);
+    T* data = array.ptr();
+    const detail::ChunkLayout layout =
+        detail::aligned_layout(data, array.num_elements(), grain, pool->num_threads());
+    detail::for_each_chunk(layout, pool, [data, &f](size_t lo, size_t hi) {
+        for (size_t i = lo; i < hi; ++i) {
+            f(data[i]);
+        }
+    });
+}
+
+/**
+ * Combines chunk(lo, hi) over chunks covering [begin, end) with combine,
+ * starting from identity. combine must be associative; chunk results are
+ * combined in order, so it needn't be commutative.
+ */
+template <typename T, typename F, typename Op>
+T parallel_reduce(size_t begin, size_t end, const T& identity, const F& chunk, const Op& combine,
+                  size_t grain = 0, ThreadPool* pool = NULL) {
+    sgl_assert(begin <= end);
+    pool = detail::pool_or_default(pool);
+    const detail::ChunkLayout layout(end - begin, grain, 0, pool->num_threads());
+    if (layout.count == 1 || layout.size < parallel_serial_threshold) {
+        return combine(identity, chunk(begin, end));
+    }
+    Array<detail::Padded<T>> partials;
+    partials.resize(layout.count, detail::Padded<T>(identity));
+    detail::Padded<T>* out = partials.ptr();
+    TaskGroup group(pool);
+    detail::run_chunks(&group, 0, layout.count, [&](size_t k) {
+        out[k].value = chunk(begin + layout.lo(k), begin + layout.hi(k));
+    });
+    group.wait();
+    T result = identity;
+    for (size_t k = 0; k < layout.count; ++k) {
+        result = combine(result, out[k].value);
+    }
+    return result;
+}
+
+/**
+ * Folds the elements with op, starting from identity.
+ *
+ * int64_t sum = parallel_reduce(values, int64_t(0), [](int64_t a, int64_t b) { return a + b; });
+ */
+template <typename T, typename A, typename U, typename Op>
+U parallel_reduce(const Array<T, A>& array, const U& identity, const Op& op,
+                  size_t grain = 0, ThreadPool* pool = NULL) {
+    const T* data = array.ptr();
+    return parallel_reduce(size_t(0), array.num_elements(), identity,
+                           [data, &identity, &op](size_t lo, size_t hi) {
+                               U acc = identity;
+                               for (size_t i = lo; i < hi; ++i) {
+                                   acc = op(acc, data[i]);
+                               }
+                               return acc;
+                           },
+                           op, grain, pool);
+}
+
+/**
+ * out[i] = f(in[i]). out is resized to match, and may be &in.
+ * Elements of out are assigned, so a non-trivial U is default constructed
+ * first.
+ */
+template <typename T, typename A, typename U, typename B, typename F>
+void parallel_transform(const Array<T, A>& in, Array<U, B>* out, const F& f,
+                        size_t grain = 0, ThreadPool* pool = NULL) {
+    const size_t n = in.num_elements();
+    detail::resize_output(out, n);
+    pool = detail::pool_or_default(pool);
+    const T* src = in.ptr();
+    U* dst = out->ptr();
+    const detail::ChunkLayout layout = detail::aligned_layout(dst, n, grain, pool->num_threads());
+    detail::for_each_chunk(layout, pool, [src, dst, &f](size_t lo, size_t hi) {
+        for (size_t i = lo; i < hi; ++i) {
+            dst[i] = f(src[i]);
+        }
+    });
+}
+
+/**
+ * out[i] = in[0] op in[1] op ... op in[i]. out is resized to match, and
+ * may be &in. op must be associative.
+ *
+ * Two passes: each chunk is reduced, the chunk totals are scanned on the
+ * calling thread, then each chunk is scanned starting from its carry.
+ */
+template <typename T, typename A, typename B, typename Op>
+void parallel_inclusive_scan(const Array<T, A>& in, Array<T, B>* out, const Op& op,
+                             size_t grain = 0, ThreadPool* pool = NULL) {
+    const size_t n = in.num_elements();
+    detail::resize_output(out, n);
+    pool = detail::pool_or_default(pool);
+    const T* src = in.ptr();
+    T* dst = out->ptr();
+    const detail::ChunkLayout layout = detail::aligned_layout(dst, n, grain, pool->num_threads());
+    if (n == 0) {
+        return;
+    }
+    if (layout.count == 1 || n < parallel_serial_threshold) {
+        detail::scan_chunk(src, dst, 0, n, (const T*)NULL, op);
+        return;
+    }
+    Array<T> carries;
+    carries.resize(layout.count, src[0]);
+    T* carry = carries.ptr();
+    TaskGroup group(pool);
+    // Pass 1: carry[k + 1] = total of chunk k. The last total isn't needed.
+    detail::run_chunks(&group, 0, layout.count - 1, [&](size_t k) {
+        const size_t lo = layout.lo(k);
+        const size_t hi = layout.hi(k);
+        T acc = src[lo];
+        for (size_t i = lo + 1; i < hi; ++i) {
+            acc = op(acc, src[i]);
+        }
+        carry[k + 1] = acc;
+    });
+    group.wait();
+    for (size_t k = 2; k < layout.count; ++k) {
+        carry[k] = op(carry[k - 1], carry[k]);
+    }
+    detail::run_chunks(&group, 0, layout.count, [&](size_t k) {
+        detail::scan_chunk(src, dst, layout.lo(k), layout.hi(k), k ? &carry[k] : NULL, op);
+    });
+    group.wait();
+}
+
+/*
+ * Bounded queues for handing values between threads. The capacity is
+ * rounded up to a power of two. Nothing blocks: try_push fails when the
+ * queue is full and try_pop when it's empty. The producer and consumer
+ * indices sit on separate cache lines.
+ */
+
 /**
- * Functional-style string class
- * I expect this to be really slow without heavy compiler help, and even then..
+ * One producer thread, one consumer thread. Wait-free: each call is a
+ * bounded number of loads and stores, with no compare-and-swap.
+ *
+ * Each side keeps a copy of the other side's index and only rereads the
+ * shared one when the copy says the queue is full (or empty).
  */
-class String : public Array<char> {
+template <typename T, typename Alloc = HeapAllocator>
+class SpscQueue : public Noncopyable {
 public:
-    String() : Array<char>(1) {
-        m_storage[0] = '\0';
+    explicit SpscQueue(size_t capacity, const Alloc& alloc = Alloc()) :
+        m_tail(0), m_head_cache(0), m_head(0), m_tail_cache(0), m_alloc(alloc) {
+        size_t c = 2;
+        while (c < capacity) c *= 2;
+        m_mask  = c - 1;
+        m_slots = (T*)m_alloc.allocate(c * sizeof(T), alignof(T));
     }
 
-    String(const char* str) : Array(strlen(str) + 1) {
-        memcpy(m_storage, str, strlen(str));
-        m_num_elements = strlen(str);
-        m_storage[m_num_elements] = '\0';
+    ~SpscQueue() {
+        const size_t tail = m_tail.load(std::memory_order_relaxed);
+        for (size_t i = m_head.load(std::memory_order_relaxed); i != tail; ++i) {
+            m_slots[i & m_mask].~T();
+        }
+        m_alloc.deallocate(m_slots, capacity() * sizeof(T), alignof(T));
     }
 
-    String appended(const String& other) {
-        const size_t new_storage = this->m_num_elements + other.m_num_elements;
-        String new_string(new_storage);
-        new_string.m_num_elements = this->m_num_elements + other.m_num_elements;
-        sprintf(new_string.m_storage, "%s%s", this->m_storage, other.m_storage);
-        return new_string;
+    // Producer.
+    bool try_push(const T& e) { return try_emplace(e); }
+    bool try_push(T&& e) { return try_emplace(std::move(e)); }
+
+    template <typename... Args>
+    bool try_emplace(Args&&... args) {
+        const size_t tail = m_tail.load(std::memory_order_relaxed);
+        if (tail - m_head_cache > m_mask) {
+            m_head_cache = m_head.load(std::memory_order_acquire);
+            if (tail - m_head_cache > m_mask) {
+                return false;
+            }
+        }
+        new (&m_slots[tail & m_mask]) T(std::forward<Args>(args)...);
+        m_tail.store(tail + 1, std::memory_order_release);
+        return true;
     }
 
-    const char* str() const {
-        return m_storage;
+    /**
+     * Copies as many of items as fit, publishing them all at once.
+     * Returns how many.
+     */
+    size_t try_push(const T* items, size_t count) {
+        const size_t tail = m_tail.load(std::memory_order_relaxed);
+        size_t room = capacity() - (tail - m_head_cache);
+        if (room < count) {
+            m_head_cache = m_head.load(std::memory_order_acquire);
+            room = capacity() - (tail - m_head_cache);
+        }
+        const size_t n = count < room ? count : room;
+        for (size_t i = 0; i < n; ++i) {
+            new (&m_slots[(tail + i) & m_mask]) T(items[i]);
+        }
+        m_tail.store(tail + n, std::memory_order_release);
+        return n;
+    }
+
+    // Consumer.
+    Maybe<T> try_pop() {
+        const size_t head = m_head.load(std::memory_order_relaxed);
+        if (head == m_tail_cache) {
+            m_tail_cache = m_tail.load(std::memory_order_acquire);
+            if (head == m_tail_cache) {
+                return Maybe<T>();
+            }
+        }
+        T& slot = m_slots[head & m_mask];
+        Maybe<T> result(std::move(slot));
+        slot.~T();
+        m_head.store(head + 1, std::memory_order_release);
+        return result;
+    }
+
+    /**
+     * Moves up to max elements into out. Returns how many.
+     */
+    size_t try_pop(T* out, size_t max) {
+        const size_t head = m_head.load(std::memory_order_relaxed);
+        if (m_tail_cache - head < max) {
+            m_tail_cache = m_tail.load(std::memory_order_acquire);
+        }
+        const size_t available = m_tail_cache - head;
+        const size_t n = max < available ? max : available;
+        for (size_t i = 0; i < n; ++i) {
+            T& slot = m_slots[(head + i) & m_mask];
+            out[i] = std::move(slot);
+            slot.~T();
+        }
+        m_head.store(head + n, std::memory_order_release);
+        return n;
+    }
+
+    size_t capacity() const { return m_mask + 1; }
+
+    /**
+     * Exact only when neither side is running.
+     */
+    size_t num_elements() const {
+        return m_tail.load(std::memory_order_acquire) - m_head.load(std::memory_order_acquire);
     }
 
 private:
-    explicit String(size_t size) : Array(size) { m_storage[0] = '\0'; }
+    alignas(compile_time_cache_line_size) std::atomic<size_t> m_tail;
+    size_t m_head_cache;  // Producer's view of m_head.
+    alignas(compile_time_cache_line_size) std::atomic<size_t> m_head;
+    size_t m_tail_cache;  // Consumer's view of m_tail.
+    alignas(compile_time_cache_line_size) T* m_slots;
+    size_t m_mask;
+    Alloc  m_alloc;
 };
 
 /**
- * djb2 hashing
+ * Any number of producers and consumers. Dmitry Vyukov's bounded queue:
+ * every slot carries a sequence number that says whose turn it is, so a
+ * push or pop is one compare-and-swap on the shared index plus a store to
+ * the slot. Lock-free, not wait-free.
  */
-static inline uint64_t djb2(char* data) {
-    uint64_t hash = 5381;
-    while (*data != '\0') {
-        hash = (hash * 33) ^ (uint64_t)(*data);
-        ++data;
-    }
-    return hash;
-}
-
-template<typename ValT>
-class Dict {
-private:
-    static const uint64_t default_size = 32;
-    struct Field {
-        /* MSB: Bit describing if field is taken.
-         * 63-bit hash for the key.*/
-        uint64_t descr;
-        ValT data;
+template <typename T, typename Alloc = HeapAllocator>
+class MpmcQueue : public Noncopyable {
+    struct Cell {
+        std::atomic<size_t> sequence;
+        alignas(T) unsigned char storage[sizeof(T)];
+        T* value() { return reinterpret_cast<T*>(storage); }
     };
 
 public:
-    explicit Dict(uint64_t size) : m_dict_size(size), m_fields(size) {
-        for(size_t i = 0; i < m_dict_size; ++i) {
-            m_fields.push_back({0, ValT()});
+    explicit MpmcQueue(size_t capacity, const Alloc& alloc = Alloc()) :
+        m_tail(0), m_head(0), m_alloc(alloc) {
+        size_t c = 2;
+        while (c < capacity) c *= 2;
+        m_mask  = c - 1;
+        m_cells = (Cell*)m_alloc.allocate(c * sizeof(Cell), alignof(Cell));
+        for (size_t i = 0; i < c; ++i) {
+            new (&m_cells[i].sequence) std::atomic<size_t>(i);
         }
     }
-    Dict() : Dict(64) { }
 
-    void insert(const String& key, const ValT& val) {
-        const auto very_long_hash = djb2((char*)key.str());
-        const uint64_t descr = very_long_hash | (uint64_t(1) << 63);
-        if (insert(descr, val) == -1) {
-            fprintf(stderr, "ERROR: ==== Dict error: Duplicate key %s\n", key.str());
+    ~MpmcQueue() {
+        const size_t tail = m_tail.load(std::memory_order_relaxed);
+        for (size_t i = m_head.load(std::memory_order_relaxed); i != tail; ++i) {
+            m_cells[i & m_mask].value()->~T();
         }
+        m_alloc.deallocate(m_cells, capacity() * sizeof(Cell), alignof(Cell));
     }
 
-    int insert(const uint64_t descr, const ValT& val) {
-        // Check that description is OK.
-        for(const auto& field : m_fields) {
-            if (field.descr == descr) {
-                return -1;
-            }
+    bool try_push(const T& e) { return try_emplace(e); }
+    bool try_push(T&& e) { return try_emplace(std::move(e)); }
+
+    template <typename... Args>
+    bool try_emplace(Args&&... args) {
+        size_t pos;
+        if (claim(&m_tail, 0, 1, &pos) == 0) {
+            return false;
         }
-        const auto long_hash = (uint64_t(1) << 63) ^ descr;
-        const auto hash = long_hash % m_fields.num_elements();
-        auto free_hash = hash;
-        while (m_fields[free_hash].descr >> 63) {
-            free_hash = (free_hash + 1) % m_dict_size;
-            if (free_hash == hash) {
-                // Resize our buffer
-                m_dict_size *= 2;
-                Array<Field> new_storage(m_dict_size);
-                for (size_t i = 0; i < m_dict_size; ++i) {
-                    new_storage.push_back({0, ValT()});
-                }
+        Cell& cell = m_cells[pos & m_mask];
+        new (cell.storage) T(std::forward<Args>(args)...);
+        cell.sequence.store(pos + 1, std::memory_order_release);
+        return true;
+    }
 
-                auto* old_storage     = &m_fields[0];
-                auto old_num_elements = m_fields.num_elements();
-                m_fields              = new_storage;
+    /**
+     * Claims as many consecutive slots as are free, up to count, with one
+     * compare-and-swap, and copies items into them. Returns how many.
+     */
+    size_t try_push(const T* items, size_t count) {
+        size_t pos;
+        const size_t n = claim(&m_tail, 0, count, &pos);
+        for (size_t i = 0; i < n; ++i) {
+            Cell& cell = m_cells[(pos + i) & m_mask];
+            new (cell.storage) T(items[i]);
+            cell.sequence.store(pos + i + 1, std::memory_order_release);
+        }
+        return n;
+    }
 
-                // Re-hash and re-insert
-                for (size_t i = 0; i < old_num_elements; ++i) {
-                    const uint64_t descr_i = old_storage[i].descr;
-                    if ((descr_i >> 63)) {
-                        insert(descr_i, old_storage[i].data);  // Re-insert
-                    }
+    Maybe<T> try_pop() {
+        size_t pos;
+        if (claim(&m_head, 1, 1, &pos) == 0) {
+            return Maybe<T>();
+        }
+        Cell& cell = m_cells[pos & m_mask];
+        Maybe<T> result(std::move(*cell.value()));
+        release(cell, pos);
+        return result;
+    }
+
+    /**
+     * Moves up to max elements into out. Returns how many.
+     */
+    size_t try_pop(T* out, size_t max) {
+        size_t pos;
+        const size_t n = claim(&m_head, 1, max, &pos);
+        for (size_t i = 0; i < n; ++i) {
+            Cell& cell = m_cells[(pos + i) & m_mask];
+            out[i] = std::move(*cell.value());
+            release(cell, pos + i);
+        }
+        return n;
+    }
+
+    size_t capacity() const { return m_mask + 1; }
+
+    /**
+     * Exact only when nobody is pushing or popping.
+     */
+    size_t num_elements() const {
+        const size_t tail = m_tail.load(std::memory_order_acquire);
+        const size_t head = m_head.load(std::memory_order_acquire);
+        return tail > head ? tail - head : 0;
+    }
+
+private:
+    // A cell at position pos is ready for producers when its sequence is
+    // pos, and for consumers when it is pos + 1 (lag). Counts the ready
+    // cells starting at *index, up to max, and moves *index past them.
+    size_t claim(std::atomic<size_t>* index, size_t lag, size_t max, size_t* pos_out) {
+        size_t pos = index->load(std::memory_order_relaxed);
+        for (;;) {
+            size_t n = 0;
+            bool stale = false;
+            while (n < max) {
+                const size_t seq = m_cells[(pos + n) & m_mask].sequence.load(std::memory_order_acquire);
+                const intptr_t diff = (intptr_t)(seq - (pos + n + lag));
+                if (diff != 0) {
+                    // Ahead of us: someone else took pos, reload. Behind:
+                    // full (or empty), stop here.
+                    stale = diff > 0 && n == 0;
+                    break;
                 }
-                free_hash = hash;
+                ++n;
+            }
+            if (n == 0 && !stale) {
+                return 0;
             }
+            if (n > 0 && index->compare_exchange_weak(pos, pos + n, std::memory_order_relaxed)) {
+                *pos_out = pos;
+                return n;
+            }
+            if (n == 0) {
+                pos = index->load(std::memory_order_relaxed);
+            }
+            // A failed compare_exchange reloaded pos.
         }
-        m_fields[free_hash] = {descr, val};
-        return 0;
     }
 
-    void print_debug_info() {
-        printf("---------------Dict debug ------\n");
-        for (size_t i = 0; i < m_fields.num_elements(); ++i) {
-            auto field = m_fields[i];
-#if !defined(__MACH__)
-            printf("Field %lu, %lu, %d\n", i, field.descr, field.data);
-#else
-            printf("Field %zu, %llu, %d\n", i, field.descr, field.data);
+    // Destroys the value and hands the cell to the producer one lap ahead.
+    void release(Cell& cell, size_t pos) {
+        cell.value()->~T();
+        cell.sequence.store(pos + m_mask + 1, std::memory_order_release);
+    }
+
+    alignas(compile_time_cache_line_size) std::atomic<size_t> m_tail;
+    alignas(compile_time_cache_line_size) std::atomic<size_t> m_head;
+    alignas(compile_time_cache_line_size) Cell* m_cells;
+    size_t m_mask;
+    Alloc  m_alloc;
+};
+
+namespace detail {
+
+// Tells the core we're spinning: pause on x86, nothing elsewhere.
+inline void cpu_relax() {
+#if (defined(__x86_64__) || defined(__i386__)) && (defined(__GNUC__) || defined(__clang__))
+    __builtin_ia32_pause();
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+    _mm_pause();
 #endif
+}
+
+/*
+ * Readers-writer spin lock in one word: the top bit is the writer, the
+ * rest counts readers. A waiting writer sets its bit first, which keeps new
+ * readers out, then waits for the current ones to leave.
+ * Meant for short critical sections; it yields after a while.
+ */
+class RwSpinLock : public Noncopyable {
+public:
+    RwSpinLock() : m_state(0) {}
+
+    void lock_shared() {
+        for (int spins = 0;; ++spins) {
+            uint32_t s = m_state.load(std::memory_order_relaxed);
+            if (!(s & writer) &&
+                m_state.compare_exchange_weak(s, s + 1, std::memory_order_acquire,
+                                              std::memory_order_relaxed)) {
+                return;
+            }
+            backoff(spins);
         }
-        printf("-------------------------\n");
     }
 
-    Maybe<ValT> find(const String& key) {
-        const auto very_long_hash = djb2((char*)key.str());
-        const auto descr = very_long_hash | (uint64_t(1) << 63);
-        const auto long_hash = (uint64_t(1) << 63) ^ descr;
-        auto hash = long_hash % m_fields.num_elements();
-        const auto start = hash;
-        while (m_fields[hash].descr != descr) {
-            hash = (hash + 1) % m_fields.num_elements();
-            if (start == hash) {
-                return Maybe<ValT>();
+    void unlock_shared() {
+        m_state.fetch_sub(1, std::memory_order_release);
+    }
+
+    void lock() {
+        for (int spins = 0;; ++spins) {
+            uint32_t s = m_state.load(std::memory_order_relaxed);
+            if (!(s & writer) &&
+                m_state.compare_exchange_weak(s, s | writer, std::memory_order_acquire,
+                                              std::memory_order_relaxed)) {
+                break;
             }
+            backoff(spins);
+        }
+        for (int spins = 0; m_state.load(std::memory_order_acquire) != writer; ++spins) {
+            backoff(spins);
+        }
+    }
+
+    void unlock() {
+        m_state.store(0, std::memory_order_release);
+    }
+
+private:
+    static const uint32_t writer = 0x80000000u;
+
+    static void backoff(int spins) {
+        if (spins < 64) {
+            cpu_relax();
+        } else {
+            std::this_thread::yield();
+        }
+    }
+
+    std::atomic<uint32_t> m_state;
+};
+
+}  // namespace detail
+
+/**
+ * HashMap split into independently locked shards, for tables that many
+ * threads read and a few update.
+ *
+ * The top bits of a key's hash pick the shard; HashMap uses the low bits,
+ * so the two don't correlate. Each shard sits on its own cache lines with a
+ * readers-writer spin lock, and grows on its own. Readers of different
+ * shards never touch the same memory, and readers of the same shard only
+ * share the lock word.
+ *
+ * find() copies the value out, since the lock is gone by the time it
+ * returns. visit() runs a function on the value under the read lock
+ * instead, and update() on a writable value under the write lock.
+ *
+ * Alloc is used from several threads at once. HeapAllocator is fine, an
+ * ArenaAllocator or PoolAllocator is not.
+ */
+template <typename K, typename V, typename HashT = Hash<K>, typename EqT = Equal<K>,
+          typename Alloc = HeapAllocator>
+class ConcurrentHashMap : public Noncopyable {
+    typedef HashMap<K, V, HashT, EqT, Alloc> Map;
+
+    struct alignas(compile_time_cache_line_size) Shard {
+        Shard(size_t size, const Alloc& alloc, const HashT& hash, const EqT& eq) :
+            map(size, alloc, hash, eq) {}
+        mutable detail::RwSpinLock lock;
+        Map map;
+    };
+
+public:
+    /**
+     * num_shards == 0 picks four per logical core. Rounded up to a power
+     * of two either way. size is the expected total number of elements.
+     */
+    explicit ConcurrentHashMap(size_t num_shards = 0, size_t size = 0, const Alloc& alloc = Alloc(),
+                               const HashT& hash = HashT(), const EqT& eq = EqT()) :
+        m_hash(hash) {
+        if (num_shards == 0) {
+            num_shards = 4 * cpu_info().logical_cores;
+        }
+        m_shift = 64;
+        size_t n = 1;
+        while (n < num_shards) {
+            n *= 2;
+            --m_shift;
+        }
+        m_num_shards = n;
+        m_shards = (Shard*)HeapAllocator().allocate(n * sizeof(Shard), alignof(Shard));
+        const size_t per_shard = size / n + 1;
+        for (size_t i = 0; i < n; ++i) {
+            new (&m_shards[i]) Shard(per_shard, alloc, hash, eq);
+        }
+    }
+
+    ~ConcurrentHashMap() {
+        for (size_t i = 0; i < m_num_shards; ++i) {
+            m_shards[i].~Shard();
+        }
+        HeapAllocator().deallocate(m_shards, m_num_shards * sizeof(Shard), alignof(Shard));
+    }
+
+    bool insert(const K& key, const V& val) { return insert_impl(key, val); }
+    template <typename Q, typename H = HashT, typename = typename H::is_transparent>
+    bool insert(const Q& key, const V& val) { return insert_impl(key, val); }
+
+    void insert_or_assign(const K& key, const V& val) { insert_or_assign_impl(key, val); }
+    template <typename Q, typename H = HashT, typename = typename H::is_transparent>
+    void insert_or_assign(const Q& key, const V& val) { insert_or_assign_impl(key, val); }
+
+    bool erase(const K& key) { return erase_impl(key); }
+    template <typename Q, typename H = HashT, typename = typename H::is_transparent>
+    bool erase(const Q& key) { return erase_impl(key); }
+
+    bool contains(const K& key) const { return contains_impl(key); }
+    template <typename Q, typename H = HashT, typename = typename H::is_transparent>
+    bool contains(const Q& key) const { return contains_impl(key); }
+
+    Maybe<V> find(const K& key) const { return find_impl(key); }
+    template <typename Q, typename H = HashT, typename = typename H::is_transparent>
+    Maybe<V> find(const Q& key) const { return find_impl(key); }
+
+    /**
+     * Calls f(const V&) under the shard's read lock. False if key isn't there.
+     */
+    template <typename Q, typename F>
+    bool visit(const Q& key, const F& f) const {
+        const uint64_t hash = m_hash(key);
+        const Shard& shard = shard_for(hash);
+        shard.lock.lock_shared();
+        const Maybe<const V&> found = shard.map.find_impl(hash, key);
+        if (found.valid()) {
+            f(found.value());
+        }
+        shard.lock.unlock_shared();
+        return found.valid();
+    }
+
+    /**
+     * Calls f(V&) under the shard's write lock. False if key isn't there.
+     */
+    template <typename Q, typename F>
+    bool update(const Q& key, const F& f) {
+        const uint64_t hash = m_hash(key);
+        Shard& shard = shard_for(hash);
+        shard.lock.lock();
+        const Maybe<V&> found = shard.map.find_impl(hash, key);
+        if (found.valid()) {
+            f(found.value());
+        }
+        shard.lock.unlock();
+        return found.valid();
+    }
+
+    /**
+     * Sum over the shards, each read at a slightly different time.
+     */
+    size_t num_elements() const {
+        size_t total = 0;
+        for (size_t i = 0; i < m_num_shards; ++i) {
+            m_shards[i].lock.lock_shared();
+            total += m_shards[i].map.num_elements();
+            m_shards[i].lock.unlock_shared();
         }
-        return Maybe<ValT>(m_fields[hash].data);
+        return total;
     }
 
+    size_t num_shards() const { return m_num_shards; }
+
 private:
-    size_t m_dict_size;
-    Array<Field> m_fields;
+    // Takes m_hash(key), which the shard's map is then given too, so that
+    // every call hashes the key once.
+    Shard& shard_for(uint64_t hash) const {
+        // m_shift is 64 with one shard, and shifting by 64 is undefined.
+        return m_shards[m_num_shards == 1 ? 0 : (size_t)(hash >> m_shift)];
+    }
+
+    template <typename Q>
+    bool insert_impl(const Q& key, const V& val) {
+        const uint64_t hash = m_hash(key);
+        Shard& shard = shard_for(hash);
+        shard.lock.lock();
+        const bool inserted = shard.map.insert_impl(hash, key, val);
+        shard.lock.unlock();
+        return inserted;
+    }
+
+    template <typename Q>
+    void insert_or_assign_impl(const Q& key, const V& val) {
+        const uint64_t hash = m_hash(key);
+        Shard& shard = shard_for(hash);
+        shard.lock.lock();
+        shard.map.insert_or_assign_impl(hash, key, val);
+        shard.lock.unlock();
+    }
+
+    template <typename Q>
+    bool erase_impl(const Q& key) {
+        const uint64_t hash = m_hash(key);
+        Shard& shard = shard_for(hash);
+        shard.lock.lock();
+        const bool erased = shard.map.erase_impl(hash, key);
+        shard.lock.unlock();
+        return erased;
+    }
+
+    template <typename Q>
+    bool contains_impl(const Q& key) const {
+        const uint64_t hash = m_hash(key);
+        const Shard& shard = shard_for(hash);
+        shard.lock.lock_shared();
+        const bool found = shard.map.find_impl(hash, key).valid();
+        shard.lock.unlock_shared();
+        return found;
+    }
+
+    template <typename Q>
+    Maybe<V> find_impl(const Q& key) const {
+        const uint64_t hash = m_hash(key);
+        const Shard& shard = shard_for(hash);
+        shard.lock.lock_shared();
+        Maybe<V> found = shard.map.find_impl(hash, key);
+        shard.lock.unlock_shared();
+        return found;
+    }
+
+    Shard*   m_shards;
+    size_t   m_num_shards;
+    unsigned m_shift;
+    HashT    m_hash;
+};
+
+/**
+ * ConcurrentHashMap from Strings to ValT.
+ */
+template <typename ValT, typename Alloc = HeapAllocator>
+using ConcurrentDict = ConcurrentHashMap<BasicString<Alloc>, ValT, Hash<BasicString<Alloc>>,
+                                         Equal<BasicString<Alloc>>, Alloc>;
+
+////////////////////////////////////////////////////////////////////////////////
+// Benchmarking
+////////////////////////////////////////////////////////////////////////////////
+
+/*
+ * Make the compiler believe that value is read, so the computation producing
+ * it can't be optimized away.
+ */
+template <typename T>
+inline void do_not_optimize(const T& value) {
+#if defined(__GNUC__) || defined(__clang__)
+    asm volatile("" : : "r,m"(value) : "memory");
+#else
+    static volatile const void* sink;
+    sink = &value;
+#endif
+}
+
+/*
+ * Make the compiler believe that all memory was read and written.
+ */
+inline void clobber_memory() {
+#if defined(__GNUC__) || defined(__clang__)
+    asm volatile("" : : : "memory");
+#elif defined(_MSC_VER)
+    _ReadWriteBarrier();
+#endif
+}
+
+/*
+ * Nanoseconds per iteration. Fractional, so calls under a nanosecond
+ * still show up.
+ */
+struct BenchStats {
+    double   min_ns;
+    double   median_ns;
+    double   p99_ns;
+    double   max_ns;
+    double   mean_ns;
+    size_t   runs;
+    size_t   iterations;  // Per run.
 };
 
+namespace detail {
+inline int compare_double(const void* a, const void* b) {
+    const double x = *(const double*)a;
+    const double y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+}  // namespace detail
+
+/**
+ * Runs f() `warmup` times untimed, then times `runs` runs of `iterations`
+ * calls each and reports per-call statistics.
+ * iterations == 0 picks a count that makes one run last at least ~100us, so
+ * that tiny functions are not dominated by clock resolution.
+ *
+ * BenchStats s = benchmark([&]{ do_not_optimize(compute()); });
+ */
+template <typename F>
+BenchStats benchmark(F f, size_t runs = 31, size_t warmup = 3, size_t iterations = 0) {
+    sgl_assert(runs > 0);
+    for (size_t i = 0; i < warmup; ++i) {
+        f();
+        clobber_memory();
+    }
+    if (iterations == 0) {
+        iterations = 1;
+        for (;;) {
+            Stopwatch watch;
+            for (size_t i = 0; i < iterations; ++i) {
+                f();
+                clobber_memory();
+            }
+            if (watch.elapsed_ns() >= 100000 || iterations >= (size_t(1) << 30)) {
+                break;
+            }
+            iterations *= 2;
+        }
+    }
+    Array<double> samples(runs);
+    double total = 0;
+    for (size_t r = 0; r < runs; ++r) {
+        Stopwatch watch;
+        for (size_t i = 0; i < iterations; ++i) {
+            f();
+            clobber_memory();
+        }
+        const double per_call = (double)watch.elapsed_ns() / (double)iterations;
+        samples.push_back(per_call);
+        total += per_call;
+    }
+    qsort(samples.ptr(), runs, sizeof(double), detail::compare_double);
+    BenchStats stats;
+    stats.min_ns     = samples[0];
+    stats.median_ns  = samples[runs / 2];
+    stats.p99_ns     = samples[(runs * 99) / 100 < runs ? (runs * 99) / 100 : runs - 1];
+    stats.max_ns     = samples[runs - 1];
+    stats.mean_ns    = total / (double)runs;
+    stats.runs       = runs;
+    stats.iterations = iterations;
+    return stats;
+}
+
+inline void print_bench(const char* name, const BenchStats& stats) {
+    printf("%-40s min %12.2f ns  median %12.2f ns  p99 %12.2f ns  (%zu runs x %zu)\n",
+           name, stats.min_ns, stats.median_ns, stats.p99_ns, stats.runs, stats.iterations);
+}
+
 }  // namespace sgl
 
 
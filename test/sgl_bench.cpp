@@ -0,0 +1,706 @@
+// sgl_bench.cpp : sgl containers against their std counterparts.
+//
+// Usage: sgl_bench [--csv | --json] [--max-size N] [--budget-ms N] [--out file]
+//
+// "append" copies the source in blocks of 1000 elements, like decoded input.
+// "hash" hashes one key of N bytes per call.
+// "find" looks for a needle at the end of N bytes.
+// "number" formats or parses N integers or doubles.
+// "sort" sorts N 64-bit ids; "search" looks each of them up in the sorted array.
+// "parallel" runs parallel_reduce/transform/inclusive_scan over N doubles on
+// default_thread_pool(), against the plain loop.
+// "write" writes N lines of a Dict dump to the null device with Writer,
+// Writer with its background flusher, and fprintf.
+// "snapshot" gets a Dict of N entries by parsing "key value" lines, by
+// copying it out of a snapshot file, and by mapping that file (checksum
+// verified, then one lookup).
+// Every case runs at sizes 10, 100, ... up to --max-size (10M by default).
+// A case stops growing once one of its runs takes longer than --budget-ms.
+// Output goes to stdout (or --out) as CSV (default) or JSON, one record per
+// (case, implementation, size). Times are nanoseconds per call of the case,
+// i.e. for the whole size-N operation, not per element.
+
+#include "../sgl.h"
+
+#include <algorithm>
+#include <string>  // For shootout purposes.
+#include <unordered_map>
+#include <vector>
+
+struct Result {
+    const char*     container;
+    const char*     op;
+    const char*     impl;
+    size_t          size;
+    sgl::BenchStats stats;
+};
+
+static sgl::Array<Result>* g_results;
+static uint64_t g_budget_ns = 1000000000;
+
+static size_t runs_for_size(size_t n) {
+    return n >= 1000000 ? 5 : 11;
+}
+
+// Runs one implementation of one case. Returns false when over budget.
+template <typename F>
+static bool run(const char* container, const char* op, const char* impl, size_t n, F f) {
+    sgl::BenchStats stats = sgl::benchmark(f, runs_for_size(n), 1);
+    g_results->push_back({container, op, impl, n, stats});
+    fprintf(stderr, "%-8s %-12s %-4s %10zu  median %12.2f ns\n",
+            container, op, impl, n, stats.median_ns);
+    return stats.median_ns * (double)stats.iterations < (double)g_budget_ns;
+}
+
+static void make_key(char* buffer, size_t size, size_t i) {
+    snprintf(buffer, size, "key_%zu", i);
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Array vs std::vector
+////////////////////////////////////////////////////////////////////////////////
+
+static bool bench_array(size_t n) {
+    bool ok = true;
+    ok &= run("array", "push_back", "sgl", n, [n]{
+        sgl::Array<int> a(1);
+        for (size_t i = 0; i < n; ++i) {
+            a.push_back((int)i);
+        }
+        sgl::do_not_optimize(a.ptr());
+    });
+    ok &= run("array", "push_back", "std", n, [n]{
+        std::vector<int> v;
+        for (size_t i = 0; i < n; ++i) {
+            v.push_back((int)i);
+        }
+        sgl::do_not_optimize(v.data());
+    });
+
+    sgl::Array<int> a(n);
+    std::vector<int> v;
+    for (size_t i = 0; i < n; ++i) {
+        a.push_back((int)i);
+        v.push_back((int)i);
+    }
+    ok &= run("array", "copy", "sgl", n, [&a]{
+        sgl::Array<int> copy(a);
+        sgl::do_not_optimize(copy.ptr());
+    });
+    ok &= run("array", "copy", "std", n, [&v]{
+        std::vector<int> copy(v);
+        sgl::do_not_optimize(copy.data());
+    });
+    ok &= run("array", "append", "sgl", n, [&a]{
+        sgl::Array<int> copy;
+        for (size_t i = 0; i < a.num_elements(); i += 1000) {
+            const size_t count = a.num_elements() - i < 1000 ? a.num_elements() - i : 1000;
+            copy.append(a.ptr() + i, count);
+        }
+        sgl::do_not_optimize(copy.ptr());
+    });
+    ok &= run("array", "append", "std", n, [&v]{
+        std::vector<int> copy;
+        for (size_t i = 0; i < v.size(); i += 1000) {
+            const size_t count = v.size() - i < 1000 ? v.size() - i : 1000;
+            copy.insert(copy.end(), v.data() + i, v.data() + i + count);
+        }
+        sgl::do_not_optimize(copy.data());
+    });
+    ok &= run("array", "iterate", "sgl", n, [&a]{
+        int64_t sum = 0;
+        for (auto e : a) {
+            sum += e;
+        }
+        sgl::do_not_optimize(sum);
+    });
+    ok &= run("array", "iterate", "std", n, [&v]{
+        int64_t sum = 0;
+        for (auto e : v) {
+            sum += e;
+        }
+        sgl::do_not_optimize(sum);
+    });
+    return ok;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// String vs std::string
+////////////////////////////////////////////////////////////////////////////////
+
+static bool bench_string(size_t n) {
+    static const char* short_str = "a short string";
+    static const char* fragment = "fragment ";
+    bool ok = true;
+    ok &= run("string", "construct", "sgl", n, [n]{
+        for (size_t i = 0; i < n; ++i) {
+            sgl::String s(short_str);
+            sgl::do_not_optimize(s.str());
+        }
+    });
+    ok &= run("string", "construct", "std", n, [n]{
+        for (size_t i = 0; i < n; ++i) {
+            std::string s(short_str);
+            sgl::do_not_optimize(s.c_str());
+        }
+    });
+    ok &= run("string", "append", "sgl", n, [n]{
+        sgl::String s;
+        sgl::String frag(fragment);
+        for (size_t i = 0; i < n; ++i) {
+            s += frag;
+        }
+        sgl::do_not_optimize(s.str());
+    });
+    ok &= run("string", "append", "std", n, [n]{
+        std::string s;
+        std::string frag(fragment);
+        for (size_t i = 0; i < n; ++i) {
+            s += frag;
+        }
+        sgl::do_not_optimize(s.c_str());
+    });
+
+    // Needle at the very end of an n-byte haystack.
+    static const char* needle = "needle";
+    std::string hay(n, 'e');
+    hay += needle;
+    const sgl::StringView view(hay.data(), hay.size());
+    ok &= run("string", "find", "sgl", n, [&]{
+        sgl::do_not_optimize(view.find(needle));
+    });
+    ok &= run("string", "find", "std", n, [&]{
+        sgl::do_not_optimize(hay.find(needle));
+    });
+    return ok;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Dict vs std::unordered_map
+////////////////////////////////////////////////////////////////////////////////
+
+static bool bench_dict(size_t n) {
+    char buffer[32];
+    // Key storage is not under test.
+    std::vector<sgl::String> keys;
+    std::vector<sgl::String> missing;
+    std::vector<std::string> std_keys;
+    std::vector<std::string> std_missing;
+    for (size_t i = 0; i < n; ++i) {
+        make_key(buffer, sizeof(buffer), i);
+        keys.push_back(sgl::String(buffer));
+        std_keys.push_back(std::string(buffer));
+        make_key(buffer, sizeof(buffer), i + n);
+        missing.push_back(sgl::String(buffer));
+        std_missing.push_back(std::string(buffer));
+    }
+
+    bool ok = true;
+    ok &= run("dict", "insert", "sgl", n, [&]{
+        sgl::Dict<int> dict;
+        for (size_t i = 0; i < n; ++i) {
+            dict.insert(keys[i], (int)i);
+        }
+        sgl::do_not_optimize(dict);
+    });
+    ok &= run("dict", "insert", "std", n, [&]{
+        std::unordered_map<std::string, int> map;
+        for (size_t i = 0; i < n; ++i) {
+            map.insert(std::make_pair(std_keys[i], (int)i));
+        }
+        sgl::do_not_optimize(map);
+    });
+
+    sgl::Dict<int> dict;
+    std::unordered_map<std::string, int> map;
+    for (size_t i = 0; i < n; ++i) {
+        dict.insert(keys[i], (int)i);
+        map.insert(std::make_pair(std_keys[i], (int)i));
+    }
+    ok &= run("dict", "find_hit", "sgl", n, [&]{
+        size_t found = 0;
+        for (size_t i = 0; i < n; ++i) {
+            found += dict.find(keys[i]).valid();
+        }
+        sgl::do_not_optimize(found);
+    });
+    ok &= run("dict", "find_hit", "std", n, [&]{
+        size_t found = 0;
+        for (size_t i = 0; i < n; ++i) {
+            found += map.find(std_keys[i]) != map.end();
+        }
+        sgl::do_not_optimize(found);
+    });
+    // Same keys, interned up front: lookups hash and compare integers.
+    sgl::Interner interner(n);
+    std::vector<sgl::Symbol> symbols;
+    sgl::HashMap<sgl::Symbol, int> by_symbol(n);
+    for (size_t i = 0; i < n; ++i) {
+        symbols.push_back(interner.intern(keys[i]));
+        by_symbol.insert(symbols[i], (int)i);
+    }
+    ok &= run("dict", "find_symbol", "sgl", n, [&]{
+        size_t found = 0;
+        for (size_t i = 0; i < n; ++i) {
+            found += by_symbol.contains(symbols[i]);
+        }
+        sgl::do_not_optimize(found);
+    });
+    ok &= run("dict", "find_miss", "sgl", n, [&]{
+        size_t found = 0;
+        for (size_t i = 0; i < n; ++i) {
+            found += dict.find(missing[i]).valid();
+        }
+        sgl::do_not_optimize(found);
+    });
+    ok &= run("dict", "find_miss", "std", n, [&]{
+        size_t found = 0;
+        for (size_t i = 0; i < n; ++i) {
+            found += map.find(std_missing[i]) != map.end();
+        }
+        sgl::do_not_optimize(found);
+    });
+    return ok;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// HashMap vs std::unordered_map, integer keys
+////////////////////////////////////////////////////////////////////////////////
+
+static bool bench_hashmap(size_t n) {
+    std::vector<uint64_t> keys;
+    for (size_t i = 0; i < n; ++i) {
+        keys.push_back((uint64_t)i * 0x9e3779b97f4a7c15ull);
+    }
+
+    bool ok = true;
+    ok &= run("hashmap", "insert", "sgl", n, [&]{
+        sgl::HashMap<uint64_t, int> map;
+        for (size_t i = 0; i < n; ++i) {
+            map.insert(keys[i], (int)i);
+        }
+        sgl::do_not_optimize(map);
+    });
+    ok &= run("hashmap", "insert", "std", n, [&]{
+        std::unordered_map<uint64_t, int> map;
+        for (size_t i = 0; i < n; ++i) {
+            map.insert(std::make_pair(keys[i], (int)i));
+        }
+        sgl::do_not_optimize(map);
+    });
+
+    sgl::HashMap<uint64_t, int> map;
+    std::unordered_map<uint64_t, int> std_map;
+    for (size_t i = 0; i < n; ++i) {
+        map.insert(keys[i], (int)i);
+        std_map.insert(std::make_pair(keys[i], (int)i));
+    }
+    ok &= run("hashmap", "find_hit", "sgl", n, [&]{
+        size_t found = 0;
+        for (size_t i = 0; i < n; ++i) {
+            found += map.contains(keys[i]);
+        }
+        sgl::do_not_optimize(found);
+    });
+    ok &= run("hashmap", "find_hit", "std", n, [&]{
+        size_t found = 0;
+        for (size_t i = 0; i < n; ++i) {
+            found += std_map.find(keys[i]) != std_map.end();
+        }
+        sgl::do_not_optimize(found);
+    });
+    return ok;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// hash_bytes vs djb2 vs std::hash
+////////////////////////////////////////////////////////////////////////////////
+
+static bool bench_hash(size_t n) {
+    // One n-byte key per call.
+    sgl::Array<char> bytes(n + 1);
+    for (size_t i = 0; i < n; ++i) {
+        bytes.push_back((char)('a' + i % 26));
+    }
+    bytes.push_back('\0');
+    std::string str(bytes.ptr(), n);
+
+    bool ok = true;
+    ok &= run("hash", "bytes", "sgl", n, [&]{
+        sgl::do_not_optimize(sgl::hash_bytes(bytes.ptr(), n));
+    });
+    ok &= run("hash", "bytes", "djb2", n, [&]{
+        sgl::do_not_optimize(sgl::djb2(bytes.ptr()));
+    });
+    ok &= run("hash", "bytes", "std", n, [&]{
+        sgl::do_not_optimize(std::hash<std::string>()(str));
+    });
+    return ok;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// format/parse vs snprintf/strtoll/strtod
+////////////////////////////////////////////////////////////////////////////////
+
+static bool bench_number(size_t n) {
+    // n values and their text, one per line.
+    sgl::Array<int64_t> ints(n);
+    sgl::Array<double> doubles(n);
+    uint64_t state = 1;
+    for (size_t i = 0; i < n; ++i) {
+        state = state * 6364136223846793005ull + 1442695040888963407ull;
+        ints.push_back((int64_t)(state >> 20) - ((int64_t)1 << 43));
+        doubles.push_back((double)(state >> 11) / 9007199254740992.0 * 1e6);
+    }
+    sgl::String int_text, double_text;
+    for (size_t i = 0; i < n; ++i) {
+        sgl::format(ints[i], &int_text);
+        int_text += '\n';
+        sgl::format(doubles[i], &double_text);
+        double_text += '\n';
+    }
+
+    bool ok = true;
+    char buffer[64];
+    ok &= run("number", "format_int", "sgl", n, [&]{
+        for (int64_t x : ints) {
+            sgl::do_not_optimize(sgl::format(x, buffer));
+        }
+    });
+    ok &= run("number", "format_int", "std", n, [&]{
+        for (int64_t x : ints) {
+            sgl::do_not_optimize(snprintf(buffer, sizeof(buffer), "%" PRId64, x));
+        }
+    });
+    ok &= run("number", "format_double", "sgl", n, [&]{
+        for (double x : doubles) {
+            sgl::do_not_optimize(sgl::format(x, buffer));
+        }
+    });
+    ok &= run("number", "format_double", "std", n, [&]{
+        for (double x : doubles) {
+            sgl::do_not_optimize(snprintf(buffer, sizeof(buffer), "%.17g", x));
+        }
+    });
+    ok &= run("number", "parse_int", "sgl", n, [&]{
+        int64_t sum = 0;
+        for (sgl::StringView line : sgl::StringView(int_text).tokens("\n")) {
+            sum += sgl::parse<int64_t>(line).value();
+        }
+        sgl::do_not_optimize(sum);
+    });
+    ok &= run("number", "parse_int", "std", n, [&]{
+        int64_t sum = 0;
+        for (const char* p = int_text.str(); *p; ++p) {
+            char* end;
+            sum += strtoll(p, &end, 10);
+            p = end;
+        }
+        sgl::do_not_optimize(sum);
+    });
+    ok &= run("number", "parse_double", "sgl", n, [&]{
+        double sum = 0;
+        for (sgl::StringView line : sgl::StringView(double_text).tokens("\n")) {
+            sum += sgl::parse<double>(line).value();
+        }
+        sgl::do_not_optimize(sum);
+    });
+    ok &= run("number", "parse_double", "std", n, [&]{
+        double sum = 0;
+        for (const char* p = double_text.str(); *p; ++p) {
+            char* end;
+            sum += strtod(p, &end);
+            p = end;
+        }
+        sgl::do_not_optimize(sum);
+    });
+    return ok;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+
+static void write_csv(FILE* out) {
+    fprintf(out, "container,op,impl,size,min_ns,median_ns,p99_ns,max_ns,mean_ns,runs,iterations\n");
+    for (const auto& r : *g_results) {
+        fprintf(out, "%s,%s,%s,%zu,%.2f,%.2f,%.2f,%.2f,%.2f,%zu,%zu\n",
+                r.container, r.op, r.impl, r.size,
+                r.stats.min_ns, r.stats.median_ns, r.stats.p99_ns, r.stats.max_ns,
+                r.stats.mean_ns, r.stats.runs, r.stats.iterations);
+    }
+}
+
+static void write_json(FILE* out) {
+    fprintf(out, "{\n  \"cache_line_size\": %zu,\n  \"logical_cores\": %zu,\n  \"results\": [\n",
+            sgl::cache_line_size(), sgl::cpu_info().logical_cores);
+    size_t i = 0;
+    for (const auto& r : *g_results) {
+        fprintf(out, "    {\"container\": \"%s\", \"op\": \"%s\", \"impl\": \"%s\", \"size\": %zu, "
+                "\"min_ns\": %.2f, \"median_ns\": %.2f, \"p99_ns\": %.2f, "
+                "\"max_ns\": %.2f, \"mean_ns\": %.2f, \"runs\": %zu, \"iterations\": %zu}%s\n",
+                r.container, r.op, r.impl, r.size,
+                r.stats.min_ns, r.stats.median_ns, r.stats.p99_ns, r.stats.max_ns,
+                r.stats.mean_ns, r.stats.runs, r.stats.iterations,
+                ++i == g_results->num_elements() ? "" : ",");
+    }
+    fprintf(out, "  ]\n}\n");
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// sort/radix_sort/lower_bound vs std
+////////////////////////////////////////////////////////////////////////////////
+
+static bool bench_sort(size_t n) {
+    // 64-bit ids that use their low 40 bits. Each call sorts a fresh copy.
+    sgl::Array<uint64_t> ids(n);
+    uint64_t state = 1;
+    for (size_t i = 0; i < n; ++i) {
+        state = state * 6364136223846793005ull + 1442695040888963407ull;
+        ids.push_back(state >> 24);
+    }
+    sgl::Array<uint64_t> work(n);
+    std::vector<uint64_t> std_work(n);
+
+    bool ok = true;
+    ok &= run("sort", "u64", "sgl", n, [&]{
+        work = ids;
+        sgl::sort(work);
+        sgl::do_not_optimize(work.ptr());
+    });
+    ok &= run("sort", "u64", "radix", n, [&]{
+        work = ids;
+        sgl::radix_sort(work);
+        sgl::do_not_optimize(work.ptr());
+    });
+    ok &= run("sort", "u64", "std", n, [&]{
+        std_work.assign(ids.begin(), ids.end());
+        std::sort(std_work.begin(), std_work.end());
+        sgl::do_not_optimize(std_work.data());
+    });
+
+    // n lookups of present keys.
+    sgl::sort(work);
+    sgl::EytzingerArray<uint64_t> eytzinger(work);
+    ok &= run("search", "lower_bound", "sgl", n, [&]{
+        size_t sum = 0;
+        for (size_t i = 0; i < n; ++i) {
+            sum += sgl::lower_bound(work, ids[i]);
+        }
+        sgl::do_not_optimize(sum);
+    });
+    ok &= run("search", "lower_bound", "eytz", n, [&]{
+        uintptr_t sum = 0;
+        for (size_t i = 0; i < n; ++i) {
+            sum += (uintptr_t)eytzinger.lower_bound(ids[i]);
+        }
+        sgl::do_not_optimize(sum);
+    });
+    ok &= run("search", "lower_bound", "std", n, [&]{
+        size_t sum = 0;
+        for (size_t i = 0; i < n; ++i) {
+            sum += (size_t)(std::lower_bound(std_work.begin(), std_work.end(), ids[i]) - std_work.begin());
+        }
+        sgl::do_not_optimize(sum);
+    });
+    return ok;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// parallel_* vs serial loops
+////////////////////////////////////////////////////////////////////////////////
+
+static bool bench_parallel(size_t n) {
+    sgl::Array<double> values(n);
+    for (size_t i = 0; i < n; ++i) {
+        values.push_back((double)(i % 1000) * 0.5);
+    }
+    sgl::Array<double> out(n);
+    sgl::default_thread_pool();  // Start the workers outside the timing.
+
+    bool ok = true;
+    ok &= run("parallel", "reduce", "sgl", n, [&]{
+        sgl::do_not_optimize(sgl::parallel_reduce(values, 0.0, [](double a, double b) { return a + b; }));
+    });
+    ok &= run("parallel", "reduce", "loop", n, [&]{
+        double sum = 0;
+        for (size_t i = 0; i < n; ++i) {
+            sum += values[i];
+        }
+        sgl::do_not_optimize(sum);
+    });
+    ok &= run("parallel", "transform", "sgl", n, [&]{
+        sgl::parallel_transform(values, &out, [](double x) { return sqrt(x) * 3.0 + 1.0; });
+        sgl::do_not_optimize(out.ptr());
+    });
+    ok &= run("parallel", "transform", "loop", n, [&]{
+        out.resize_for_overwrite(n);
+        for (size_t i = 0; i < n; ++i) {
+            out[i] = sqrt(values[i]) * 3.0 + 1.0;
+        }
+        sgl::do_not_optimize(out.ptr());
+    });
+    ok &= run("parallel", "scan", "sgl", n, [&]{
+        sgl::parallel_inclusive_scan(values, &out, [](double a, double b) { return a + b; });
+        sgl::do_not_optimize(out.ptr());
+    });
+    ok &= run("parallel", "scan", "loop", n, [&]{
+        out.resize_for_overwrite(n);
+        double acc = 0;
+        for (size_t i = 0; i < n; ++i) {
+            acc += values[i];
+            out[i] = acc;
+        }
+        sgl::do_not_optimize(out.ptr());
+    });
+    return ok;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Writer vs stdio
+////////////////////////////////////////////////////////////////////////////////
+
+static bool bench_write(size_t n) {
+#if defined(_WIN32)
+    FILE* null_file = fopen("NUL", "wb");
+#else
+    FILE* null_file = fopen("/dev/null", "wb");
+#endif
+    if (!null_file) {
+        return false;
+    }
+    sgl::Writer out(null_file);
+    sgl::Writer background(null_file);
+    background.start_background_flush();
+
+    // n lines of "Field i, hash, value", like a Dict dump.
+    bool ok = true;
+    ok &= run("write", "lines", "sgl", n, [&]{
+        for (size_t i = 0; i < n; ++i) {
+            out.write("Field ").write(i).write(", ").write(i * 0x9e3779b97f4a7c15ull).write(", ");
+            out.write((double)i * 0.25).write('\n');
+        }
+        out.flush();
+    });
+    ok &= run("write", "lines", "sgl_bg", n, [&]{
+        for (size_t i = 0; i < n; ++i) {
+            background.write("Field ").write(i).write(", ").write(i * 0x9e3779b97f4a7c15ull).write(", ");
+            background.write((double)i * 0.25).write('\n');
+        }
+        background.flush();
+    });
+    ok &= run("write", "lines", "std", n, [&]{
+        for (size_t i = 0; i < n; ++i) {
+            fprintf(null_file, "Field %zu, %" PRIu64 ", %g\n", i,
+                    (uint64_t)(i * 0x9e3779b97f4a7c15ull), (double)i * 0.25);
+        }
+        fflush(null_file);
+    });
+    background.stop_background_flush();
+    fclose(null_file);
+    return ok;
+}
+
+////////////////////////////////////////////////////////////////////////////////
+// Snapshot loading vs rebuilding
+////////////////////////////////////////////////////////////////////////////////
+
+static bool bench_snapshot(size_t n) {
+    const char* path = "sgl_bench_snapshot.tmp";
+    // n "key value" lines, the text a table would otherwise be rebuilt from.
+    sgl::String text;
+    char buffer[32];
+    for (size_t i = 0; i < n; ++i) {
+        make_key(buffer, sizeof(buffer), i);
+        text += buffer;
+        text += ' ';
+        sgl::format(i, &text);
+        text += '\n';
+    }
+    sgl::Dict<int64_t> dict;
+    for (sgl::StringView line : sgl::StringView(text).lines()) {
+        const size_t space = line.find(' ');
+        dict.insert(sgl::String(line.substr(0, space)), sgl::parse<int64_t>(line.substr(space + 1)).value());
+    }
+    if (!sgl::save_snapshot(path, dict)) {
+        return false;
+    }
+
+    bool ok = true;
+    ok &= run("snapshot", "dict_load", "rebuild", n, [&]{
+        sgl::Dict<int64_t> d;
+        for (sgl::StringView line : sgl::StringView(text).lines()) {
+            const size_t space = line.find(' ');
+            d.insert(sgl::String(line.substr(0, space)), sgl::parse<int64_t>(line.substr(space + 1)).value());
+        }
+        sgl::do_not_optimize(d.num_elements());
+    });
+    ok &= run("snapshot", "dict_load", "copy", n, [&]{
+        sgl::Dict<int64_t> d;
+        sgl::load_snapshot(path, &d);
+        sgl::do_not_optimize(d.num_elements());
+    });
+    ok &= run("snapshot", "dict_load", "mmap", n, [&]{
+        sgl::Maybe<sgl::Snapshot> snapshot = sgl::Snapshot::open(path);
+        sgl::do_not_optimize(snapshot.value().dict<int64_t>().value().find("key_0").value_or(-1));
+    });
+    remove(path);
+    return ok;
+}
+
+int main(int argc, char** argv) {
+    bool json = false;
+    size_t max_size = 10000000;
+    const char* out_path = NULL;
+    for (int i = 1; i < argc; ++i) {
+        if (!strcmp(argv[i], "--json")) {
+            json = true;
+        } else if (!strcmp(argv[i], "--csv")) {
+            json = false;
+        } else if (!strcmp(argv[i], "--max-size") && i + 1 < argc) {
+            max_size = (size_t)strtoull(argv[++i], NULL, 10);
+        } else if (!strcmp(argv[i], "--budget-ms") && i + 1 < argc) {
+            g_budget_ns = strtoull(argv[++i], NULL, 10) * 1000000;
+        } else if (!strcmp(argv[i], "--out") && i + 1 < argc) {
+            out_path = argv[++i];
+        } else {
+            fprintf(stderr, "Usage: %s [--csv | --json] [--max-size N] [--budget-ms N] [--out file]\n",
+                    argv[0]);
+            return 1;
+        }
+    }
+#ifdef SGL_DEBUG
+    fprintf(stderr, "Warning: benchmarking a debug build.\n");
+#endif
+
+    sgl::Array<Result> results(64);
+    g_results = &results;
+
+    bool array_ok = true, string_ok = true, dict_ok = true, hashmap_ok = true, hash_ok = true;
+    bool number_ok = true, parallel_ok = true, sort_ok = true, write_ok = true, snapshot_ok = true;
+    for (size_t n = 10; n <= max_size; n *= 10) {
+        if (array_ok)   array_ok   = bench_array(n);
+        if (string_ok)  string_ok  = bench_string(n);
+        if (dict_ok)    dict_ok    = bench_dict(n);
+        if (hashmap_ok) hashmap_ok = bench_hashmap(n);
+        if (hash_ok)    hash_ok    = bench_hash(n);
+        if (number_ok)  number_ok  = bench_number(n);
+        if (parallel_ok) parallel_ok = bench_parallel(n);
+        if (sort_ok)    sort_ok    = bench_sort(n);
+        if (write_ok)   write_ok   = bench_write(n);
+        if (snapshot_ok) snapshot_ok = bench_snapshot(n);
+    }
+
+    FILE* out = out_path ? fopen(out_path, "w") : stdout;
+    if (!out) {
+        fprintf(stderr, "Could not open %s\n", out_path);
+        return 1;
+    }
+    if (json) {
+        write_json(out);
+    } else {
+        write_csv(out);
+    }
+    if (out != stdout) {
+        fclose(out);
+    }
+    return 0;
+}
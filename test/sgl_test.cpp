@@ -13,23 +13,34 @@ int get_random_int() {
     return 4;
 }
 
-#if defined(_WIN32)
-#define BENCHMARK(expr) { \
-    LARGE_INTEGER before, after; \
-    QueryPerformanceCounter(&before); \
-    (expr); \
-    QueryPerformanceCounter(&after); \
-    printf("Measure " #expr ": %ld\n", after.QuadPart - before.QuadPart); \
-}
-#elif defined(__linux__) || defined(__MACH__)
-#define BENCHMARK(expr) { \
-    long before, after;\
-    before = sgl::get_nanoseconds();\
-    (expr);\
-    after = sgl::get_nanoseconds();\
-    printf("Measure " #expr ": %ld\n", after - before); \
-}
-#endif
+#define BENCHMARK(expr) \
+    sgl::print_bench(#expr, sgl::benchmark([&]{ (expr); }, 11, 1))
+
+// Counts live instances, to check that containers construct and destroy
+// exactly what they hold.
+struct Tracked {
+    static int live;
+    int value;
+    Tracked(int v) : value(v) { ++live; }
+    Tracked(const Tracked& o) : value(o.value) { ++live; }
+    Tracked(Tracked&& o) : value(o.value) { o.value = -1; ++live; }
+    Tracked& operator=(const Tracked& o) { value = o.value; return *this; }
+    ~Tracked() { --live; }
+};
+int Tracked::live = 0;
+
+struct Counted : sgl::RefCounted<> {
+    static int live;
+    Counted() { ++live; }
+    ~Counted() { --live; }
+};
+int Counted::live = 0;
+
+struct SharedCounted : sgl::AtomicRefCounted {};
+
+struct alignas(64) OverAligned {
+    int value;
+};
 
 void stress_stl_vector(size_t reserve, int times) {
     std::vector<int> v;
@@ -39,6 +50,7 @@ void stress_stl_vector(size_t reserve, int times) {
     for(int i = 0; i < times; ++i) {
         v.push_back(i);
     }
+    sgl::do_not_optimize(v.data());
 }
 
 void stress_sgl_vector(size_t reserve, int times) {
@@ -47,6 +59,7 @@ void stress_sgl_vector(size_t reserve, int times) {
     for(int i = 0; i < times; ++i) {
         v.push_back(i);
     }
+    sgl::do_not_optimize(v.ptr());
 }
 
 #if defined(_WIN32)
@@ -65,10 +78,60 @@ int main()
     sgl::Maybe<int> maybe_too(2);
     maybe = maybe_too;
     sgl_expect(maybe.value() == 2);
+    {
+        // No default constructor needed, and nothing built while empty.
+        sgl::Maybe<Tracked> t;
+        sgl_expect(!t.valid() && Tracked::live == 0);
+        t = Tracked(5);
+        sgl_expect(t.valid() && t.value().value == 5 && Tracked::live == 1);
+        sgl::Maybe<Tracked> moved(std::move(t));
+        sgl_expect(moved.value().value == 5 && t.value().value == -1);
+        t.reset();
+        sgl_expect(!t.valid() && Tracked::live == 1);
+        t.emplace(9);
+        sgl_expect(t.value_or(Tracked(0)).value == 9);
+        sgl::Maybe<int> doubled = t.map([](const Tracked& x) { return x.value * 2; });
+        sgl_expect(doubled.value() == 18);
+        sgl::Maybe<int> half = doubled.and_then([](int x) {
+            return x % 2 ? sgl::Maybe<int>() : sgl::Maybe<int>(x / 2);
+        });
+        sgl_expect(half.value() == 9);
+        (void)half;
+        sgl_expect(sgl::Maybe<int>().map([](int x) { return x + 1; }).value_or(-1) == -1);
+
+        int target = 3;
+        sgl::Maybe<int&> ref(target);
+        ref.value() = 4;
+        sgl_expect(target == 4 && ref.ptr() == &target);
+        sgl::Maybe<const int&> cref = ref;
+        sgl::Maybe<int> copy = cref;
+        target = 5;
+        sgl_expect(cref.value() == 5 && copy.value() == 4);
+        sgl_expect(sgl::Maybe<int&>().value_or(7) == 7);
+        (void)copy;
+
+        // A Maybe of plain data is plain data, returned in registers.
+        static_assert(std::is_trivially_copyable<sgl::Maybe<int>>::value, "Maybe<int> is trivial");
+        static_assert(std::is_trivially_destructible<sgl::Maybe<double>>::value, "Maybe<double> is trivial");
+        static_assert(!std::is_trivially_copyable<sgl::Maybe<sgl::String>>::value, "Maybe<String> copies");
+    }
+    sgl_expect(Tracked::live == 0);
 
     size_t cache_size = sgl::cache_line_size();
     sgl_assert(cache_size);
     printf("cache line in bytes: %ld\n", cache_size);
+    {
+        const sgl::CpuInfo& info = sgl::cpu_info();
+        sgl_expect(&info == &sgl::cpu_info());  // Detected once.
+        sgl_expect(info.l1d_line_size == cache_size);
+        sgl_expect(info.logical_cores >= 1 && info.physical_cores >= 1);
+        sgl_expect(info.physical_cores <= info.logical_cores);
+        sgl_expect(info.numa_nodes >= 1);
+        printf("L1d %zu/%zu, L2 %zu/%zu, L3 %zu/%zu, cores %zu/%zu, numa nodes %zu\n",
+               info.l1d_size, info.l1d_line_size, info.l2_size, info.l2_line_size,
+               info.l3_size, info.l3_line_size,
+               info.physical_cores, info.logical_cores, info.numa_nodes);
+    }
 
     sgl::Array<int> v(1);
     for (int i = 0; i < 16; ++i) {
@@ -78,6 +141,24 @@ int main()
         printf("%d\n", e);
     }
 
+    {
+        sgl::Stopwatch watch;
+        uint64_t before = sgl::Clock::now_ns();
+        uint64_t after = sgl::Clock::now_ns();
+        sgl_expect(after >= before);
+        printf("clock delta: %" PRIu64 " ns\n", after - before);
+        sgl::Stopwatch tsc_watch(true);
+        while (watch.elapsed_ns() < 2000000) {}
+        sgl_expect(tsc_watch.elapsed_ns() > 1000000);
+        printf("ns per tick: %f\n", sgl::Clock::ns_per_tick());
+
+        sgl::BenchStats stats = sgl::benchmark([]{ sgl::do_not_optimize(get_random_int()); }, 21);
+        sgl_expect(stats.runs == 21 && stats.iterations > 0);
+        sgl_expect(stats.min_ns <= stats.median_ns && stats.median_ns <= stats.p99_ns);
+        sgl_expect(stats.p99_ns <= stats.max_ns);
+        sgl::print_bench("get_random_int()", stats);
+    }
+
     size_t reserve = 32;
     BENCHMARK(stress_sgl_vector(reserve, 1));
     BENCHMARK(stress_sgl_vector(reserve, 2));
@@ -119,12 +200,247 @@ int main()
         ad->push_back(42);
         sgl_expect((*ad)[0] == 42);
     }
+    {
+        static_assert(sizeof(sgl::ScopedPtr<int>) == sizeof(int*), "");
+        static_assert(sizeof(sgl::ScopedArray<int>) == sizeof(int*), "");
+        static_assert(sizeof(sgl::RefPtr<Counted>) == sizeof(Counted*), "");
+        static_assert(!std::is_polymorphic<sgl::ScopedPtr<int>>::value, "");
+
+        sgl::Array<sgl::ScopedPtr<Tracked>> owners;
+        for (int i = 0; i < 20; ++i) {
+            owners.push_back(sgl::make_scoped<Tracked>(i));
+        }
+        sgl::ScopedPtr<Tracked> taken = std::move(owners[3]);
+        sgl_expect(!owners[3] && taken->value == 3 && Tracked::live == 20);
+        owners.clear();
+        sgl_expect(Tracked::live == 1);
+        taken.reset();
+        sgl_expect(Tracked::live == 0);
+
+        sgl::ScopedArray<int> numbers(new int[4]);
+        numbers[2] = 7;
+        sgl_expect(numbers.get()[2] == 7);
+
+        sgl::Arena arena;
+        {
+            auto in_arena = sgl::arena_new<Tracked>(&arena, 11);
+            static_assert(sizeof(in_arena) == sizeof(Tracked*), "");
+            sgl_expect(in_arena->value == 11 && Tracked::live == 1);
+        }
+        sgl::Pool pool(sizeof(Tracked));
+        {
+            auto first = sgl::pool_new<Tracked>(&pool, 1);
+            Tracked* where = first.get();
+            first.reset();
+            auto second = sgl::pool_new<Tracked>(&pool, 2);
+            sgl_expect(second.get() == where && Tracked::live == 1);  // Block went back.
+            (void)where;
+        }
+        sgl_expect(Tracked::live == 0);
+
+        sgl::RefPtr<Counted> a = sgl::make_ref<Counted>();
+        sgl_expect(a->ref_count() == 1 && Counted::live == 1);
+        {
+            sgl::RefPtr<Counted> b = a;
+            sgl::RefPtr<Counted> c(b.get());
+            sgl_expect(a->ref_count() == 3 && b == c);
+            sgl::RefPtr<Counted> d = std::move(c);
+            sgl_expect(!c && a->ref_count() == 3);
+        }
+        sgl_expect(a->ref_count() == 1);
+        a.reset();
+        sgl_expect(Counted::live == 0);
+
+        sgl::RefPtr<SharedCounted> shared = sgl::make_ref<SharedCounted>();
+        sgl::RefPtr<SharedCounted> shared_too = shared;
+        sgl_expect(shared->ref_count() == 2);
+    }
     {
         sgl::Array<int> init_list = { 0, 1, 2, 3 };
         for (const auto& e : init_list) {
             printf("%d ", e);
         }
     }
+    {
+        sgl::Array<int> empty;
+        sgl_expect(empty.num_elements() == 0 && empty.capacity() == 0 && !empty.ptr());
+        sgl::Array<int> reserved(100);
+        sgl_expect(reserved.num_elements() == 0 && reserved.capacity() >= 100);
+    }
+    {
+        sgl::Array<Tracked> tracked(1);
+        for (int i = 0; i < 100; ++i) {
+            tracked.emplace_back(i);
+        }
+        sgl_expect(Tracked::live == 100);
+        tracked.push_back(tracked[0]);  // Aliases storage that may move.
+        sgl_expect(tracked[100].value == 0);
+        sgl::Array<Tracked> copy = tracked;
+        sgl_expect(Tracked::live == 202 && copy[50].value == 50);
+        sgl::Array<Tracked> moved = std::move(copy);
+        sgl_expect(Tracked::live == 202 && copy.num_elements() == 0);
+        moved = tracked;
+        sgl_expect(Tracked::live == 202);
+        moved.resize(10);
+        sgl_expect(Tracked::live == 111);
+        tracked = std::move(moved);
+        sgl_expect(Tracked::live == 10 && tracked.num_elements() == 10);
+    }
+    sgl_expect(Tracked::live == 0);
+    {
+        int block[1000];
+        for (int i = 0; i < 1000; ++i) {
+            block[i] = i;
+        }
+        sgl::Array<int> a;
+        a.reserve(1000);
+        const int* before = a.ptr();
+        (void)before;
+        a.append(block, 1000);
+        sgl_expect(a.ptr() == before && a.num_elements() == 1000 && a[999] == 999);
+        a.append(a.ptr(), 10);  // Self append across a reallocation.
+        sgl_expect(a.num_elements() == 1010 && a[1009] == 9);
+        a.erase(1000, 1010);
+        a.erase(0, 500);
+        sgl_expect(a.num_elements() == 500 && a[0] == 500 && a[499] == 999);
+        a.insert(0, block, 500);
+        sgl_expect(a.num_elements() == 1000 && a[499] == 499 && a[500] == 500);
+        a.insert(1, a[999]);
+        sgl_expect(a[1] == 999 && a[2] == 1);
+        a.erase(1);
+        a.pop_back();
+        sgl_expect(a.num_elements() == 999 && a[998] == 998);
+        a.resize(1200, -1);
+        sgl_expect(a.num_elements() == 1200 && a[999] == -1 && a[1199] == -1);
+        a.resize(10, -1);
+        a.shrink_to_fit();
+        sgl_expect(a.num_elements() == 10 && a.capacity() == 10);
+        a.clear();
+        sgl_expect(a.num_elements() == 0 && a.capacity() == 10);
+
+        sgl::Array<int> slow(1);
+        slow.set_growth(sgl::ArrayGrowth::OneAndHalf);
+        for (int i = 0; i < 1000; ++i) {
+            slow.push_back(i);
+        }
+        sgl_expect(slow.capacity() < 1500 && slow[999] == 999);
+    }
+    {
+        sgl::Array<Tracked> t;
+        for (int i = 0; i < 10; ++i) {
+            t.emplace_back(i);
+        }
+        t.insert(5, t[0]);
+        t.erase(0, 3);
+        t.resize(20, Tracked(7));
+        sgl_expect(t.num_elements() == 20 && t[2].value == 0 && t[3].value == 5);
+        sgl_expect(Tracked::live == 20);
+        t.pop_back();
+        t.shrink_to_fit();
+        sgl_expect(Tracked::live == 19 && t[18].value == 7);
+    }
+    sgl_expect(Tracked::live == 0);
+    {
+        sgl::SmallArray<int, 8> small;
+        for (int i = 0; i < 8; ++i) {
+            small.push_back(i);
+        }
+        sgl_expect(small.is_inline());
+        sgl_expect((char*)small.ptr() >= (char*)&small && (char*)small.ptr() < (char*)(&small + 1));
+        sgl::SmallArray<int, 8> small_copy = small;
+        small.push_back(8);  // Spills.
+        sgl_expect(!small.is_inline() && small.num_elements() == 9 && small[8] == 8);
+        sgl_expect(small_copy.is_inline() && small_copy[7] == 7);
+        sgl::Array<int>& as_array = small_copy;
+        as_array.erase(0);
+        sgl_expect(small_copy.num_elements() == 7 && small_copy[0] == 1);
+        sgl::SmallArray<int, 8> moved = std::move(small);
+        sgl_expect(!moved.is_inline() && moved[8] == 8 && small.is_inline());
+        sgl::Array<int> plain = std::move(small_copy);  // Out of the inline buffer.
+        sgl_expect(plain.num_elements() == 7 && plain[6] == 7 && small_copy.num_elements() == 0);
+    }
+    {
+        sgl::SmallArray<Tracked, 4> t;
+        for (int i = 0; i < 4; ++i) {
+            t.emplace_back(i);
+        }
+        sgl::SmallArray<Tracked, 4> inline_moved = std::move(t);
+        sgl_expect(inline_moved.is_inline() && inline_moved[3].value == 3);
+        inline_moved.emplace_back(4);
+        t = std::move(inline_moved);
+        sgl_expect(!t.is_inline() && t.num_elements() == 5 && Tracked::live == 5);
+        t = sgl::SmallArray<Tracked, 4>({Tracked(9)});
+        sgl_expect(t.num_elements() == 1 && t[0].value == 9);
+    }
+    sgl_expect(Tracked::live == 0);
+    {
+        sgl::Arena arena(4096);
+        void* first = arena.allocate(16, 8);
+        (void)first;
+        sgl::Arena::Mark mark = arena.mark();
+        sgl::ArenaAllocator alloc(&arena);
+        {
+            sgl::Array<int, sgl::ArenaAllocator> a(alloc);
+            for (int i = 0; i < 500; ++i) {
+                a.push_back(i);  // Last allocation: grows in place.
+            }
+            sgl_expect(a[499] == 499 && arena.bytes_used() < 4096);
+            sgl::Array<int, sgl::ArenaAllocator> big(100000, alloc);  // Oversized block.
+            big.resize(100000, 7);
+            sgl_expect(big[99999] == 7);
+            sgl::SmallArray<int, 4, sgl::ArenaAllocator> small(alloc);
+            small.append(a.ptr(), 10);
+            sgl_expect(!small.is_inline() && small[9] == 9);
+        }
+        arena.reset(mark);
+        sgl_expect(arena.allocate(16, 8) == (char*)first + 16);
+        {
+            sgl::BasicString<sgl::ArenaAllocator> s("arena string", alloc);
+            sgl::BasicString<sgl::ArenaAllocator> t = s.appended(s);
+            sgl_expect(!strcmp(t.str(), "arena stringarena string"));
+            sgl::Dict<int, sgl::ArenaAllocator> dict(alloc);
+            dict.insert(sgl::String("one"), 1);
+            sgl_expect(dict.find(sgl::String("one")).value() == 1);
+
+            sgl::Arena other_arena;
+            sgl::ArenaAllocator other_alloc(&other_arena);
+            sgl::Array<int, sgl::ArenaAllocator> x(other_alloc);
+            x.push_back(1);
+            sgl::Array<int, sgl::ArenaAllocator> y(alloc);
+            y = std::move(x);  // Different arenas: moves the elements.
+            sgl_expect(y[0] == 1 && y.allocator() == alloc);
+        }
+        arena.reset();
+        sgl_expect(arena.bytes_used() == 0);
+    }
+    {
+        sgl::Pool pool(sizeof(int) * 16, 4);
+        sgl::PoolAllocator alloc(&pool);
+        void* a = pool.allocate();
+        void* b = pool.allocate();
+        sgl_expect(a != b);
+        pool.free(a);
+        sgl_expect(pool.allocate() == a);
+        pool.free(b);
+        for (int n = 0; n < 10; ++n) {  // More than one chunk.
+            sgl::Array<int, sgl::PoolAllocator> block(alloc);
+            block.reserve(16);
+            block.resize(16, n);
+            sgl_expect(block[15] == n && block.capacity() == 16);
+        }
+    }
+    {
+        sgl::Array<sgl::String> strings;
+        for (int i = 0; i < 100; ++i) {
+            strings.push_back(sgl::String("grow me"));
+        }
+        sgl_expect(!strcmp(strings[99].str(), "grow me"));
+        sgl::Array<OverAligned> aligned;
+        for (int i = 0; i < 10; ++i) {
+            aligned.push_back({i});
+        }
+        sgl_expect(((uintptr_t)aligned.ptr() & 63) == 0 && aligned[9].value == 9);
+    }
 
     {
         sgl::String s;
@@ -149,6 +465,155 @@ int main()
         printf("\n----\n");
     }
 
+    {
+        // Short strings stay inside the object.
+        sgl::String empty;
+        sgl::String small("twenty-four characters!!");
+        sgl::String fits("exactly 23 characters!!");
+        sgl_expect(empty.is_inline() && empty.num_elements() == 0 && !strcmp(empty.str(), ""));
+        sgl_expect(!small.is_inline() && fits.is_inline() && fits.num_elements() == 23);
+
+        // Appending grows in place, and works from inside the string.
+        sgl::String s("ab");
+        for (int i = 0; i < 10; ++i) {
+            s += s;
+        }
+        s.append('!');
+        sgl_expect(s.num_elements() == 2049 && s[2047] == 'b' && s[2048] == '!' && s.str()[2049] == 0);
+        sgl_expect(s.capacity() < 4096 + 64);
+        sgl::String tail("xyz");
+        tail.append(tail.str() + 1, 2);
+        sgl_expect(tail == "xyzyz");
+        tail = tail.str() + 2;
+        sgl_expect(tail == "zyz" && tail != "zy");
+
+        // Moves of inline strings copy; moves of heap strings steal.
+        sgl::String moved_small = std::move(fits);
+        sgl::String moved_big = std::move(s);
+        sgl_expect(moved_small == "exactly 23 characters!!" && fits == "");
+        sgl_expect(moved_big.num_elements() == 2049 && s.num_elements() == 0);
+
+        // The hash follows the characters.
+        sgl::String h("hash me");
+        const uint64_t before = h.hash();
+        h += " more";
+        sgl_expect(h.hash() != before && h.hash() == sgl::String("hash me more").hash());
+        (void)before;
+
+        sgl::StringBuilder b;
+        b.append("user ").append(sgl::String("bob")).append(' ');
+        b.appendf("logged in after %d tries", 3);
+        sgl::String line = b.to_string();
+        sgl_expect(line == "user bob logged in after 3 tries");
+        b.clear();
+        for (int i = 0; i < 1000; ++i) {
+            b.appendf("%d,", i);
+        }
+        char big[300];
+        memset(big, 'x', sizeof(big) - 1);
+        big[sizeof(big) - 1] = 0;
+        b.appendf("%s", big);
+        sgl::String csv = b.to_string();
+        sgl_expect(csv.num_elements() == b.num_elements() && !strncmp(csv.str(), "0,1,2,", 6));
+        sgl_expect(csv[csv.num_elements() - 300] == ',' && csv[csv.num_elements() - 1] == 'x');
+        printf("SSO: %zu bytes per String, built %zu chars: %s\n",
+               sizeof(sgl::String), csv.num_elements(), line.str());
+    }
+    {
+        // Headers parsed in place; nothing is copied until the Dict keeps a key.
+        const char* request =
+            "GET /index.html HTTP/1.1\r\n"
+            "Host: example.com\r\n"
+            "Content-Length:   42  \r\n"
+            "Accept: text/html, application/xhtml+xml,,*/*\r\n"
+            "\r\n";
+        sgl::StringView rest(request);
+        sgl::Dict<sgl::String> headers;
+        int lines = 0;
+        for (sgl::StringView line : rest.split('\n')) {
+            line = line.trim_right();
+            if (lines++ == 0 || line.empty()) {
+                continue;
+            }
+            const size_t colon = line.find(':');
+            sgl_expect(colon != sgl::StringView::not_found);
+            headers.insert(line.substr(0, colon), sgl::String(line.substr(colon + 1).trim()));
+        }
+        sgl_expect(lines == 6 && headers.num_elements() == 3);
+        sgl_expect(headers.find(sgl::StringView("Content-Length")).value() == "42");
+        sgl_expect(headers.contains("Host") && !headers.contains(sgl::StringView("Hostname", 5)));
+        int accepted = 0;
+        const sgl::String accept = headers.find("Accept").value();
+        for (sgl::StringView type : sgl::StringView(accept).tokens(", ")) {
+            accepted += type == "text/html" || type == "application/xhtml+xml" || type == "*/*";
+        }
+        sgl_expect(accepted == 3);
+        // find() refers into the table.
+        headers.find("Host").value() = "localhost";
+        const sgl::Dict<sgl::String>& const_headers = headers;
+        (void)const_headers;
+        sgl_expect(const_headers.find("Host").ptr() == headers.find("Host").ptr());
+        sgl_expect(const_headers.find("Host").value() == "localhost");
+
+        // Every alignment and length against the scalar answer.
+        char hay[100];
+        for (size_t i = 0; i < sizeof(hay); ++i) {
+            hay[i] = (char)('a' + i % 7);
+        }
+        int checked = 0;
+        for (size_t from = 0; from < 40; ++from) {
+            for (size_t len = 0; from + len <= sizeof(hay); len += 3) {
+                const sgl::StringView view(hay + from, len);
+                char terminated[sizeof(hay) + 1];
+                memcpy(terminated, view.ptr(), len);
+                terminated[len] = '\0';
+                for (char c = 'a'; c < 'j'; ++c) {
+                    const char* p = (const char*)memchr(view.ptr(), c, len);
+                    const size_t expected = p ? (size_t)(p - view.ptr()) : sgl::StringView::not_found;
+                    sgl_expect(view.find(c) == expected);
+                    (void)expected;
+                    ++checked;
+                }
+                static const char* needles[] = { "gab", "cdefgabc", "fgx", "0123456789abcdefg" };
+                for (const char* needle : needles) {
+                    const size_t m = strlen(needle);
+                    size_t expected = sgl::StringView::not_found;
+                    for (size_t i = 0; i + m <= len; ++i) {
+                        if (!memcmp(view.ptr() + i, needle, m)) {
+                            expected = i;
+                            break;
+                        }
+                    }
+                    sgl_expect(view.find(needle) == expected);
+                    (void)expected;
+                    const size_t any = strcspn(terminated, needle);
+                    sgl_expect(view.find_first_of(needle) == (any < len ? any : sgl::StringView::not_found));
+                    (void)any;
+                    ++checked;
+                }
+            }
+        }
+        sgl::StringView long_view(hay, sizeof(hay));
+        sgl_expect(long_view.find("gabcdefg") == 6 && long_view.find("gabcdefg", 7) == 13);
+        sgl_expect(long_view.find("gabx") == sgl::StringView::not_found);
+        sgl_expect(long_view.find("") == 0 && long_view.find_first_of("xyzfg") == 5);
+        sgl_expect(long_view.find_first_of("0123456789!g") == 6);
+        sgl_expect(long_view.starts_with("abc") && long_view.ends_with(sgl::StringView(hay + 95, 5)));
+        sgl_expect(sgl::StringView("  \t x y \n").trim() == "x y");
+
+        int fields = 0;
+        for (sgl::StringView f : sgl::StringView("a,,b,").split(',')) {
+            fields += f.empty() ? 10 : 1;
+        }
+        for (sgl::StringView f : sgl::StringView("").split(',')) {
+            fields += f.empty() ? 100 : 0;
+        }
+        for (sgl::StringView f : sgl::StringView(" ,, ").tokens(", ")) {
+            fields += 1000 + (int)f.num_elements();
+        }
+        sgl_expect(fields == 122);
+        printf("StringView: %d headers lines, %d finds checked, fields %d\n", lines, checked, fields);
+    }
     {
         sgl::Dict<int> dict;
         sgl::String key = sgl::String("hola dict");
@@ -181,11 +646,13 @@ int main()
         dict.print_debug_info();
         dict.insert(sgl::String("9"), 9);
         dict.print_debug_info();
-        printf("\t\tEXPECTING AN ERROR HERE:\n");
-        dict.insert(sgl::String("9"), 10);
+        // A duplicate insert fails and leaves the old value.
+        const bool inserted = dict.insert(sgl::String("9"), 10);
+        sgl_expect(!inserted && dict.find(sgl::String("9")).value() == 9);
+        (void)inserted;
         for (int i = 1; i <= 10; ++i) {
-            char *str = (char*)malloc(2);
-            memset(str, 0, 2);
+            char *str = (char*)malloc(3);
+            memset(str, 0, 3);
             sprintf(str, "%d", i);
             if (i < 10) {
                 sgl_expect(dict.find(sgl::String(str)).valid());
@@ -196,6 +663,969 @@ int main()
             free(str);
         }
     }
+    {
+        const int n = 20000;
+        char key[32];
+        sgl::Dict<int> dict;
+        for (int i = 0; i < n; ++i) {
+            snprintf(key, sizeof(key), "key %d", i);
+            dict.insert(sgl::String(key), i);
+        }
+        sgl_expect(dict.num_elements() == (size_t)n);
+        sgl_expect((dict.capacity() & (dict.capacity() - 1)) == 0);
+        sgl_expect(dict.num_elements() <= dict.capacity() - dict.capacity() / 8);
+        int found = 0;
+        int missing = 0;
+        for (int i = 0; i < 2 * n; ++i) {
+            snprintf(key, sizeof(key), "key %d", i);
+            sgl::Maybe<int> m = dict.find(sgl::String(key));
+            if (m.valid()) {
+                found += m.value() == i;
+            } else {
+                missing += i >= n;
+            }
+        }
+        sgl_expect(found == n && missing == n);
+        sgl::Dict<int> copy = dict;
+        sgl::Dict<int> moved = std::move(dict);
+        sgl_expect(copy.find(sgl::String("key 123")).value() == 123);
+        sgl_expect(moved.find(sgl::String("key 123")).value() == 123);
+        sgl_expect(dict.num_elements() == 0);
+        printf("Dict: %d found, %d missing\n", found, missing);
+    }
+    {
+        // "bC" and "cb" have the same djb2 hash, which Dict used to use.
+        sgl_expect(sgl::djb2((char*)"bC") == sgl::djb2((char*)"cb"));
+        // Inserts and erases stay out of sgl_expect, which is empty in release builds.
+        sgl::Dict<int> dict;
+        const bool inserted = dict.insert(sgl::String("bC"), 1) && dict.insert(sgl::String("cb"), 2);
+        sgl_expect(inserted);
+        sgl_expect(dict.find(sgl::String("bC")).value() == 1);
+        sgl_expect(dict.find(sgl::String("cb")).value() == 2);
+        const bool erased = dict.erase(sgl::String("bC"));
+        sgl_expect(erased);
+        sgl_expect(!dict.contains(sgl::String("bC")) && dict.contains(sgl::String("cb")));
+        dict.insert_or_assign(sgl::String("cb"), 3);
+        dict.insert_or_assign(sgl::String("bC"), 4);
+        sgl_expect(dict.find(sgl::String("cb")).value() == 3);
+        sgl_expect(dict.find(sgl::String("bC")).value() == 4);
+        const bool erased_missing = dict.erase(sgl::String("nope"));
+        sgl_expect(!erased_missing && dict.num_elements() == 2);
+        (void)inserted; (void)erased; (void)erased_missing;
+    }
+    {
+        // Churn: erase and re-insert many times, capacity must not creep.
+        char key[32];
+        sgl::Dict<int> dict;
+        dict.reserve(1000);
+        const size_t capacity = dict.capacity();
+        for (int i = 0; i < 1000; ++i) {
+            snprintf(key, sizeof(key), "churn %d", i);
+            dict.insert(sgl::String(key), i);
+        }
+        sgl_expect(dict.capacity() == capacity);
+        for (int round = 0; round < 20; ++round) {
+            for (int i = round; i < 1000; i += 3) {
+                snprintf(key, sizeof(key), "churn %d", i);
+                dict.erase(sgl::String(key));
+            }
+            for (int i = round; i < 1000; i += 3) {
+                snprintf(key, sizeof(key), "churn %d", i);
+                dict.insert(sgl::String(key), i + round);
+            }
+        }
+        int ok = 0;
+        for (int i = 0; i < 1000; ++i) {
+            snprintf(key, sizeof(key), "churn %d", i);
+            ok += dict.contains(sgl::String(key));
+        }
+        sgl_expect(ok == 1000 && dict.num_elements() == 1000 && dict.capacity() == capacity);
+        printf("Dict churn: %d keys, capacity %zu\n", ok, capacity);
+    }
+    {
+        // Integer and pointer keys, no Strings involved.
+        // Inserts and erases stay out of sgl_expect, which is empty in release builds.
+        sgl::HashMap<uint64_t, int> ids;
+        size_t changed = 0;
+        for (uint64_t i = 0; i < 5000; ++i) {
+            changed += ids.insert(i * 0x10000, (int)i);
+        }
+        const bool duplicate = ids.insert(0, 7);
+        sgl_expect(changed == 5000 && !duplicate && ids.find(0).value() == 0);
+        changed = 0;
+        for (uint64_t i = 0; i < 5000; i += 2) {
+            changed += ids.erase(i * 0x10000);
+        }
+        sgl_expect(changed == 2500);
+        (void)duplicate;
+        int64_t sum = 0;
+        size_t visited = 0;
+        for (auto& e : ids) {
+            sgl_expect(e.key == (uint64_t)e.value * 0x10000 && (e.value & 1));
+            sum += e.value;
+            ++visited;
+        }
+        sgl_expect(visited == 2500 && ids.num_elements() == 2500 && !ids.contains(2 * 0x10000));
+
+        int objects[8];
+        sgl::HashSet<int*> set;
+        for (int i = 0; i < 8; ++i) {
+            set.insert(&objects[i]);
+        }
+        const bool reinserted = set.insert(&objects[3]);
+        sgl_expect(!reinserted && set.contains(&objects[7]) && set.num_elements() == 8);
+        (void)reinserted;
+        set.erase(&objects[3]);
+        sgl_expect(!set.contains(&objects[3]));
+        set.clear();
+        sgl_expect(set.num_elements() == 0 && !set.contains(&objects[0]));
+
+        // String keys can be looked up without building a String.
+        sgl::Dict<int> dict;
+        dict.insert("literal", 1);
+        sgl::HashSet<sgl::String> names;
+        names.insert(sgl::String("alice"));
+        sgl_expect(dict.contains("literal") && dict.find(sgl::String("literal")).value() == 1);
+        sgl_expect(names.contains("alice") && !names.contains("bob"));
+
+        // Inserting a value that lives in the table while it grows.
+        sgl::HashMap<int, sgl::String> self;
+        self.insert(0, sgl::String("zero"));
+        for (int i = 1; i < 100; ++i) {
+            self.insert(i, self.begin()->value);
+        }
+        int zeros = 0;
+        for (const auto& e : self) {
+            zeros += e.value == "zero";
+        }
+        sgl_expect(zeros == 100);
+        printf("HashMap: %zu ids, sum %" PRId64 ", %d zeros\n", visited, sum, zeros);
+    }
+    {
+        // Every key collides. Still correct, only slower.
+        struct BadHash {
+            uint64_t operator()(int) const { return 42; }
+        };
+        sgl::HashMap<int, int, BadHash> map;
+        for (int i = 0; i < 300; ++i) {
+            map.insert(i, i * 2);
+        }
+        for (int i = 0; i < 300; i += 3) {
+            map.erase(i);
+        }
+        int ok = 0;
+        for (int i = 0; i < 300; ++i) {
+            sgl::Maybe<int> m = map.find(i);
+            ok += (i % 3 == 0) ? !m.valid() : (m.valid() && m.value() == i * 2);
+        }
+        sgl_expect(ok == 300 && map.num_elements() == 200);
+        printf("Colliding keys: %d ok\n", ok);
+    }
+    {
+        sgl::Interner interner;
+        const sgl::Symbol get = interner.intern("GET");
+        const sgl::Symbol post = interner.intern(sgl::String("POST"));
+        char buffer[] = "xGETx";
+        const sgl::Symbol again = interner.intern(sgl::StringView(buffer + 1, 3));
+        sgl_expect(again == get && get != post);
+        (void)again;
+        sgl_expect(get.id == 1 && post.id == 2 && interner.num_symbols() == 2);
+        sgl_expect(interner.str(post) == "POST" && !strcmp(interner.str(get).ptr(), "GET"));
+        sgl_expect(interner.find("PUT") == sgl::Symbol() && !interner.find("PUT").valid());
+        sgl_expect(interner.find("POST") == post);
+
+        // Views stay put while the interner grows.
+        const char* get_chars = interner.str(get).ptr();
+        char name[32];
+        sgl::HashMap<sgl::Symbol, int> counts;
+        for (int i = 0; i < 20000; ++i) {
+            snprintf(name, sizeof(name), "identifier_%d", i & 1023);
+            const sgl::Symbol s = interner.intern(name);
+            if (!counts.insert(s, 1)) {
+                counts.insert_or_assign(s, counts.find(s).value() + 1);
+            }
+        }
+        sgl_expect(interner.num_symbols() == 1026 && counts.num_elements() == 1024);
+        sgl_expect(interner.str(get).ptr() == get_chars);
+        const sgl::Symbol last = interner.find("identifier_1023");
+        sgl_expect(last.id == 1026 && counts.find(last).value() == 19);
+        (void)post;
+        (void)buffer;
+        (void)get_chars;
+        printf("Interner: %zu symbols, %s\n", interner.num_symbols(), interner.str(last).ptr());
+    }
+    {
+        // Every length goes through a different path of hash_bytes.
+        char bytes[200];
+        for (size_t i = 0; i < sizeof(bytes); ++i) {
+            bytes[i] = (char)(i * 7);
+        }
+        sgl::Dict<int> seen(sizeof(bytes));
+        int distinct = 0;
+        for (size_t len = 0; len < sizeof(bytes); ++len) {
+            const uint64_t h = sgl::hash_bytes(bytes, len);
+            sgl_expect(h == sgl::hash_bytes(bytes, len, 0));
+            sgl_expect(h != sgl::hash_bytes(bytes, len, 1));
+            char name[32];
+            snprintf(name, sizeof(name), "%" PRIx64, h);
+            distinct += seen.insert(sgl::String(name), 0);
+        }
+        sgl_expect(distinct == (int)sizeof(bytes));
+        // Flipping any one bit of the input changes the hash.
+        const uint64_t h = sgl::hash_bytes(bytes, 100);
+        for (size_t bit = 0; bit < 800; ++bit) {
+            bytes[bit / 8] = (char)(bytes[bit / 8] ^ (1 << (bit & 7)));
+            sgl_expect(sgl::hash_bytes(bytes, 100) != h);
+            bytes[bit / 8] = (char)(bytes[bit / 8] ^ (1 << (bit & 7)));
+        }
+        sgl_expect(sgl::hash_u64(1) != sgl::hash_u64(2) && sgl::hash_u64(1, 1) != sgl::hash_u64(1));
+
+        // Field boundaries matter to Hasher.
+        const uint64_t ab_c = sgl::Hasher().add("ab", 2).add("c", 1).finish();
+        const uint64_t a_bc = sgl::Hasher().add("a", 1).add("bc", 2).finish();
+        const uint64_t xy = sgl::Hasher(7).add_u64(1).add_u64(2).finish();
+        const uint64_t yx = sgl::Hasher(7).add_u64(2).add_u64(1).finish();
+        sgl_expect(ab_c != a_bc && xy != yx);
+
+        // Strings cache their hash on request; copies carry it along.
+        sgl::String s("a key that is long enough to be worth remembering the hash of");
+        const uint64_t sh = s.hash();
+        sgl_expect(sh == sgl::hash_bytes(s.str(), s.num_elements(), sgl::hash_seed()));
+        sgl_expect(s.cache_hash() == sh && s.hash() == sh);
+        sgl::String copy = s;
+        sgl_expect(copy.hash() == sh);
+        copy = sgl::String("something else");
+        sgl_expect(copy.hash() != sh);
+        s += "!";
+        sgl_expect(s.hash() != sh);
+        printf("Hashing: %d distinct lengths, %" PRIx64 "\n", distinct, h ^ ab_c ^ a_bc ^ xy ^ yx ^ sh);
+    }
+    {
+        sgl_expect(sgl::parse<int64_t>("-42").value() == -42);
+        sgl_expect(sgl::parse<int64_t>("+7").value() == 7);
+        sgl_expect(sgl::parse<int64_t>("9223372036854775807").value() == INT64_MAX);
+        sgl_expect(sgl::parse<int64_t>("-9223372036854775808").value() == INT64_MIN);
+        sgl_expect(!sgl::parse<int64_t>("9223372036854775808").valid());
+        sgl_expect(sgl::parse<uint64_t>("18446744073709551615").value() == UINT64_MAX);
+        sgl_expect(!sgl::parse<uint64_t>("18446744073709551616").valid());
+        sgl_expect(!sgl::parse<uint64_t>("-1").valid());
+        sgl_expect(!sgl::parse<int32_t>("2147483648").valid() && sgl::parse<int32_t>("-2147483648").valid());
+        const char* bad[] = { "", "-", "+", " 1", "1 ", "1x", "0x10", "--1" };
+        for (const char* b : bad) {
+            sgl_expect(!sgl::parse<int64_t>(b).valid());
+            (void)b;
+        }
+
+        sgl_expect(sgl::parse<double>("0.1").value() == 0.1);
+        sgl_expect(sgl::parse<double>("-1.5e-7").value() == -1.5e-7);
+        sgl_expect(sgl::parse<double>("1e23").value() == 1e23);
+        sgl_expect(sgl::parse<double>("2.2250738585072014e-308").value() == 2.2250738585072014e-308);
+        sgl_expect(sgl::parse<double>("-inf").value() == -std::numeric_limits<double>::infinity());
+        sgl_expect(std::isnan(sgl::parse<double>("nan").value()));
+        sgl_expect(!sgl::parse<double>(".").valid() && !sgl::parse<double>("1e").valid());
+        sgl_expect(!sgl::parse<double>("1,5").valid() && !sgl::parse<double>("").valid());
+
+        // Long inputs stay on the stack: 1, then 900 zeros, a 1, and e-901.
+        char long_number[1000];
+        memset(long_number, '0', sizeof(long_number));
+        long_number[0] = '1';
+        long_number[901] = '1';
+        memcpy(long_number + 902, "e-901", 5);
+        sgl_expect(sgl::parse<double>(sgl::StringView(long_number, 907)).value() == 1.0);
+        long_number[0] = '0';
+        long_number[1] = '.';
+        memcpy(long_number + 902, "e+900", 5);  // 0.000...01e+900
+        sgl_expect(sgl::parse<double>(sgl::StringView(long_number, 907)).value() == 1.0);
+
+        // 1 + 2^-53 is halfway between 1 and the next double; a nonzero
+        // digit 900 places further on breaks the tie upwards.
+        const char* half = "1.00000000000000011102230246251565404236316680908203125";
+        memset(long_number, '0', sizeof(long_number));
+        memcpy(long_number, half, strlen(half));
+        sgl_expect(sgl::parse<double>(sgl::StringView(long_number, 950)).value() == 1.0);
+        long_number[950] = '1';
+        sgl_expect(sgl::parse<double>(sgl::StringView(long_number, 951)).value() == 1.0000000000000002);
+
+        // 1 + 2^-24 is halfway between two floats. Via double, anything a
+        // hair above it would round twice, down to 1.
+        sgl_expect(sgl::parse<float>("1.0000000596046447753906251").value() == 1.00000012f);
+        sgl_expect(sgl::parse<float>("1.000000059604644775390625").value() == 1.0f);
+        sgl_expect(sgl::parse<float>("1.0000000596046447753906249").value() == 1.0f);
+        sgl_expect(sgl::parse<float>("0.1").value() == 0.1f && sgl::parse<float>("-2.5e3").value() == -2500.0f);
+
+        char buffer[sgl::format_buffer_size];
+        sgl_expect(sgl::format(0, buffer) == 1 && !strcmp(buffer, "0"));
+        sgl_expect(sgl::format(INT64_MIN, buffer) == 20 && !strcmp(buffer, "-9223372036854775808"));
+        sgl_expect(sgl::format(UINT64_MAX, buffer) == 20 && !strcmp(buffer, "18446744073709551615"));
+        sgl_expect(sgl::format(0.1, buffer) == 3 && !strcmp(buffer, "0.1"));
+        sgl_expect(sgl::format(1e300, buffer) && !strcmp(buffer, "1e+300"));
+        sgl_expect(sgl::format(5e-324, buffer) && !strcmp(buffer, "5e-324"));
+        sgl_expect(sgl::format(-2.5, buffer) && !strcmp(buffer, "-2.5"));
+        sgl_expect(sgl::format(1e15, buffer) && !strcmp(buffer, "1000000000000000"));
+
+        // Every double comes back bit for bit, in no more digits than %.17g.
+        uint64_t state = 0x9e3779b97f4a7c15ull;
+        int round_trips = 0;
+        for (int i = 0; i < 100000; ++i) {
+            state = state * 6364136223846793005ull + 1442695040888963407ull;
+            double d;
+            memcpy(&d, &state, sizeof(d));
+            if (std::isnan(d)) {
+                continue;
+            }
+            const size_t len = sgl::format(d, buffer);
+            const double back = sgl::parse<double>(sgl::StringView(buffer, len)).value();
+            char reference[64];
+            snprintf(reference, sizeof(reference), "%.17g", d);
+            sgl_expect(!memcmp(&back, &d, sizeof(d)) && strtod(buffer, NULL) == d);
+            sgl_expect(len <= strlen(reference) + 1);
+            round_trips += !memcmp(&back, &d, sizeof(d));
+        }
+
+        // Floats in the shortest form for a float, not for its double.
+        sgl_expect(sgl::format(0.1f, buffer) == 3 && !strcmp(buffer, "0.1"));
+        sgl_expect(sgl::format(1e-45f, buffer) && !strcmp(buffer, "1e-45"));
+        sgl_expect(sgl::format(std::numeric_limits<float>::max(), buffer) && !strcmp(buffer, "3.4028235e+38"));
+        sgl_expect(sgl::format(16777216.0f, buffer) && !strcmp(buffer, "16777216"));
+        sgl_expect(sgl::format(-1.17549435e-38f, buffer) && !strcmp(buffer, "-1.1754944e-38"));
+        for (int i = 0; i < 100000; ++i) {
+            state = state * 6364136223846793005ull + 1442695040888963407ull;
+            const uint32_t bits = (uint32_t)(state >> 32);
+            float f;
+            memcpy(&f, &bits, sizeof(f));
+            if (std::isnan(f)) {
+                continue;
+            }
+            const size_t len = sgl::format(f, buffer);
+            const float back = sgl::parse<float>(sgl::StringView(buffer, len)).value();
+            sgl_expect(!memcmp(&back, &f, sizeof(f)) && strtof(buffer, NULL) == f);
+            round_trips += !memcmp(&back, &f, sizeof(f));
+            // No more significant digits than the fewest that read back.
+            int fewest = 1;
+            char reference[64];
+            for (; fewest < 9; ++fewest) {
+                snprintf(reference, sizeof(reference), "%.*e", fewest - 1, (double)f);
+                if (strtof(reference, NULL) == f) break;
+            }
+            const char* first = buffer + strspn(buffer, "-0.");
+            const char* last = first + strcspn(first, "e");
+            while (last > first && (last[-1] == '0' || last[-1] == '.')) --last;
+            int digits = 0;
+            for (const char* c = first; c < last; ++c) digits += *c != '.';
+            sgl_expect(digits <= fewest);
+        }
+
+        sgl::String s("x = ");
+        sgl::format(-17, &s);
+        s += ", y = ";
+        sgl::format(0.25f, &s);
+        sgl_expect(s == "x = -17, y = 0.25");
+        printf("Numbers: %d round trips, %s\n", round_trips, s.str());
+    }
+
+    {
+        sgl::ThreadPool pool;
+        sgl_expect(pool.num_threads() >= 1);
+        std::atomic<int> sum(0);
+        {
+            sgl::TaskGroup group(&pool);
+            for (int i = 1; i <= 1000; ++i) {
+                group.run([&sum, i]{ sum += i; });
+            }
+            group.wait();
+            sgl_expect(sum == 500500);
+        }
+
+        // Tasks that spawn tasks and wait on them from inside the pool.
+        struct Fib {
+            static int run(sgl::ThreadPool* p, int n) {
+                if (n < 12) {
+                    return n < 2 ? n : run(p, n - 1) + run(p, n - 2);
+                }
+                int a = 0;
+                sgl::TaskGroup group(p);
+                group.run([p, n, &a]{ a = run(p, n - 1); });
+                const int b = run(p, n - 2);
+                group.wait();
+                return a + b;
+            }
+        };
+        int fib = 0;
+        {
+            sgl::TaskGroup group(&pool);
+            group.run([&pool, &fib]{ fib = Fib::run(&pool, 25); });
+        }  // Waits.
+        sgl_expect(fib == 75025);
+
+        sgl::ThreadPool small(2);
+        sgl::TaskGroup group(&small);
+        std::atomic<int> count(0);
+        for (int i = 0; i < 100; ++i) {
+            group.run([&count, &group]{
+                group.run([&count]{ ++count; });
+                ++count;
+            });
+        }
+        group.wait();
+        sgl_expect(count == 200);
+        printf("Threads: %zu workers, fib(25) = %d\n", pool.num_threads(), fib);
+    }
+    {
+        const size_t n = 1000003;  // Not a multiple of anything.
+        sgl::ThreadPool pool(3);
+        sgl::Array<int64_t> values;
+        values.resize_for_overwrite(n);
+        sgl::parallel_for(0, n, [&values](size_t lo, size_t hi) {
+            for (size_t i = lo; i < hi; ++i) values[i] = (int64_t)i;
+        }, 0, &pool);
+        sgl::parallel_for_each(values, [](int64_t& x) { x *= 3; }, 1000, &pool);
+        sgl_expect(values[n - 1] == 3 * (int64_t)(n - 1));
+
+        const int64_t sum = sgl::parallel_reduce(values, int64_t(0),
+                                                 [](int64_t a, int64_t b) { return a + b; },
+                                                 0, &pool);
+        sgl_expect(sum == 3 * (int64_t)n * (int64_t)(n - 1) / 2);
+        // Chunks are combined in order, so a non-commutative op works.
+        const size_t first = sgl::parallel_reduce(size_t(5), n, n,
+                                                  [](size_t lo, size_t) { return lo; },
+                                                  [n](size_t a, size_t b) { return a == n ? b : a; },
+                                                  5000, &pool);
+        sgl_expect(first == 5);
+        (void)first;
+
+        sgl::Array<double> halves;
+        sgl::parallel_transform(values, &halves, [](int64_t x) { return (double)x / 2; }, 0, &pool);
+        sgl_expect(halves.num_elements() == n && halves[n - 1] == 1.5 * (double)(n - 1));
+        sgl::Array<sgl::String> names;
+        sgl::Array<int> small = { 1, 2, 3 };
+        sgl::parallel_transform(small, &names, [](int x) {
+            sgl::String s;
+            sgl::format(x, &s);
+            return s;
+        });
+        sgl_expect(names.num_elements() == 3 && names[2] == "3");
+
+        sgl::Array<int64_t> ones;
+        ones.resize(n, 1);
+        sgl::Array<int64_t> prefix;
+        sgl::parallel_inclusive_scan(ones, &prefix, [](int64_t a, int64_t b) { return a + b; }, 777, &pool);
+        bool scanned = prefix.num_elements() == n;
+        for (size_t i = 0; i < n && scanned; ++i) {
+            scanned = prefix[i] == (int64_t)i + 1;
+        }
+        sgl_expect(scanned);
+        sgl::parallel_inclusive_scan(ones, &ones, [](int64_t a, int64_t b) { return a + b; }, 0, &pool);
+        sgl_expect(ones[n - 1] == (int64_t)n && ones[4095] == 4096);
+        printf("Parallel: sum %" PRId64 ", prefix %" PRId64 "\n", sum, prefix[n - 1]);
+    }
+    {
+        // Every chunk after the first starts on a cache line, also with the
+        // default grain and a misaligned start.
+        sgl::Array<int> ints;
+        ints.resize(1000003, 0);
+        const size_t line = sgl::compile_time_cache_line_size;
+        bool aligned = true;
+        for (size_t offset = 0; offset < 3; ++offset) {
+            const int* start = ints.ptr() + offset;
+            const size_t count = ints.num_elements() - offset;
+            for (size_t grain = 0; grain <= 1000; grain += 1000) {
+                const sgl::detail::ChunkLayout layout = sgl::detail::aligned_layout(start, count, grain, 3);
+                aligned = aligned && layout.count > 1;
+                for (size_t k = 1; k < layout.count; ++k) {
+                    aligned = aligned && (uintptr_t)(start + layout.lo(k)) % line == 0;
+                }
+            }
+        }
+        sgl_expect(aligned);
+    }
+
+    {
+        sgl::SpscQueue<Tracked> spsc(3);
+        sgl_expect(spsc.capacity() == 4);
+        // Pushes and pops stay out of sgl_expect, which is empty in release builds.
+        int pushed = 0;
+        for (int i = 0; i < 4; ++i) {
+            pushed += spsc.try_emplace(i);
+        }
+        bool full = !spsc.try_push(Tracked(4));
+        sgl_expect(pushed == 4 && full && spsc.num_elements() == 4);
+        sgl::Maybe<Tracked> front = spsc.try_pop();
+        sgl_expect(front.value().value == 0);
+        const bool wrapped = spsc.try_push(Tracked(4));  // Wraps around.
+        sgl_expect(wrapped);
+        sgl::Array<Tracked> out;
+        out.resize(8, Tracked(-1));
+        size_t n = spsc.try_pop(out.ptr(), 8);
+        sgl_expect(n == 4 && out[3].value == 4);
+        const bool empty = !spsc.try_pop().valid();
+        sgl_expect(empty);
+        n = spsc.try_push(out.ptr(), 8);
+        sgl_expect(n == 4);
+        sgl::MpmcQueue<sgl::String> mpmc(4);
+        pushed = mpmc.try_push(sgl::String("a")) + mpmc.try_push(sgl::String("b"));
+        sgl_expect(pushed == 2);
+        sgl::Maybe<sgl::String> first = mpmc.try_pop();
+        sgl_expect(first.value() == "a");
+        const sgl::String more[] = { sgl::String("c"), sgl::String("d"), sgl::String("e"), sgl::String("f") };
+        n = mpmc.try_push(more, 4);
+        sgl_expect(n == 3 && mpmc.num_elements() == 4);
+        sgl::String popped[4];
+        n = mpmc.try_pop(popped, 4);
+        sgl_expect(n == 4 && popped[0] == "b" && popped[3] == "e");
+        full = !mpmc.try_push(sgl::String("g"));  // Left in the queue.
+        sgl_expect(!full && mpmc.num_elements() == 1);
+        (void)full; (void)wrapped; (void)empty; (void)n;
+    }
+    sgl_expect(Tracked::live == 0);
+    {
+        // Producers push their ids tagged with the producer; consumers
+        // check that each producer's values arrive in order.
+        const int producers = 3, consumers = 3;
+        const int64_t per_producer = 20000;
+        sgl::MpmcQueue<int64_t> queue(256);
+        std::atomic<int64_t> total(0);
+        std::atomic<int> ordered(1);
+        sgl::Array<std::thread*> threads;
+        for (int p = 0; p < producers; ++p) {
+            threads.push_back(new std::thread([&queue, p, per_producer]{
+                int64_t batch[16];
+                for (int64_t i = 0; i < per_producer;) {
+                    int64_t n = 0;
+                    for (; n < 16 && i + n < per_producer; ++n) batch[n] = (int64_t)p << 32 | (i + n);
+                    const size_t pushed = queue.try_push(batch, (size_t)n);
+                    if (!pushed) std::this_thread::yield();
+                    i += (int64_t)pushed;
+                }
+            }));
+        }
+        for (int c = 0; c < consumers; ++c) {
+            threads.push_back(new std::thread([&queue, &total, &ordered, per_producer]{
+                int64_t last[producers] = { -1, -1, -1 };
+                while (total.load() < producers * per_producer) {
+                    sgl::Maybe<int64_t> m = queue.try_pop();
+                    if (!m.valid()) {
+                        std::this_thread::yield();
+                        continue;
+                    }
+                    const int64_t p = m.value() >> 32, i = m.value() & 0xffffffff;
+                    if (i <= last[p]) ordered = 0;
+                    last[p] = i;
+                    ++total;
+                }
+            }));
+        }
+        for (std::thread* t : threads) {
+            t->join();
+            delete t;
+        }
+        sgl_expect(total == producers * per_producer && ordered);
+
+        sgl::SpscQueue<int64_t> spsc(64);
+        int64_t sum = 0;
+        std::thread producer([&spsc]{
+            for (int64_t i = 1; i <= 100000;) {
+                if (spsc.try_push(i)) {
+                    ++i;
+                } else {
+                    std::this_thread::yield();
+                }
+            }
+        });
+        for (int64_t expected = 1; expected <= 100000;) {
+            int64_t buffer[8];
+            const size_t n = spsc.try_pop(buffer, 8);
+            if (!n) std::this_thread::yield();
+            for (size_t k = 0; k < n; ++k, ++expected) {
+                sgl_expect(buffer[k] == expected);
+                sum += buffer[k];
+            }
+        }
+        producer.join();
+        sgl_expect(sum == 5000050000);
+        printf("Queues: %" PRId64 " values through the MPMC queue\n", total.load());
+    }
+
+    {
+        sgl::ConcurrentDict<int> routes(8);
+        sgl_expect(routes.num_shards() == 8);
+        // Writes stay out of sgl_expect, which is empty in release builds.
+        const bool inserted = routes.insert(sgl::String("/index"), 1);
+        const bool duplicate = routes.insert("/index", 2);
+        sgl_expect(inserted && !duplicate);
+        routes.insert_or_assign("/about", 3);
+        sgl_expect(routes.find("/index").value() == 1 && routes.find(sgl::StringView("/about")).value() == 3);
+        const bool updated = routes.update("/about", [](int& x) { x += 10; });
+        const bool updated_none = routes.update("/none", [](int&) {});
+        sgl_expect(updated && !updated_none);
+        int seen = 0;
+        const bool visited = routes.visit("/about", [&seen](const int& x) { seen = x; });
+        sgl_expect(visited && seen == 13);
+        const bool erased = routes.erase("/index");
+        sgl_expect(erased && !routes.contains("/index") && routes.num_elements() == 1);
+        (void)inserted; (void)duplicate; (void)updated; (void)updated_none; (void)visited; (void)erased;
+
+        // Readers and writers at the same time. Writers own disjoint keys.
+        sgl::ConcurrentHashMap<uint64_t, uint64_t> map(0, 1000);
+        for (uint64_t i = 0; i < 1000; ++i) {
+            map.insert(i, i * 2);
+        }
+        std::atomic<int> bad(0);
+        sgl::Array<std::thread*> threads;
+        for (int t = 0; t < 4; ++t) {
+            threads.push_back(new std::thread([&map, &bad, t]{
+                for (uint64_t i = 0; i < 20000; ++i) {
+                    const uint64_t key = i % 1000;
+                    if (t == 0) {
+                        map.insert_or_assign(1000 + i, i);  // Forces shards to grow.
+                    } else {
+                        const sgl::Maybe<uint64_t> found = map.find(key);
+                        bad += !found.valid() || found.value() != key * 2;
+                    }
+                }
+            }));
+        }
+        for (std::thread* t : threads) {
+            t->join();
+            delete t;
+        }
+        sgl_expect(bad == 0 && map.num_elements() == 21000);
+
+        // Many readers sharing one const key, some with its hash cached.
+        const sgl::String shared("/a/route/long/enough/that/hashing/it/is/not/free");
+        sgl::String cached(shared);
+        cached.cache_hash();
+        routes.insert(shared, 42);
+        sgl::Array<std::thread*> readers;
+        for (int t = 0; t < 4; ++t) {
+            readers.push_back(new std::thread([&routes, &shared, &cached, &bad]{
+                for (int i = 0; i < 10000; ++i) {
+                    bad += !routes.contains(shared) || routes.find(cached).value_or(0) != 42;
+                }
+            }));
+        }
+        for (std::thread* t : readers) {
+            t->join();
+            delete t;
+        }
+        sgl_expect(bad == 0);
+        printf("ConcurrentHashMap: %zu shards, %zu elements\n", map.num_shards(), map.num_elements());
+    }
+
+    {
+        uint64_t state = 7;
+        auto next = [&state]() {
+            state = state * 6364136223846793005ull + 1442695040888963407ull;
+            return state >> 16;
+        };
+        // Random, sorted, reversed, few distinct values, organ pipe.
+        for (int pattern = 0; pattern < 5; ++pattern) {
+            for (size_t n : { (size_t)0, (size_t)1, (size_t)20, (size_t)300, (size_t)20000 }) {
+                sgl::Array<int64_t> a;
+                for (size_t i = 0; i < n; ++i) {
+                    const int64_t x = pattern == 0 ? (int64_t)next() - (1ll << 47)
+                                    : pattern == 1 ? (int64_t)i
+                                    : pattern == 2 ? (int64_t)(n - i)
+                                    : pattern == 3 ? (int64_t)(next() % 4)
+                                    : (int64_t)(i < n / 2 ? i : n - i);
+                    a.push_back(x);
+                }
+                sgl::Array<int64_t> b = a;
+                sgl::Array<int64_t> c = a;
+                sgl::sort(a);
+                sgl::radix_sort(b);
+                sgl::stable_sort(c, [](int64_t x, int64_t y) { return x > y; });
+                bool ok = true;
+                for (size_t i = 0; i < n; ++i) {
+                    ok = ok && b[i] == a[i] && c[i] == a[n - 1 - i] && (i == 0 || a[i - 1] <= a[i]);
+                }
+                sgl_expect(ok);
+            }
+        }
+
+        // Stable: equal keys keep their order.
+        struct Record {
+            uint32_t key;
+            uint32_t order;
+        };
+        sgl::Array<Record> records;
+        for (uint32_t i = 0; i < 5000; ++i) {
+            records.push_back({ (uint32_t)(next() % 50), i });
+        }
+        sgl::Array<Record> by_merge = records;
+        sgl::stable_sort(by_merge, [](const Record& x, const Record& y) { return x.key < y.key; });
+        sgl::radix_sort(records, [](const Record& r) { return r.key; });
+        bool stable = true;
+        for (size_t i = 1; i < records.num_elements(); ++i) {
+            const Record& p = records[i - 1];
+            const Record& r = records[i];
+            stable = stable && (p.key < r.key || (p.key == r.key && p.order < r.order));
+            stable = stable && by_merge[i].key == r.key && by_merge[i].order == r.order;
+        }
+        sgl_expect(stable);
+
+        sgl::Array<double> doubles = { 3.5, -0.0, -1e300, 0.0, 2.0, -2.5, 1e-300, -1e-300 };
+        for (int i = 0; i < 300; ++i) {
+            doubles.push_back((double)(int64_t)(next() % 2001) - 1000.5);
+        }
+        sgl::radix_sort(doubles);
+        bool doubles_sorted = doubles[0] == -1e300;
+        for (size_t i = 1; i < doubles.num_elements(); ++i) {
+            doubles_sorted = doubles_sorted && doubles[i - 1] <= doubles[i];
+        }
+        sgl_expect(doubles_sorted);
+
+        sgl::Array<sgl::String> words = { sgl::String("pear"), sgl::String("apple"), sgl::String("fig") };
+        sgl::sort(words);
+        sgl_expect(words[0] == "apple" && words[2] == "pear");
+
+        sgl::Array<int> sorted;
+        for (int i = 0; i < 1000; ++i) {
+            sorted.push_back(i * 2);
+        }
+        sgl::EytzingerArray<int> eytzinger(sorted);
+        bool found = eytzinger.num_elements() == 1000;
+        for (int x = -1; x <= 2000; ++x) {
+            const size_t i = sgl::lower_bound(sorted, x);
+            const int* e = eytzinger.lower_bound(x);
+            found = found && i == (size_t)(x <= 0 ? 0 : (x + 1) / 2);
+            found = found && (i == 1000 ? e == NULL : (e && *e == sorted[i]));
+            found = found && eytzinger.contains(x) == (x >= 0 && x % 2 == 0 && x < 2000);
+        }
+        sgl_expect(found);
+        printf("Sorting: %zu doubles, first %g\n", doubles.num_elements(), doubles[0]);
+    }
+
+    {
+        sgl_expect(!sgl::MappedFile::open("does/not/exist").valid());
+
+        const char* path = "sgl_test_mapped.tmp";
+        FILE* f = fopen(path, "wb");
+        sgl_expect(f);
+        fputs("first\r\nsecond\n\nlast", f);
+        fclose(f);
+        {
+            sgl::Maybe<sgl::MappedFile> file = sgl::MappedFile::open(path, sgl::MappedFile::sequential);
+            sgl_expect(file.valid() && file.value().size() == 19);
+            const char* expected[] = { "first", "second", "", "last" };
+            int n = 0, matches = 0;
+            for (sgl::StringView line : file.value().lines()) {
+                matches += n < 4 && line == expected[n];
+                ++n;
+            }
+            sgl_expect(n == 4 && matches == 4);
+            (void)matches;
+            sgl::MappedFile moved = std::move(file.value());
+            sgl_expect(moved.view().starts_with("first") && file.value().size() == 0);
+        }
+
+        uint32_t ids[100];
+        for (uint32_t i = 0; i < 100; ++i) {
+            ids[i] = i * i;
+        }
+        f = fopen(path, "wb");
+        fwrite(ids, sizeof(ids), 1, f);
+        fputc('x', f);  // Not a whole record.
+        fclose(f);
+        {
+            sgl::Maybe<sgl::MappedFile> file = sgl::MappedFile::open(path, sgl::MappedFile::will_need |
+                                                                           sgl::MappedFile::huge_pages);
+            sgl::ArrayView<uint32_t> records = file.value().records<uint32_t>(8);
+            sgl_expect(records.num_elements() == 98 && records[0] == 4 && records[97] == 99 * 99);
+            (void)records;
+            int lines = 0;
+            for (sgl::StringView line : sgl::StringView("a\nb\n").lines()) {
+                lines += (int)line.num_elements();
+            }
+            sgl_expect(lines == 2);
+        }
+        f = fopen(path, "wb");
+        fclose(f);
+        {
+            sgl::Maybe<sgl::MappedFile> empty = sgl::MappedFile::open(path);
+            sgl_expect(empty.valid() && empty.value().size() == 0 && empty.value().view() == "");
+            sgl_expect(empty.value().lines().begin() == empty.value().lines().end());
+        }
+        remove(path);
+    }
+
+    {
+        const char* path = "sgl_test_writer.tmp";
+        FILE* f = fopen(path, "wb");
+        sgl_expect(f);
+        {
+            sgl::Writer out(f, 64);  // Small, so that most writes cross a flush.
+            out.write("n=").write(-42).write(' ').write((uint64_t)18446744073709551615ull);
+            out.write(' ').write(0.1).write(' ').write(sgl::StringView("view", 2));
+            out.write(' ').write(sgl::String("string")).write(' ').write((const void*)0xbeef);
+            out.writef(" %03d|", 7);
+            for (int i = 0; i < 50; ++i) {
+                out.write(i).write(',');
+            }
+            char zs[100];
+            memset(zs, 'z', sizeof(zs));
+            out.write(zs, sizeof(zs));  // Bigger than the buffer.
+            const bool flushed = out.flush();  // Not inside sgl_expect: that is empty in release builds.
+            sgl_expect(flushed);
+            (void)flushed;
+        }
+        char expected[512];
+        size_t len = (size_t)snprintf(expected, sizeof(expected),
+                                      "n=-42 18446744073709551615 0.1 vi string 0xbeef 007|");
+        for (int i = 0; i < 50; ++i) {
+            len += (size_t)snprintf(expected + len, sizeof(expected) - len, "%d,", i);
+        }
+        memset(expected + len, 'z', 100);
+        len += 100;
+        fclose(f);
+        {
+            sgl::Maybe<sgl::MappedFile> file = sgl::MappedFile::open(path);
+            sgl_expect(file.valid() && file.value().view() == sgl::StringView(expected, len));
+        }
+
+        f = fopen(path, "wb");
+        {
+            sgl::Writer out(f, 256);
+            out.start_background_flush();
+            for (int i = 0; i < 100000; ++i) {
+                out.write(i).write('\n');
+            }
+            const bool flushed = out.flush();
+            sgl_expect(flushed);
+            (void)flushed;
+            out.write("last\n");
+        }
+        fclose(f);
+        {
+            sgl::Maybe<sgl::MappedFile> file = sgl::MappedFile::open(path);
+            int n = 0, matches = 0;
+            for (sgl::StringView line : file.value().lines()) {
+                matches += n < 100000 ? sgl::parse<int>(line).value_or(-1) == n : line == "last";
+                ++n;
+            }
+            sgl_expect(n == 100001 && matches == n);
+            (void)matches;
+        }
+        remove(path);
+    }
+
+    {
+        // dbg() and print_debug_info() share stdout_writer() across threads.
+        sgl::Dict<int> small;
+        small.insert(sgl::String("worker"), 1);
+        sgl::Array<std::thread*> threads;
+        for (int t = 0; t < 4; ++t) {
+            threads.push_back(new std::thread([&small]{
+                for (int i = 0; i < 3; ++i) {
+                    sgl::dbg({sgl::String("dbg"), sgl::String("from a worker\n")});
+                }
+                small.print_debug_info();
+            }));
+        }
+        for (std::thread* t : threads) {
+            t->join();
+            delete t;
+        }
+    }
+
+    {
+        const char* path = "sgl_test_snapshot.tmp";
+        sgl_expect(!sgl::Snapshot::open("does/not/exist").valid());
+
+        sgl::Array<uint64_t> ids;
+        for (uint64_t i = 0; i < 1000; ++i) {
+            ids.push_back(i * 0x9e3779b97f4a7c15ull);
+        }
+        // Saves and loads stay out of sgl_expect, which is empty in release builds.
+        bool ok = sgl::save_snapshot(path, ids);
+        sgl_expect(ok);
+        {
+            sgl::Array<uint64_t> loaded;
+            ok = sgl::load_snapshot(path, &loaded);
+            sgl_expect(ok && loaded.num_elements() == 1000);
+            sgl_expect(memcmp(loaded.ptr(), ids.ptr(), 1000 * sizeof(uint64_t)) == 0);
+            sgl::Maybe<sgl::Snapshot> snapshot = sgl::Snapshot::open(path);
+            sgl_expect(snapshot.valid() && snapshot.value().array<uint64_t>().valid());
+            sgl_expect(snapshot.value().array<uint64_t>().value()[999] == ids[999]);
+            sgl_expect(!snapshot.value().array<uint32_t>().valid());
+            sgl_expect(!snapshot.value().string().valid() && !snapshot.value().dict<int>().valid());
+            sgl::String str;
+            sgl_expect(!sgl::load_snapshot(path, &str));
+        }
+
+        ok = sgl::save_snapshot(path, sgl::String("snapshot of a string"));
+        sgl_expect(ok);
+        {
+            sgl::String loaded;
+            ok = sgl::load_snapshot(path, &loaded);
+            sgl_expect(ok && loaded == "snapshot of a string");
+            sgl::Maybe<sgl::Snapshot> snapshot = sgl::Snapshot::open(path);
+            sgl_expect(snapshot.value().string().value() == "snapshot of a string");
+        }
+
+        sgl::Dict<int> dict;
+        char key[32];
+        for (int i = 0; i < 1000; ++i) {
+            snprintf(key, sizeof(key), "key_%d", i);
+            dict.insert(sgl::String(key), i * 3);
+        }
+        dict.insert(sgl::String(""), -1);
+        ok = sgl::save_snapshot(path, dict);
+        sgl_expect(ok);
+        {
+            sgl::Maybe<sgl::Snapshot> snapshot = sgl::Snapshot::open(path);
+            sgl::Maybe<sgl::FrozenDict<int>> frozen = snapshot.value().dict<int>();
+            sgl_expect(frozen.valid() && frozen.value().num_elements() == 1001);
+            int matches = 0;
+            for (int i = 0; i < 1000; ++i) {
+                snprintf(key, sizeof(key), "key_%d", i);
+                matches += frozen.value().find(key).value_or(-1) == i * 3;
+            }
+            sgl_expect(matches == 1000 && frozen.value().find("").value_or(0) == -1);
+            sgl_expect(!frozen.value().contains("key_1000") && !frozen.value().contains("key"));
+            (void)matches;
+            size_t visited = 0;
+            frozen.value().visit([&visited](sgl::StringView, const int&) { ++visited; });
+            sgl_expect(visited == 1001);
+            (void)visited;
+
+            sgl::Dict<int> loaded;
+            ok = sgl::load_snapshot(path, &loaded);
+            sgl_expect(ok && loaded.num_elements() == 1001);
+            sgl_expect(loaded.find(sgl::String("key_500")).value_or(0) == 1500);
+
+            // Saving over a mapped snapshot leaves the mapping alone.
+            sgl::Dict<int> smaller;
+            smaller.insert(sgl::String("only"), 1);
+            ok = sgl::save_snapshot(path, smaller);
+            sgl_expect(ok);
+            sgl_expect(frozen.value().find("key_999").value_or(-1) == 2997);
+            sgl::Maybe<sgl::Snapshot> replaced = sgl::Snapshot::open(path);
+            sgl_expect(replaced.value().dict<int>().value().num_elements() == 1);
+        }
+
+        // Flip one payload byte: the checksum catches it.
+        FILE* f = fopen(path, "r+b");
+        fseek(f, 200, SEEK_SET);
+        const int c = fgetc(f);
+        fseek(f, 200, SEEK_SET);
+        fputc(c ^ 1, f);
+        fclose(f);
+        sgl_expect(!sgl::Snapshot::open(path).valid());
+        sgl_expect(sgl::Snapshot::open(path, false).valid());
+        sgl::Dict<int> untouched;
+        sgl_expect(!sgl::load_snapshot(path, &untouched) && untouched.num_elements() == 0);
+
+        ok = sgl::save_snapshot(path, sgl::Dict<int>());
+        sgl_expect(ok);
+        {
+            sgl::Maybe<sgl::Snapshot> snapshot = sgl::Snapshot::open(path);
+            sgl::Maybe<sgl::FrozenDict<int>> frozen = snapshot.value().dict<int>();
+            sgl_expect(frozen.valid() && frozen.value().num_elements() == 0 && !frozen.value().contains("a"));
+            (void)frozen;
+        }
+        (void)ok;
+        remove(path);
+    }
 
     printf("Done.\n");
 